@@ -0,0 +1,241 @@
+#
+#Benchmarks for the ruby <-> libpurple boundary, using the offline prpl-loopback.
+#
+#Usage:
+#$ rake bench
+#$ ruby bench/bench.rb [output.json]
+#
+#Set BENCH_QUICK=1 to use smaller sizes, e.g. on a laptop.
+#
+
+require 'json'
+require 'objspace'
+require 'socket'
+require 'tmpdir'
+require File.expand_path(File.join(File.dirname(__FILE__), '../ext/purple_ruby'))
+
+class PurpleRubyBench
+  IPC_IP = "127.0.0.1"
+  IPC_PORT = 9878
+  QUICK = ENV['BENCH_QUICK']
+
+  def initialize
+    @on_im = nil
+    @on_blist = nil
+    @on_ipc = nil
+    @results = {}
+  end
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  #pump the main loop until the block returns true
+  def pump_until timeout = 30
+    deadline = now + timeout
+    until yield
+      raise "benchmark timed out" if now > deadline
+      PurpleRuby.run_one_loop
+    end
+  end
+
+  def login username
+    acc = PurpleRuby.login(PurpleRuby::Loopback::PROTOCOL, username, "")
+    pump_until { acc.connected? }
+    acc
+  end
+
+  def percentile sorted, pct
+    sorted[((sorted.length - 1) * pct / 100.0).round]
+  end
+
+  def setup
+    PurpleRuby::Loopback.enable
+    PurpleRuby.prefs_path = Dir.mktmpdir("purple_ruby_bench")
+    PurpleRuby.init false, PurpleRuby.prefs_path
+
+    PurpleRuby.watch_incoming_im {|acc, sender, message| @on_im.call(acc, sender, message) if @on_im }
+    PurpleRuby.watch_blist_change {|buddy, acc| @on_blist.call(buddy, acc) if @on_blist }
+    PurpleRuby.watch_incoming_ipc(IPC_IP, IPC_PORT) {|data| @on_ipc.call(data) if @on_ipc }
+  end
+
+  def bench_inbound
+    acc = login "inbound"
+    count = 0
+    @on_im = lambda {|a, sender, message| count += 1 }
+
+    duration = QUICK ? 1.0 : 5.0
+    PurpleRuby::Loopback.traffic(acc, 1_000_000)
+    start = now
+    PurpleRuby.run_one_loop while now - start < duration
+    PurpleRuby::Loopback.traffic(acc, 0)
+    elapsed = now - start
+
+    @results[:inbound_im] = {:messages => count, :seconds => elapsed, :per_second => count / elapsed}
+  end
+
+  def bench_latency
+    acc = login "latency"
+    received = nil
+    @on_im = lambda {|a, sender, message| received = message }
+
+    samples = (QUICK ? 1_000 : 10_000).times.collect do |i|
+      received = nil
+      message = "latency #{i}"
+      start = now
+      acc.send_im("peer", message)
+      pump_until { received == message }
+      (now - start) * 1000.0
+    end.sort
+
+    @results[:send_latency_ms] = {
+      :samples => samples.length,
+      :p50 => percentile(samples, 50),
+      :p99 => percentile(samples, 99),
+      :max => samples.last
+    }
+  end
+
+  def bench_ipc
+    n = QUICK ? 1_000 : 10_000
+    count = 0
+    @on_ipc = lambda {|data| count += 1 }
+
+    #the producer has to run outside this process, main loop is not re-entrant
+    pid = fork do
+      n.times do |i|
+        t = TCPSocket.new(IPC_IP, IPC_PORT)
+        t.print "prpl-loopback,peer,message #{i}"
+        t.close
+      end
+      exit!(0)
+    end
+
+    start = now
+    pump_until(120) { count >= n }
+    elapsed = now - start
+    Process.wait(pid)
+
+    @results[:ipc] = {:messages => count, :seconds => elapsed, :per_second => count / elapsed}
+  end
+
+  def bench_allocations
+    acc = login "allocations"
+    n = QUICK ? 10_000 : 100_000
+    @on_im = lambda {|a, sender, message| }
+
+    GC.start
+    allocated = GC.stat(:total_allocated_objects)
+    live = GC.stat(:heap_live_slots)
+    memsize = ObjectSpace.memsize_of_all
+
+    n.times { PurpleRuby::Loopback.inject_im(acc, "peer", "allocation") }
+
+    allocated = GC.stat(:total_allocated_objects) - allocated
+    GC.start
+    @results[:per_event] = {
+      :events => n,
+      :objects_allocated => allocated.to_f / n,
+      :objects_retained => (GC.stat(:heap_live_slots) - live).to_f / n,
+      :bytes_retained => (ObjectSpace.memsize_of_all - memsize).to_f / n
+    }
+  end
+
+  def bench_blist
+    sizes = QUICK ? [1_000, 10_000] : [1_000, 10_000, 100_000]
+    @results[:blist_storm] = sizes.collect do |size|
+      acc = login "roster#{size}"
+      updates = 0
+      @on_blist = lambda {|buddy, a| updates += 1 }
+
+      start = now
+      PurpleRuby::Loopback.buddies(acc, size)
+      elapsed = now - start
+
+      {:buddies => size, :updates => updates, :seconds => elapsed, :per_update_us => elapsed * 1_000_000 / [updates, 1].max}
+    end
+  end
+
+  #recorded inbound traffic replayed through the registered handlers
+  def bench_replay
+    acc = login "replay"
+    n = QUICK ? 10_000 : 100_000
+    @on_im = lambda {|a, sender, message| }
+    path = File.join(PurpleRuby.prefs_path, "replay.rec")
+
+    PurpleRuby.record(path)
+    n.times { PurpleRuby::Loopback.inject_im(acc, "peer", "replayed") }
+    PurpleRuby.stop_recording
+
+    @results[:replay] = PurpleRuby.replay(path)
+  end
+
+  def rss_kb
+    File.read("/proc/self/status")[/VmRSS:\s+(\d+)/, 1].to_i rescue nil
+  end
+
+  #wakeup cost and memory with many idle fds watched, as with thousands of connections
+  def bench_fd_watches
+    count = QUICK ? 1_000 : 5_000
+    limit = Process.getrlimit(Process::RLIMIT_NOFILE)
+    soft = [limit[1], count * 2 + 256].min
+    Process.setrlimit(Process::RLIMIT_NOFILE, soft, limit[1]) if soft > limit[0]
+
+    pairs = count.times.collect { UNIXSocket.pair }
+    GC.start
+    before = rss_kb
+
+    ready = 0
+    handles = pairs.collect do |r, w|
+      PurpleRuby.watch_io(r) {|fd| r.read_nonblock(64, :exception => false); ready += 1 }
+    end
+    GC.start
+    after = rss_kb
+
+    n = QUICK ? 2_000 : 20_000
+    start = now
+    n.times do |i|
+      pairs[i % count][1].write("x")
+      pump_until { ready > i }
+    end
+    elapsed = now - start
+
+    handles.each {|h| PurpleRuby.unwatch_io(h) }
+    pairs.flatten.each(&:close)
+
+    @results[:fd_watches] = {
+      :fds => count,
+      :wakeups => n,
+      :wakeup_us => elapsed * 1_000_000 / n,
+      :rss_kb => before && after && after - before,
+      :eventloop => PurpleRuby.eventloop_stats
+    }
+  end
+
+  def run output
+    setup
+    bench_inbound
+    bench_latency
+    bench_ipc
+    bench_allocations
+    bench_blist
+    bench_replay
+    bench_fd_watches
+
+    spec = Gem::Specification.load(File.expand_path(File.join(File.dirname(__FILE__), '../purple_ruby.gemspec')))
+    report = {
+      :version => spec ? spec.version.to_s : nil,
+      :ruby => RUBY_DESCRIPTION,
+      :time => Time.now.utc.to_s,
+      :results => @results
+    }
+
+    File.open(output, "w") {|f| f.puts JSON.pretty_generate(report) }
+    puts JSON.pretty_generate(@results)
+    puts "written to #{output}"
+  end
+end
+
+if __FILE__ == $0
+  PurpleRubyBench.new.run(ARGV[0] || "bench_results.json")
+end
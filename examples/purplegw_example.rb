@@ -28,6 +28,7 @@ class PurpleGWExample
       puts "logging in #{config[:username]} (#{config[:protocol]})..."
       account = PurpleRuby.login(config[:protocol], config[:username], config[:password])
       accounts[config[:protocol]] = account
+      PurpleRuby.ipc_route(config[:protocol], account)
     }
     
     #handle incoming im messages
@@ -65,10 +66,12 @@ class PurpleGWExample
     #listen a tcp port, parse incoming data and send it out.
     #We assume the incoming data is in the following format (separated by comma):
     #<protocol>,<user>,<message>
-    PurpleRuby.watch_incoming_ipc(SERVER_IP, SERVER_PORT) do |data|
-      protocol, user, message = data.split(",").collect{|x| x.chomp.strip}
-      puts "send: #{protocol},#{user},#{message}"
-      puts accounts[protocol].send_im(user, message)
+    #:route sends it in C using the ipc_route table above, the block only
+    #gets what could not be sent that way (e.g. the account is offline)
+    PurpleRuby.watch_incoming_ipc(SERVER_IP, SERVER_PORT, :route) do |data|
+      protocol, user, message = data.split(",", 3).collect{|x| x.chomp.strip}
+      puts "not routed: #{protocol},#{user},#{message}"
+      puts accounts[protocol].send_im(user, message) if accounts[protocol]
     end
         
     PurpleRuby.main_loop_run
@@ -50,6 +50,11 @@ extern VALUE cAccount;
 extern VALUE new_buddy_handler;
 
 extern VALUE check_callback(VALUE, const char*);
+extern VALUE call_handler(VALUE handler, const char *handler_name, const char *event, int argc, VALUE *argv);
+extern gboolean policy_add(PurpleAccount *account, const char *remote_user, const char *alias, const char *message);
+extern gboolean policy_authorize(PurpleAccount *account, const char *remote_user, const char *alias,
+  const char *message, PurpleAccountRequestAuthorizationCb auth_cb,
+  PurpleAccountRequestAuthorizationCb deny_cb, void *user_data);
 
 static char *
 make_info(PurpleAccount *account, PurpleConnection *gc, const char *remote_user,
@@ -94,13 +99,15 @@ request_add(PurpleAccount *account, const char *remote_user,
 		  const char *id, const char *alias,
 		  const char *message)
 {
+	if (policy_add(account, remote_user, alias, message))
+		return;
+
 	if (new_buddy_handler != Qnil) {
     VALUE args[3];
     args[0] = Data_Wrap_Struct(cAccount, NULL, NULL, account);
     args[1] = rb_str_new2(NULL == remote_user ? "" : remote_user);
     args[2] = rb_str_new2(NULL == message ? "" : message);
-    check_callback(new_buddy_handler, "new_buddy_handler");
-    VALUE v = rb_funcall2(new_buddy_handler, CALL, 3, args);
+    VALUE v = call_handler(new_buddy_handler, "new_buddy_handler", "request_add", 3, args);
     
     if (v != Qnil && v != Qfalse) {
       PurpleConnection *gc = purple_account_get_connection(account);
@@ -123,12 +130,15 @@ static void *request_authorize(PurpleAccount *account,
                         PurpleAccountRequestAuthorizationCb deny_cb,
                         void *user_data)
 {
+  if (policy_authorize(account, remote_user, alias, message, auth_cb, deny_cb, user_data))
+    return NULL;
+
   if (new_buddy_handler != Qnil) {
     VALUE args[3];
     args[0] = Data_Wrap_Struct(cAccount, NULL, NULL, account);
     args[1] = rb_str_new2(NULL == remote_user ? "" : remote_user);
     args[2] = rb_str_new2(NULL == message ? "" : message);
-    VALUE v = rb_funcall2((VALUE)new_buddy_handler, CALL, 3, args);
+    VALUE v = call_handler(new_buddy_handler, "new_buddy_handler", "request_authorize", 3, args);
     
     if (v != Qnil && v != Qfalse) {
       auth_cb(user_data);
@@ -0,0 +1,293 @@
+/*
+ * Content addressed store for account avatars.
+ *
+ * The same brand avatar is usually applied to thousands of accounts. Files are
+ * mmap'd and hashed once and later calls with the same (unchanged) path are
+ * a stat() and a hash lookup; setting the image an account already has
+ * stops there.
+ *
+ * The image itself is libpurple's: an entry holds a reference on the
+ * PurpleStoredImage libpurple made of it, which libpurple shares by content
+ * between accounts. purple_buddy_icons_set_account_icon takes ownership of
+ * its buffer and frees it when it already has the image, so giving an
+ * account a new image still costs a short lived copy.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/buddyicon.h>
+#include <libpurple/imgstore.h>
+#include <libpurple/signals.h>
+
+#include <ruby.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifndef RSTRING_PTR
+#define RSTRING_PTR(s) (RSTRING(s)->ptr)
+#endif
+#ifndef RSTRING_LEN
+#define RSTRING_LEN(s) (RSTRING(s)->len)
+#endif
+
+extern VALUE cAccount;
+extern PurpleAccount* get_account_from_ruby_object(VALUE acc);
+
+typedef struct {
+  char *checksum;
+  PurpleStoredImage *img;   /* libpurple's copy, NULL until an account uses it */
+  gsize len;
+  guint refs;   /* accounts and paths using it */
+} AvatarEntry;
+
+typedef struct {
+  AvatarEntry *entry;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+} AvatarPath;
+
+/* checksum -> AvatarEntry */
+static GHashTable *avatars = NULL;
+/* path -> AvatarPath */
+static GHashTable *avatar_paths = NULL;
+/* PurpleAccount* -> AvatarEntry */
+static GHashTable *account_avatars = NULL;
+
+static unsigned long path_hits = 0;
+static unsigned long loads = 0;
+static unsigned long content_hits = 0;
+
+static void avatar_unref(AvatarEntry *entry)
+{
+  if (--entry->refs > 0)
+    return;
+
+  g_hash_table_remove(avatars, entry->checksum);
+  g_free(entry->checksum);
+  if (entry->img != NULL)
+    purple_imgstore_unref(entry->img);
+  g_free(entry);
+}
+
+static void free_avatar_path(gpointer data)
+{
+  AvatarPath *path = data;
+  avatar_unref(path->entry);
+  g_free(path);
+}
+
+static void account_removed_cb(PurpleAccount *account, gpointer user_data)
+{
+  AvatarEntry *entry = g_hash_table_lookup(account_avatars, account);
+  if (entry != NULL) {
+    g_hash_table_remove(account_avatars, account);
+    avatar_unref(entry);
+  }
+}
+
+static void *avatar_get_handle(void)
+{
+  static int handle;
+
+  return &handle;
+}
+
+static void avatar_store_init()
+{
+  if (avatars != NULL)
+    return;
+
+  avatars = g_hash_table_new(g_str_hash, g_str_equal);
+  avatar_paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_avatar_path);
+  account_avatars = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  purple_signal_connect(purple_accounts_get_handle(), "account-removed",
+            avatar_get_handle(), PURPLE_CALLBACK(account_removed_cb), NULL);
+}
+
+/* returns a referenced entry with the given content */
+static AvatarEntry* avatar_lookup(const guchar *data, gsize len)
+{
+  char *checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, data, len);
+  AvatarEntry *entry = g_hash_table_lookup(avatars, checksum);
+
+  if (entry != NULL) {
+    content_hits++;
+    g_free(checksum);
+  } else {
+    entry = g_new0(AvatarEntry, 1);
+    entry->checksum = checksum;
+    entry->len = len;
+    g_hash_table_insert(avatars, entry->checksum, entry);
+  }
+
+  entry->refs++;
+  return entry;
+}
+
+/*
+ * Takes over the reference on entry. data is its content, NULL when libpurple
+ * already has it.
+ */
+static void avatar_set(PurpleAccount *account, AvatarEntry *entry, const guchar *data)
+{
+  AvatarEntry *old = g_hash_table_lookup(account_avatars, account);
+  PurpleStoredImage *img;
+
+  if (old == entry) {
+    avatar_unref(entry);
+    return;
+  }
+  if (NULL == data)
+    data = purple_imgstore_get_data(entry->img);
+
+  g_hash_table_insert(account_avatars, account, entry);
+  img = purple_buddy_icons_set_account_icon(account, g_memdup(data, entry->len), entry->len);
+  if (NULL == entry->img && img != NULL)
+    entry->img = purple_imgstore_ref(img);
+
+  if (old != NULL)
+    avatar_unref(old);
+}
+
+static void avatar_set_file(PurpleAccount *account, const char *filename)
+{
+  struct stat st;
+  AvatarPath *path;
+  AvatarEntry *entry;
+  void *map;
+  int fd, error;
+
+  /* a hit is only a stat */
+  path = g_hash_table_lookup(avatar_paths, filename);
+  if (path != NULL && path->entry->img != NULL && stat(filename, &st) == 0 &&
+      path->dev == st.st_dev && path->ino == st.st_ino &&
+      path->size == st.st_size && path->mtime == st.st_mtime) {
+    path_hits++;
+    path->entry->refs++;
+    avatar_set(account, path->entry, NULL);
+    return;
+  }
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    error = errno;
+    if (fd >= 0)
+      close(fd);
+    rb_raise(rb_eRuntimeError, "Error when opening picture: %s: %s", filename, g_strerror(error));
+  }
+
+  if (0 == st.st_size) {
+    close(fd);
+    rb_raise(rb_eRuntimeError, "Error when opening picture: %s is empty", filename);
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  error = errno;
+  close(fd);
+  if (MAP_FAILED == map) {
+    rb_raise(rb_eRuntimeError, "Error when reading picture: %s: %s", filename, g_strerror(error));
+  }
+
+  loads++;
+  entry = avatar_lookup(map, st.st_size);
+
+  /* the path cache holds its own reference */
+  path = g_new0(AvatarPath, 1);
+  path->entry = entry;
+  path->dev = st.st_dev;
+  path->ino = st.st_ino;
+  path->size = st.st_size;
+  path->mtime = st.st_mtime;
+  entry->refs++;
+  g_hash_table_replace(avatar_paths, g_strdup(filename), path);
+
+  avatar_set(account, entry, map);
+  munmap(map, st.st_size);
+}
+
+/*
+ * Account#avatar = path
+ */
+static VALUE set_avatar_from_file(VALUE self, VALUE filepath)
+{
+  PurpleAccount *account = get_account_from_ruby_object(self);
+
+  avatar_store_init();
+  avatar_set_file(account, StringValueCStr(filepath));
+
+  return Qtrue;
+}
+
+/*
+ * Account#avatar_data = string
+ *
+ * Same as avatar= with the image content instead of a path.
+ */
+static VALUE set_avatar_from_data(VALUE self, VALUE data)
+{
+  PurpleAccount *account = get_account_from_ruby_object(self);
+
+  StringValue(data);
+  if (0 == RSTRING_LEN(data)) {
+    rb_raise(rb_eArgError, "avatar_data: empty picture");
+  }
+
+  avatar_store_init();
+  avatar_set(account, avatar_lookup((const guchar *)RSTRING_PTR(data), RSTRING_LEN(data)),
+             (const guchar *)RSTRING_PTR(data));
+
+  return Qtrue;
+}
+
+static void sum_bytes(gpointer key, gpointer value, gpointer user_data)
+{
+  *(gsize *)user_data += ((AvatarEntry *)value)->len;
+}
+
+/*
+ * PurpleRuby.avatar_stats => Hash
+ */
+static VALUE avatar_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+  gsize bytes = 0;
+
+  if (avatars != NULL)
+    g_hash_table_foreach(avatars, sum_bytes, &bytes);
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("images")), UINT2NUM(avatars ? g_hash_table_size(avatars) : 0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), ULONG2NUM(bytes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("accounts")), UINT2NUM(account_avatars ? g_hash_table_size(account_avatars) : 0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("file_loads")), ULONG2NUM(loads));
+  rb_hash_aset(hash, ID2SYM(rb_intern("path_hits")), ULONG2NUM(path_hits));
+  rb_hash_aset(hash, ID2SYM(rb_intern("content_hits")), ULONG2NUM(content_hits));
+
+  return hash;
+}
+
+void init_avatar(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "avatar_stats", avatar_stats, 0);
+  rb_define_method(cAccount, "avatar=", set_avatar_from_file, 1);
+  rb_define_method(cAccount, "avatar_data=", set_avatar_from_data, 1);
+}
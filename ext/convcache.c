@@ -0,0 +1,252 @@
+/*
+ * Index and idle eviction of IM conversations.
+ *
+ * libpurple finds a conversation by walking the list of all of them, and
+ * never closes one by itself: every recipient of common_send and every
+ * sender of an incoming IM leaves a PurpleConversation with its history
+ * behind. IM conversations are indexed here by (account, normalized name),
+ * kept in least recently used order and destroyed once idle for
+ * PurpleRuby.conversation_idle seconds or when there are more than
+ * PurpleRuby.conversation_max of them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/conversation.h>
+#include <libpurple/eventloop.h>
+#include <libpurple/signals.h>
+#include <libpurple/util.h>
+
+#include <ruby.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_IDLE 1800
+#define DEFAULT_MAX 10000
+#define SWEEP_INTERVAL 60
+
+typedef struct {
+  PurpleAccount *account;
+  char *name;                 /* normalized */
+  PurpleConversation *conv;
+  time_t used;
+  GList *link;                /* in lru */
+} ConvEntry;
+
+static GHashTable *by_name = NULL;   /* ConvEntry => ConvEntry, on (account, name) */
+static GHashTable *by_conv = NULL;   /* PurpleConversation* => ConvEntry */
+static GQueue lru = G_QUEUE_INIT;   /* least recently used first */
+
+static guint conversation_idle = DEFAULT_IDLE;
+static guint conversation_max = DEFAULT_MAX;
+
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+static unsigned long evicted_idle = 0;
+static unsigned long evicted_max = 0;
+
+static guint entry_hash(gconstpointer key)
+{
+  const ConvEntry *entry = key;
+  return g_direct_hash(entry->account) ^ g_str_hash(entry->name);
+}
+
+static gboolean entry_equal(gconstpointer a, gconstpointer b)
+{
+  const ConvEntry *x = a, *y = b;
+  return x->account == y->account && strcmp(x->name, y->name) == 0;
+}
+
+static void entry_remove(ConvEntry *entry)
+{
+  g_hash_table_remove(by_name, entry);
+  g_hash_table_remove(by_conv, entry->conv);
+  g_queue_delete_link(&lru, entry->link);
+  g_free(entry->name);
+  g_free(entry);
+}
+
+static void entry_touch(ConvEntry *entry)
+{
+  entry->used = time(NULL);
+  g_queue_unlink(&lru, entry->link);
+  g_queue_push_tail_link(&lru, entry->link);
+}
+
+/* destroy the least recently used conversations that are over the limits */
+static void conv_cache_evict(void)
+{
+  time_t now = time(NULL);
+  ConvEntry *entry;
+
+  while (NULL != (entry = g_queue_peek_head(&lru))) {
+    PurpleConversation *conv = entry->conv;
+
+    if (conversation_max > 0 && g_queue_get_length(&lru) > conversation_max)
+      evicted_max++;
+    else if (conversation_idle > 0 && now - entry->used >= conversation_idle)
+      evicted_idle++;
+    else
+      break;
+
+    entry_remove(entry);
+    purple_conversation_destroy(conv);
+  }
+}
+
+static gboolean conv_cache_sweep(gpointer data)
+{
+  conv_cache_evict();
+  return TRUE;
+}
+
+static void conversation_created(PurpleConversation *conv, gpointer data)
+{
+  ConvEntry *entry, *old;
+
+  if (purple_conversation_get_type(conv) != PURPLE_CONV_TYPE_IM)
+    return;
+
+  entry = g_new0(ConvEntry, 1);
+  entry->account = purple_conversation_get_account(conv);
+  entry->name = g_strdup(purple_normalize(entry->account, purple_conversation_get_name(conv)));
+  entry->conv = conv;
+  entry->used = time(NULL);
+
+  if (NULL != (old = g_hash_table_lookup(by_name, entry)))
+    entry_remove(old);
+
+  g_queue_push_tail(&lru, entry);
+  entry->link = g_queue_peek_tail_link(&lru);
+  g_hash_table_insert(by_name, entry, entry);
+  g_hash_table_insert(by_conv, conv, entry);
+
+  conv_cache_evict();
+}
+
+static void deleting_conversation(PurpleConversation *conv, gpointer data)
+{
+  ConvEntry *entry = g_hash_table_lookup(by_conv, conv);
+
+  if (entry != NULL)
+    entry_remove(entry);
+}
+
+/* the IM conversation of account with name, NULL if there is none */
+PurpleConversation *conv_cache_find(PurpleAccount *account, const char *name)
+{
+  ConvEntry key, *entry;
+
+  key.account = account;
+  key.name = (char *)purple_normalize(account, name);
+  entry = g_hash_table_lookup(by_name, &key);
+  if (NULL == entry) {
+    misses++;
+    return NULL;
+  }
+
+  hits++;
+  entry_touch(entry);
+  return entry->conv;
+}
+
+/* write_conv: conv is in use */
+void conv_cache_touch(PurpleConversation *conv)
+{
+  ConvEntry *entry = g_hash_table_lookup(by_conv, conv);
+
+  if (entry != NULL)
+    entry_touch(entry);
+}
+
+static void *conv_cache_get_handle(void)
+{
+  static int handle;
+
+  return &handle;
+}
+
+/* after purple_core_init */
+void conv_cache_register()
+{
+  by_name = g_hash_table_new(entry_hash, entry_equal);
+  by_conv = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  purple_signal_connect(purple_conversations_get_handle(), "conversation-created", conv_cache_get_handle(),
+            PURPLE_CALLBACK(conversation_created), NULL);
+  purple_signal_connect(purple_conversations_get_handle(), "deleting-conversation", conv_cache_get_handle(),
+            PURPLE_CALLBACK(deleting_conversation), NULL);
+  purple_timeout_add_seconds(SWEEP_INTERVAL, conv_cache_sweep, NULL);
+}
+
+/*
+ * PurpleRuby.conversation_idle = seconds
+ *
+ * Close IM conversations unused for that long, 0 keeps them.
+ */
+static VALUE set_conversation_idle(VALUE self, VALUE seconds)
+{
+  conversation_idle = NUM2UINT(seconds);
+  return seconds;
+}
+
+static VALUE get_conversation_idle(VALUE self)
+{
+  return UINT2NUM(conversation_idle);
+}
+
+/*
+ * PurpleRuby.conversation_max = count
+ *
+ * Close the least recently used IM conversations beyond count, 0 for no limit.
+ */
+static VALUE set_conversation_max(VALUE self, VALUE count)
+{
+  conversation_max = NUM2UINT(count);
+  if (by_name != NULL)
+    conv_cache_evict();
+  return count;
+}
+
+static VALUE get_conversation_max(VALUE self)
+{
+  return UINT2NUM(conversation_max);
+}
+
+/*
+ * PurpleRuby.conversation_stats => Hash
+ */
+static VALUE conversation_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("open")), UINT2NUM(g_queue_get_length(&lru)));
+  rb_hash_aset(hash, ID2SYM(rb_intern("hits")), ULONG2NUM(hits));
+  rb_hash_aset(hash, ID2SYM(rb_intern("misses")), ULONG2NUM(misses));
+  rb_hash_aset(hash, ID2SYM(rb_intern("evicted_idle")), ULONG2NUM(evicted_idle));
+  rb_hash_aset(hash, ID2SYM(rb_intern("evicted_max")), ULONG2NUM(evicted_max));
+
+  return hash;
+}
+
+void init_conv_cache(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "conversation_idle=", set_conversation_idle, 1);
+  rb_define_singleton_method(cPurpleRuby, "conversation_idle", get_conversation_idle, 0);
+  rb_define_singleton_method(cPurpleRuby, "conversation_max=", set_conversation_max, 1);
+  rb_define_singleton_method(cPurpleRuby, "conversation_max", get_conversation_max, 0);
+  rb_define_singleton_method(cPurpleRuby, "conversation_stats", conversation_stats, 0);
+}
@@ -0,0 +1,250 @@
+/*
+ * PurpleRuby.defer: one native FIFO per priority lane, drained by a single
+ * idle source.
+ *
+ * Each drain runs blocks until the time budget (2 ms by default) is used up
+ * and then goes back to the main loop, so a burst of deferred work can not
+ * starve network I/O. The queued blocks are marked for the GC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <glib.h>
+
+#include <ruby.h>
+
+#include "probes.h"
+
+#define LANES 3
+#define LANE_HIGH 0
+#define LANE_NORMAL 1
+#define LANE_LOW 2
+#define DEFAULT_BUDGET 2000 /* us */
+
+extern VALUE call_handler(VALUE handler, const char *handler_name, const char *event, int argc, VALUE *argv);
+
+/* ring buffer, cap is a power of 2 */
+typedef struct {
+  VALUE *items;
+  gsize head;
+  gsize len;
+  gsize cap;
+} DeferLane;
+
+static DeferLane lanes[LANES];
+static VALUE lanes_holder = Qnil;
+static guint drain_source = 0;
+static gint64 budget = DEFAULT_BUDGET;
+
+static gsize max_depth = 0;
+static unsigned long executed = 0;
+static unsigned long drains = 0;
+
+static ID id_high, id_normal, id_low;
+
+static void lanes_mark(void *data)
+{
+  int i;
+  gsize j;
+
+  for (i = 0; i < LANES; i++) {
+    for (j = 0; j < lanes[i].len; j++) {
+      rb_gc_mark(lanes[i].items[(lanes[i].head + j) & (lanes[i].cap - 1)]);
+    }
+  }
+}
+
+static void lane_push(DeferLane *lane, VALUE block)
+{
+  if (lane->len == lane->cap) {
+    gsize cap = lane->cap ? lane->cap * 2 : 64;
+    VALUE *items = g_new(VALUE, cap);
+    gsize j;
+
+    for (j = 0; j < lane->len; j++)
+      items[j] = lane->items[(lane->head + j) & (lane->cap - 1)];
+
+    g_free(lane->items);
+    lane->items = items;
+    lane->head = 0;
+    lane->cap = cap;
+  }
+
+  lane->items[(lane->head + lane->len) & (lane->cap - 1)] = block;
+  lane->len++;
+}
+
+static VALUE lane_shift(DeferLane *lane)
+{
+  VALUE block = lane->items[lane->head];
+
+  lane->head = (lane->head + 1) & (lane->cap - 1);
+  lane->len--;
+  return block;
+}
+
+static gsize depth()
+{
+  return lanes[LANE_HIGH].len + lanes[LANE_NORMAL].len + lanes[LANE_LOW].len;
+}
+
+/* blocks not run yet, for the drain */
+gsize defer_pending()
+{
+  return depth();
+}
+
+static VALUE run_block(VALUE block)
+{
+  return call_handler(block, "defer", "idle", 0, NULL);
+}
+
+static gboolean drain(gpointer data)
+{
+  gint64 deadline = g_get_monotonic_time() + budget;
+  guint source = drain_source;
+  unsigned long ran = executed;
+  VALUE error = Qnil;
+  int lane, state;
+
+  drains++;
+
+  do {
+    for (lane = 0; lane < LANES && 0 == lanes[lane].len; lane++)
+      ;
+    if (LANES == lane)
+      break;
+
+    VALUE block = lane_shift(&lanes[lane]);
+    executed++;
+    rb_protect(run_block, block, &state);
+    RB_GC_GUARD(block);
+    if (state) {
+      error = rb_errinfo();
+      rb_set_errinfo(Qnil);
+      break;
+    }
+  } while (g_get_monotonic_time() < deadline);
+
+  PROBE2(defer__drain, executed - ran, depth());
+
+  if (0 == depth()) {
+    drain_source = 0;
+  }
+
+  if (!NIL_P(error)) {
+    /* glib never sees our return value when we raise, drop the source here */
+    g_source_remove(source);
+    if (drain_source != 0)
+      drain_source = g_idle_add(drain, NULL);
+    rb_exc_raise(error);
+  }
+
+  return drain_source != 0;
+}
+
+/*
+ * PurpleRuby.defer(lane = :normal) { }
+ *
+ * Run the block from the main loop when it is idle. :high blocks run before
+ * :normal ones, :normal before :low.
+ */
+static VALUE defer_execute(int argc, VALUE* argv, VALUE self)
+{
+  VALUE priority;
+  int lane = LANE_NORMAL;
+
+  rb_scan_args(argc, argv, "01", &priority);
+
+  if (!rb_block_given_p()) {
+    rb_raise(rb_eArgError, "defer_execute: no block given");
+  }
+
+  if (!NIL_P(priority)) {
+    ID id = SYMBOL_P(priority) ? SYM2ID(priority) : 0;
+    if (id == id_high) {
+      lane = LANE_HIGH;
+    } else if (id == id_low) {
+      lane = LANE_LOW;
+    } else if (id != id_normal) {
+      rb_raise(rb_eArgError, "defer: lane should be :high, :normal or :low");
+    }
+  }
+
+  lane_push(&lanes[lane], rb_block_proc());
+
+  if (depth() > max_depth)
+    max_depth = depth();
+
+  if (0 == drain_source)
+    drain_source = g_idle_add(drain, NULL);
+
+  return Qtrue;
+}
+
+/*
+ * PurpleRuby.defer_budget = ms
+ *
+ * How long one drain may run before yielding to the main loop.
+ */
+static VALUE set_defer_budget(VALUE self, VALUE ms)
+{
+  double value = NUM2DBL(ms);
+
+  if (value <= 0) {
+    rb_raise(rb_eArgError, "defer_budget should be positive");
+  }
+
+  budget = (gint64)(value * 1000);
+  return ms;
+}
+
+static VALUE get_defer_budget(VALUE self)
+{
+  return rb_float_new(budget / 1000.0);
+}
+
+/*
+ * PurpleRuby.defer_stats => Hash
+ */
+static VALUE defer_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("depth")), ULONG2NUM(depth()));
+  rb_hash_aset(hash, ID2SYM(id_high), ULONG2NUM(lanes[LANE_HIGH].len));
+  rb_hash_aset(hash, ID2SYM(id_normal), ULONG2NUM(lanes[LANE_NORMAL].len));
+  rb_hash_aset(hash, ID2SYM(id_low), ULONG2NUM(lanes[LANE_LOW].len));
+  rb_hash_aset(hash, ID2SYM(rb_intern("max_depth")), ULONG2NUM(max_depth));
+  rb_hash_aset(hash, ID2SYM(rb_intern("executed")), ULONG2NUM(executed));
+  rb_hash_aset(hash, ID2SYM(rb_intern("drains")), ULONG2NUM(drains));
+
+  return hash;
+}
+
+void init_defer(VALUE cPurpleRuby)
+{
+  id_high = rb_intern("high");
+  id_normal = rb_intern("normal");
+  id_low = rb_intern("low");
+
+  rb_global_variable(&lanes_holder);
+  lanes_holder = Data_Wrap_Struct(rb_cObject, lanes_mark, NULL, lanes);
+
+  rb_define_singleton_method(cPurpleRuby, "defer", defer_execute, -1);
+  rb_define_singleton_method(cPurpleRuby, "defer_budget=", set_defer_budget, 1);
+  rb_define_singleton_method(cPurpleRuby, "defer_budget", get_defer_budget, 0);
+  rb_define_singleton_method(cPurpleRuby, "defer_stats", defer_stats, 0);
+}
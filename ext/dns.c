@@ -0,0 +1,426 @@
+/*
+ * DNS resolver for libpurple (PurpleDnsQueryUiOps).
+ *
+ * Instead of libpurple forking a resolver child per lookup, getaddrinfo runs
+ * on a small thread pool and the results are cached per hostname for
+ * PurpleRuby.dns_ttl seconds. Lookups for a hostname that is already being
+ * resolved wait for that answer instead of starting another one, so a login
+ * ramp of thousands of accounts on the same servers costs one lookup per
+ * server.
+ *
+ * The workers only call getaddrinfo; callbacks run from the main loop.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/debug.h>
+#include <libpurple/dnsquery.h>
+
+#include <ruby.h>
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define DNS_THREADS 4
+#define DEFAULT_TTL 300     /* s */
+#define FAILURE_TTL 10      /* s, at most */
+
+extern VALUE call_handler(VALUE handler, const char *handler_name, const char *event, int argc, VALUE *argv);
+
+typedef struct {
+  char *host;
+  GSList *addrs;      /* (length, sockaddr) pairs as libpurple wants them, port 0 */
+  char *error;
+  gint64 expires;     /* monotonic us */
+  gboolean resolving;
+  GSList *waiting;    /* DnsWaiter */
+} DnsEntry;
+
+typedef struct {
+  PurpleDnsQueryData *query;  /* NULL once destroyed */
+  PurpleDnsQueryResolvedCallback resolved_cb;
+  PurpleDnsQueryFailedCallback failed_cb;
+  DnsEntry *entry;
+  gboolean detached;          /* taken off entry->waiting for delivery */
+} DnsWaiter;
+
+/* runs on a worker thread, then back on the main loop */
+typedef struct {
+  char *host;
+  struct addrinfo *res;
+  int error;
+} DnsJob;
+
+static GThreadPool *pool = NULL;
+/* lower case hostname -> DnsEntry */
+static GHashTable *entries = NULL;
+/* PurpleDnsQueryData* -> DnsWaiter */
+static GHashTable *queries = NULL;
+static guint ttl = DEFAULT_TTL;
+
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+static unsigned long coalesced = 0;
+static unsigned long failures = 0;
+static guint in_flight = 0;
+
+/* Proc -> true for PurpleRuby.resolve, keeps the blocks away from the GC */
+static VALUE resolve_blocks = Qnil;
+
+static void addrs_free(GSList *addrs)
+{
+  GSList *l;
+
+  for (l = addrs; l != NULL; l = l->next->next)
+    g_free(l->next->data);
+  g_slist_free(addrs);
+}
+
+/* copy of the cached addresses with the port of the query */
+static GSList* addrs_copy(GSList *addrs, unsigned short port)
+{
+  GSList *hosts = NULL, *l;
+
+  for (l = addrs; l != NULL; l = l->next->next) {
+    gsize len = GPOINTER_TO_INT(l->data);
+    struct sockaddr *addr = g_memdup(l->next->data, len);
+
+    if (AF_INET == addr->sa_family)
+      ((struct sockaddr_in *)addr)->sin_port = htons(port);
+    else if (AF_INET6 == addr->sa_family)
+      ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+
+    hosts = g_slist_prepend(hosts, GINT_TO_POINTER(len));
+    hosts = g_slist_prepend(hosts, addr);
+  }
+
+  /* prepended as (addr, len) pairs, reversed they are (len, addr) again */
+  return g_slist_reverse(hosts);
+}
+
+static void deliver(DnsWaiter *waiter)
+{
+  DnsEntry *entry = waiter->entry;
+  PurpleDnsQueryData *query = waiter->query;
+
+  g_hash_table_remove(queries, query);
+  waiter->query = NULL;
+
+  /* both callbacks end with purple_dnsquery_destroy, which calls dns_destroy */
+  if (entry->addrs != NULL)
+    waiter->resolved_cb(query, addrs_copy(entry->addrs, purple_dnsquery_get_port(query)));
+  else
+    waiter->failed_cb(query, entry->error);
+}
+
+static gboolean job_done(gpointer data);
+
+static void resolve_job(gpointer data, gpointer user_data)
+{
+  DnsJob *job = data;
+  struct addrinfo hints;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+#ifdef AI_ADDRCONFIG
+  hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+
+  job->error = getaddrinfo(job->host, NULL, &hints, &job->res);
+  g_idle_add(job_done, job);
+}
+
+static gboolean job_done(gpointer data)
+{
+  DnsJob *job = data;
+  DnsEntry *entry = g_hash_table_lookup(entries, job->host);
+  GSList *pending, *l;
+  struct addrinfo *ai;
+
+  in_flight--;
+
+  addrs_free(entry->addrs);
+  entry->addrs = NULL;
+  g_free(entry->error);
+  entry->error = NULL;
+
+  for (ai = job->res; ai != NULL; ai = ai->ai_next) {
+    if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+      continue;
+    entry->addrs = g_slist_prepend(entry->addrs, GINT_TO_POINTER(ai->ai_addrlen));
+    entry->addrs = g_slist_prepend(entry->addrs, g_memdup(ai->ai_addr, ai->ai_addrlen));
+  }
+  entry->addrs = g_slist_reverse(entry->addrs);
+
+  if (entry->addrs != NULL) {
+    entry->expires = g_get_monotonic_time() + (gint64)ttl * G_USEC_PER_SEC;
+  } else {
+    failures++;
+    entry->error = g_strdup_printf("Error resolving %s: %s", job->host,
+                                   job->error ? gai_strerror(job->error) : "no address");
+    entry->expires = g_get_monotonic_time() + (gint64)MIN(ttl, FAILURE_TTL) * G_USEC_PER_SEC;
+    purple_debug_info("purple_ruby", "%s\n", entry->error);
+  }
+  entry->resolving = FALSE;
+
+  /* a callback may start or cancel other queries */
+  pending = g_slist_reverse(entry->waiting);
+  entry->waiting = NULL;
+  for (l = pending; l != NULL; l = l->next)
+    ((DnsWaiter *)l->data)->detached = TRUE;
+
+  for (l = pending; l != NULL; l = l->next) {
+    DnsWaiter *waiter = l->data;
+    if (waiter->query != NULL)
+      deliver(waiter);
+  }
+  g_slist_free_full(pending, g_free);
+
+  if (job->res != NULL)
+    freeaddrinfo(job->res);
+  g_free(job->host);
+  g_free(job);
+
+  return FALSE;
+}
+
+static gboolean dns_resolve_host(PurpleDnsQueryData *query, PurpleDnsQueryResolvedCallback resolved_cb,
+                                 PurpleDnsQueryFailedCallback failed_cb)
+{
+  char *host = g_ascii_strdown(purple_dnsquery_get_host(query), -1);
+  DnsEntry *entry;
+  DnsWaiter *waiter;
+
+  if (NULL == pool) {
+#if !GLIB_CHECK_VERSION(2,32,0)
+    if (!g_thread_supported())
+      g_thread_init(NULL);
+#endif
+    pool = g_thread_pool_new(resolve_job, NULL, DNS_THREADS, FALSE, NULL);
+    if (NULL == pool) {
+      g_free(host);
+      return FALSE;
+    }
+  }
+
+  entry = g_hash_table_lookup(entries, host);
+  if (NULL == entry) {
+    entry = g_new0(DnsEntry, 1);
+    entry->host = host;
+    g_hash_table_insert(entries, entry->host, entry);
+  } else {
+    g_free(host);
+  }
+
+  waiter = g_new0(DnsWaiter, 1);
+  waiter->query = query;
+  waiter->resolved_cb = resolved_cb;
+  waiter->failed_cb = failed_cb;
+  waiter->entry = entry;
+
+  if (!entry->resolving && entry->expires > g_get_monotonic_time()) {
+    /* we are called from a timeout, answering right away is fine */
+    hits++;
+    waiter->detached = TRUE;
+    g_hash_table_insert(queries, query, waiter);
+    deliver(waiter);
+    g_free(waiter);
+    return TRUE;
+  }
+
+  g_hash_table_insert(queries, query, waiter);
+  entry->waiting = g_slist_prepend(entry->waiting, waiter);
+
+  if (entry->resolving) {
+    coalesced++;
+  } else {
+    DnsJob *job = g_new0(DnsJob, 1);
+    job->host = g_strdup(entry->host);
+    entry->resolving = TRUE;
+    misses++;
+    in_flight++;
+    g_thread_pool_push(pool, job, NULL);
+  }
+
+  return TRUE;
+}
+
+static void dns_destroy(PurpleDnsQueryData *query)
+{
+  DnsWaiter *waiter = g_hash_table_lookup(queries, query);
+
+  if (NULL == waiter)
+    return;
+
+  g_hash_table_remove(queries, query);
+  waiter->query = NULL;
+  if (!waiter->detached) {
+    waiter->entry->waiting = g_slist_remove(waiter->entry->waiting, waiter);
+    g_free(waiter);
+  }
+}
+
+static PurpleDnsQueryUiOps dns_ui_ops =
+{
+  dns_resolve_host,
+  dns_destroy,
+
+  /* padding */
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+PurpleDnsQueryUiOps* dns_get_ui_ops()
+{
+  if (NULL == entries) {
+    entries = g_hash_table_new(g_str_hash, g_str_equal);
+    queries = g_hash_table_new(g_direct_hash, g_direct_equal);
+  }
+  return &dns_ui_ops;
+}
+
+static void resolve_cb(GSList *hosts, gpointer data, const char *error_message)
+{
+  VALUE block = (VALUE)data;
+  VALUE addresses = rb_ary_new();
+  VALUE args[2];
+
+  while (hosts != NULL) {
+    struct sockaddr *addr = hosts->next->data;
+    char ip[INET6_ADDRSTRLEN];
+    const void *src = (AF_INET6 == addr->sa_family) ?
+      (const void *)&((struct sockaddr_in6 *)addr)->sin6_addr :
+      (const void *)&((struct sockaddr_in *)addr)->sin_addr;
+
+    if (inet_ntop(addr->sa_family, src, ip, sizeof(ip)) != NULL)
+      rb_ary_push(addresses, rb_str_new2(ip));
+
+    g_free(addr);
+    hosts = g_slist_delete_link(hosts, hosts);
+    hosts = g_slist_delete_link(hosts, hosts);
+  }
+
+  rb_hash_delete(resolve_blocks, block);
+
+  args[0] = addresses;
+  args[1] = error_message ? rb_str_new2(error_message) : Qnil;
+  call_handler(block, "resolve", "dns", 2, args);
+}
+
+/*
+ * PurpleRuby.resolve(host, port = 0) { |addresses, error| }
+ *
+ * Resolve host the way libpurple does for connections, through the cache.
+ */
+static VALUE resolve(int argc, VALUE* argv, VALUE self)
+{
+  VALUE host, port, block;
+
+  rb_scan_args(argc, argv, "11", &host, &port);
+
+  if (!rb_block_given_p()) {
+    rb_raise(rb_eArgError, "resolve: no block given");
+  }
+
+  block = rb_block_proc();
+  rb_hash_aset(resolve_blocks, block, Qtrue);
+
+  purple_dnsquery_a(StringValueCStr(host), NIL_P(port) ? 0 : NUM2INT(port), resolve_cb, (gpointer)block);
+  return Qnil;
+}
+
+/*
+ * PurpleRuby.dns_ttl = seconds
+ *
+ * How long resolved addresses are cached, 300 by default. Failures are
+ * cached for at most 10 seconds.
+ */
+static VALUE set_dns_ttl(VALUE self, VALUE seconds)
+{
+  ttl = NUM2UINT(seconds);
+  return seconds;
+}
+
+static VALUE get_dns_ttl(VALUE self)
+{
+  return UINT2NUM(ttl);
+}
+
+static gboolean expired(gpointer key, gpointer value, gpointer user_data)
+{
+  DnsEntry *entry = value;
+
+  if (entry->resolving || entry->expires > *(gint64 *)user_data)
+    return FALSE;
+
+  addrs_free(entry->addrs);
+  g_free(entry->error);
+  g_free(entry->host);
+  g_free(entry);
+  return TRUE;
+}
+
+/*
+ * PurpleRuby.dns_flush
+ *
+ * Forget cached addresses that are not being resolved right now.
+ */
+static VALUE dns_flush(VALUE self)
+{
+  gint64 forever = G_MAXINT64;
+
+  if (entries != NULL)
+    g_hash_table_foreach_remove(entries, expired, &forever);
+  return Qnil;
+}
+
+/*
+ * PurpleRuby.dns_stats => Hash
+ */
+static VALUE dns_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+  gint64 now = g_get_monotonic_time();
+
+  /* drop what expired while we are here */
+  if (entries != NULL)
+    g_hash_table_foreach_remove(entries, expired, &now);
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("hits")), ULONG2NUM(hits));
+  rb_hash_aset(hash, ID2SYM(rb_intern("misses")), ULONG2NUM(misses));
+  rb_hash_aset(hash, ID2SYM(rb_intern("coalesced")), ULONG2NUM(coalesced));
+  rb_hash_aset(hash, ID2SYM(rb_intern("failures")), ULONG2NUM(failures));
+  rb_hash_aset(hash, ID2SYM(rb_intern("in_flight")), UINT2NUM(in_flight));
+  rb_hash_aset(hash, ID2SYM(rb_intern("entries")), UINT2NUM(entries ? g_hash_table_size(entries) : 0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("ttl")), UINT2NUM(ttl));
+
+  return hash;
+}
+
+void init_dns(VALUE cPurpleRuby)
+{
+  rb_global_variable(&resolve_blocks);
+  resolve_blocks = rb_hash_new();
+
+  rb_define_singleton_method(cPurpleRuby, "resolve", resolve, -1);
+  rb_define_singleton_method(cPurpleRuby, "dns_ttl=", set_dns_ttl, 1);
+  rb_define_singleton_method(cPurpleRuby, "dns_ttl", get_dns_ttl, 0);
+  rb_define_singleton_method(cPurpleRuby, "dns_flush", dns_flush, 0);
+  rb_define_singleton_method(cPurpleRuby, "dns_stats", dns_stats, 0);
+}
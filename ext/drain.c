@@ -0,0 +1,297 @@
+/*
+ * Graceful drain on SIGTERM/SIGINT.
+ *
+ * The signal handler only writes the signal number to a self-pipe (or, with
+ * no pipe yet, leaves it in a flag drain_register picks up); the main loop
+ * reads it and starts the drain: the IPC listeners are closed, open IPC
+ * connections, PurpleRuby.defer blocks, file transfers and the spools of
+ * connected accounts get until the deadline to finish, then the accounts
+ * are signed off PurpleRuby.drain_batch at a time per tick, the
+ * conversations closed and the main loop quit. What was still pending is
+ * logged and kept in PurpleRuby.drain_stats; spooled messages stay in the
+ * spool files for the next run. SIGQUIT, or a second SIGTERM/SIGINT while
+ * draining, quits right away.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/conversation.h>
+#include <libpurple/debug.h>
+#include <libpurple/eventloop.h>
+
+#include <ruby.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define DRAIN_TICK 20 /* ms */
+
+extern void quit_main_loop(void);
+extern void ipc_stop_listening(void);
+extern guint ipc_connections(void);
+extern gsize defer_pending(void);
+extern guint xfer_pending(void);
+extern gsize spool_pending(gboolean flushing);
+
+enum {
+  DRAIN_IDLE,
+  DRAIN_FLUSH,      /* waiting for IPC connections, deferred blocks, transfers and spools */
+  DRAIN_SIGNOFF,
+  DRAIN_DONE
+};
+
+static int drain_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t missed_signal = 0;
+static int state = DRAIN_IDLE;
+static guint drain_timeout = 0;
+static gint64 drain_started = 0;
+static gint64 drain_deadline = 0;
+
+static double deadline_seconds = 10;
+static guint drain_batch = 50;
+
+static guint dropped_ipc = 0;
+static gsize dropped_deferred = 0;
+static guint dropped_xfers = 0;
+static gsize spooled = 0;
+static guint signed_off = 0;
+static guint conversations_closed = 0;
+static gboolean timed_out = FALSE;
+
+/* async signal safe: nothing but write and the flag */
+void drain_signal(int sig)
+{
+  int saved = errno;
+  char c = sig;
+
+  /* no pipe before drain_register, and a full one already woke the loop */
+  if (drain_pipe[1] < 0 || write(drain_pipe[1], &c, 1) != 1)
+    missed_signal = sig;
+  errno = saved;
+}
+
+static void drain_finish(void)
+{
+  GList *list, *l;
+
+  if (drain_timeout != 0)
+    purple_timeout_remove(drain_timeout);
+  drain_timeout = 0;
+
+  list = g_list_copy(purple_get_conversations());
+  for (l = list; l != NULL; l = l->next) {
+    purple_conversation_destroy(l->data);
+    conversations_closed++;
+  }
+  g_list_free(list);
+
+  spooled = spool_pending(FALSE);
+  state = DRAIN_DONE;
+  purple_debug_info("purple_ruby", "drained in %.3fs%s: %u accounts signed off, %u conversations closed, "
+    "%u IPC connections, %lu deferred blocks and %u file transfers dropped, %lu messages left spooled\n",
+    (g_get_monotonic_time() - drain_started) / 1e6, timed_out ? " (deadline)" : "",
+    signed_off, conversations_closed, dropped_ipc, (unsigned long)dropped_deferred, dropped_xfers,
+    (unsigned long)spooled);
+  quit_main_loop();
+}
+
+/* sign off up to drain_batch accounts, TRUE when none is left */
+static gboolean drain_signoff(void)
+{
+  GList *l;
+  guint n = 0;
+
+  for (l = purple_accounts_get_all(); l != NULL && n < drain_batch; l = l->next) {
+    PurpleAccount *account = l->data;
+    if (purple_account_get_connection(account) != NULL) {
+      purple_account_disconnect(account);
+      signed_off++;
+      n++;
+    }
+  }
+  return 0 == n;
+}
+
+static gboolean drain_tick(gpointer data)
+{
+  gboolean late = g_get_monotonic_time() >= drain_deadline;
+
+  if (DRAIN_FLUSH == state) {
+    if (ipc_connections() > 0 || defer_pending() > 0 || xfer_pending() > 0 || spool_pending(TRUE) > 0) {
+      if (!late)
+        return TRUE;
+      timed_out = TRUE;
+      dropped_ipc = ipc_connections();
+      dropped_deferred = defer_pending();
+      dropped_xfers = xfer_pending();
+    }
+    state = DRAIN_SIGNOFF;
+  }
+
+  if (DRAIN_SIGNOFF == state && !drain_signoff())
+    return TRUE;
+
+  drain_timeout = 0;
+  drain_finish();
+  return FALSE;
+}
+
+static void drain_start(double seconds)
+{
+  if (state != DRAIN_IDLE)
+    return;
+
+  state = DRAIN_FLUSH;
+  drain_started = g_get_monotonic_time();
+  drain_deadline = drain_started + (gint64)(seconds * G_USEC_PER_SEC);
+  purple_debug_info("purple_ruby", "draining, deadline %.1fs\n", seconds);
+
+  ipc_stop_listening();
+  drain_timeout = purple_timeout_add(DRAIN_TICK, drain_tick, NULL);
+}
+
+static void drain_on_signal(int sig)
+{
+  if (SIGQUIT == sig || state != DRAIN_IDLE) {
+    purple_debug_info("purple_ruby", "quitting without drain\n");
+    quit_main_loop();
+  } else {
+    drain_start(deadline_seconds);
+  }
+}
+
+static void drain_pipe_cb(gpointer data, int fd, PurpleInputCondition condition)
+{
+  char c;
+
+  while (read(fd, &c, 1) == 1)
+    drain_on_signal(c);
+
+  if (missed_signal != 0) {
+    int sig = missed_signal;
+    missed_signal = 0;
+    drain_on_signal(sig);
+  }
+}
+
+/* from init, after the signal handlers are installed: a signal before it is kept in missed_signal */
+void drain_register()
+{
+  int i;
+
+  if (drain_pipe[0] >= 0)
+    return;
+
+  if (pipe(drain_pipe) != 0) {
+    purple_debug_error("purple_ruby", "drain: pipe: %s\n", g_strerror(errno));
+    drain_pipe[0] = drain_pipe[1] = -1;
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    fcntl(drain_pipe[i], F_SETFL, fcntl(drain_pipe[i], F_GETFL) | O_NONBLOCK);
+    fcntl(drain_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+  purple_input_add(drain_pipe[0], PURPLE_INPUT_READ, drain_pipe_cb, NULL);
+
+  /* a signal that came before the pipe existed, handled once the loop runs */
+  if (missed_signal != 0) {
+    char c = missed_signal;
+    missed_signal = 0;
+    if (write(drain_pipe[1], &c, 1) != 1)
+      missed_signal = c;
+  }
+}
+
+/*
+ * PurpleRuby.drain(deadline = PurpleRuby.drain_deadline)
+ *
+ * Start the drain as SIGTERM does; main_loop_run returns when it is done.
+ */
+static VALUE drain(int argc, VALUE* argv, VALUE self)
+{
+  VALUE seconds;
+
+  rb_scan_args(argc, argv, "01", &seconds);
+  drain_start(NIL_P(seconds) ? deadline_seconds : NUM2DBL(seconds));
+  return Qnil;
+}
+
+static VALUE is_draining(VALUE self)
+{
+  return DRAIN_FLUSH == state || DRAIN_SIGNOFF == state ? Qtrue : Qfalse;
+}
+
+/*
+ * PurpleRuby.drain_deadline = seconds
+ */
+static VALUE set_drain_deadline(VALUE self, VALUE seconds)
+{
+  double value = NUM2DBL(seconds);
+
+  if (value < 0)
+    rb_raise(rb_eArgError, "drain_deadline should not be negative");
+  deadline_seconds = value;
+  return seconds;
+}
+
+static VALUE get_drain_deadline(VALUE self)
+{
+  return rb_float_new(deadline_seconds);
+}
+
+/*
+ * PurpleRuby.drain_batch = accounts signed off per tick
+ */
+static VALUE set_drain_batch(VALUE self, VALUE count)
+{
+  if (NUM2UINT(count) < 1)
+    rb_raise(rb_eArgError, "drain_batch should be positive");
+  drain_batch = NUM2UINT(count);
+  return count;
+}
+
+/*
+ * PurpleRuby.drain_stats => Hash
+ */
+static VALUE drain_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+  static const char *states[] = { "idle", "flush", "signoff", "done" };
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("state")), ID2SYM(rb_intern(states[state])));
+  rb_hash_aset(hash, ID2SYM(rb_intern("seconds")),
+    rb_float_new(DRAIN_IDLE == state ? 0 : (g_get_monotonic_time() - drain_started) / 1e6));
+  rb_hash_aset(hash, ID2SYM(rb_intern("timed_out")), timed_out ? Qtrue : Qfalse);
+  rb_hash_aset(hash, ID2SYM(rb_intern("signed_off")), UINT2NUM(signed_off));
+  rb_hash_aset(hash, ID2SYM(rb_intern("conversations_closed")), UINT2NUM(conversations_closed));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dropped_ipc")), UINT2NUM(dropped_ipc));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dropped_deferred")), ULONG2NUM(dropped_deferred));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dropped_xfers")), UINT2NUM(dropped_xfers));
+  rb_hash_aset(hash, ID2SYM(rb_intern("spooled")), ULONG2NUM(spooled));
+
+  return hash;
+}
+
+void init_drain(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "drain", drain, -1);
+  rb_define_singleton_method(cPurpleRuby, "draining?", is_draining, 0);
+  rb_define_singleton_method(cPurpleRuby, "drain_deadline=", set_drain_deadline, 1);
+  rb_define_singleton_method(cPurpleRuby, "drain_deadline", get_drain_deadline, 0);
+  rb_define_singleton_method(cPurpleRuby, "drain_batch=", set_drain_batch, 1);
+  rb_define_singleton_method(cPurpleRuby, "drain_stats", drain_stats, 0);
+}
@@ -0,0 +1,510 @@
+/*
+ * libpurple eventloop ui ops.
+ *
+ * Timeouts are timers on the wheel in timer.c.
+ *
+ * fd watches do not get a GIOChannel and a GSource each. On Linux all of them
+ * share one epoll fd behind a single GSource, so the main loop polls one fd no
+ * matter how many connections there are, and a watch costs a small
+ * InputWatch plus a slot in an array indexed by fd. Several watches on the
+ * same fd (libpurple adds a write watch next to the read watch while it has
+ * data to flush) share the slot and its epoll registration.
+ *
+ * fds epoll refuses (regular files) and systems without epoll fall back to a
+ * GIOChannel watch per fd, as before.
+ *
+ * Watches should be removed before their fd is closed. epoll keeps a
+ * registration until every fd sharing the open file (dup, fork) is closed,
+ * and it can not be deleted by fd number once that fd is gone. Each
+ * registration carries a generation of its slot, so an event from such a
+ * leftover (no watches, or an older generation) is recognized and the epoll
+ * set is rebuilt from the live slots instead of spinning on it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/eventloop.h>
+
+#include <ruby.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#define PURPLE_GLIB_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
+#define PURPLE_GLIB_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
+
+#define EPOLL_BATCH 256
+
+extern guint timer_timeout_add(guint interval, GSourceFunc function, gpointer data);
+extern guint timer_timeout_add_seconds(guint interval, GSourceFunc function, gpointer data);
+extern gboolean timer_timeout_remove(guint id);
+
+typedef struct _InputWatch InputWatch;
+
+struct _InputWatch {
+  InputWatch *next;   /* next watch on the same fd */
+  guint handle;
+  gint fd;
+  guint serial;       /* wakeup it was added in */
+  guint source;       /* GIOChannel watch, 0 when it is in the epoll set */
+  PurpleInputCondition condition;
+  PurpleInputFunction function;
+  gpointer data;
+};
+
+/* handle -> InputWatch */
+static GHashTable *input_watches = NULL;
+static guint next_handle = 1;
+
+static unsigned long wakeups = 0;
+static unsigned long fd_events = 0;
+
+static gboolean glib_input_invoke(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+  InputWatch *watch = data;
+  PurpleInputCondition purple_cond = 0;
+
+  if (condition & PURPLE_GLIB_READ_COND)
+    purple_cond |= PURPLE_INPUT_READ;
+  if (condition & PURPLE_GLIB_WRITE_COND)
+    purple_cond |= PURPLE_INPUT_WRITE;
+
+  wakeups++;
+  fd_events++;
+  watch->function(watch->data, watch->fd, purple_cond);
+
+  return TRUE;
+}
+
+static void glib_input_add(InputWatch *watch)
+{
+  GIOChannel *channel;
+  GIOCondition cond = 0;
+
+  if (watch->condition & PURPLE_INPUT_READ)
+    cond |= PURPLE_GLIB_READ_COND;
+  if (watch->condition & PURPLE_INPUT_WRITE)
+    cond |= PURPLE_GLIB_WRITE_COND;
+
+  channel = g_io_channel_unix_new(watch->fd);
+  watch->source = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond,
+                                      glib_input_invoke, watch, NULL);
+  g_io_channel_unref(channel);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/* the watches on one fd */
+typedef struct {
+  InputWatch *watches;
+  guint32 events;     /* registered with epoll */
+  guint32 generation; /* bumped when the fd leaves the set */
+} FdSlot;
+
+typedef struct {
+  GSource source;
+  GPollFD pollfd;
+} EpollSource;
+
+static int epoll_fd = -1;
+static gboolean epoll_failed = FALSE;
+static FdSlot *slots = NULL;
+static gint slots_len = 0;
+static guint epoll_fds = 0;
+static unsigned long epoll_rebuilds = 0;
+
+static guint wake_serial = 0;
+static gboolean dispatching = FALSE;
+/* removed while dispatching, freed when it is done */
+static GSList *dead_watches = NULL;
+
+static gboolean epoll_prepare(GSource *source, gint *timeout)
+{
+  *timeout = -1;
+  return FALSE;
+}
+
+static gboolean epoll_check(GSource *source)
+{
+  return (((EpollSource *)source)->pollfd.revents & G_IO_IN) != 0;
+}
+
+static guint64 registration(gint fd, FdSlot *slot)
+{
+  return ((guint64)slot->generation << 32) | (guint32)fd;
+}
+
+/* add or modify the registration of fd, libpurple may have closed and reused it */
+static int epoll_register(gint fd, FdSlot *slot, guint32 events)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.u64 = registration(fd, slot);
+
+  if (0 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event))
+    return 0;
+  if (EEXIST == errno)
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+  return -1;
+}
+
+/*
+ * Replace the epoll set with one holding only the live slots. The new set
+ * takes over the fd number of the old one, which the GSource polls.
+ */
+static void epoll_rebuild()
+{
+  int fresh = epoll_create1(EPOLL_CLOEXEC);
+  gint fd;
+
+  if (fresh < 0)
+    return;
+  if (dup2(fresh, epoll_fd) < 0) {
+    close(fresh);
+    return;
+  }
+  close(fresh);
+  fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+
+  epoll_rebuilds++;
+  epoll_fds = 0;
+  for (fd = 0; fd < slots_len; fd++) {
+    if (0 == slots[fd].events)
+      continue;
+    /* closed without removing its watches, they can not fire anymore */
+    if (epoll_register(fd, &slots[fd], slots[fd].events) < 0) {
+      slots[fd].events = 0;
+      slots[fd].generation++;
+      continue;
+    }
+    epoll_fds++;
+  }
+}
+
+typedef struct {
+  InputWatch *watch;
+  gint fd;
+  PurpleInputCondition cond;
+} WatchCall;
+
+static VALUE watch_call(VALUE data)
+{
+  WatchCall *call = (WatchCall *)data;
+  call->watch->function(call->watch->data, call->fd, call->cond);
+  return Qnil;
+}
+
+static VALUE pending_error = Qnil;
+
+static gboolean raise_pending(gpointer data)
+{
+  VALUE error = pending_error;
+
+  pending_error = Qnil;
+  rb_exc_raise(error);
+  return FALSE;
+}
+
+static gboolean epoll_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  struct epoll_event ready[EPOLL_BATCH];
+  VALUE error = Qnil;
+  gboolean stale = FALSE;
+  int n, i, state;
+
+  wakeups++;
+  wake_serial++;
+  dispatching = TRUE;
+
+  n = epoll_wait(epoll_fd, ready, EPOLL_BATCH, 0);
+  for (i = 0; i < n; i++) {
+    gint fd = (gint)(guint32)ready[i].data.u64;
+    PurpleInputCondition cond = 0;
+    InputWatch *watch;
+
+    if (fd >= slots_len || 0 == slots[fd].events || ready[i].data.u64 != registration(fd, &slots[fd])) {
+      stale = TRUE;
+      continue;
+    }
+
+    if (ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      cond |= PURPLE_INPUT_READ;
+    if (ready[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+      cond |= PURPLE_INPUT_WRITE;
+
+    fd_events++;
+
+    /*
+     * Removed watches stay allocated until we are done, so following next is
+     * safe. Watches added by a callback wait for the next wakeup, the event may
+     * be for an fd that was closed and reused.
+     */
+    for (watch = slots[fd].watches; watch != NULL; watch = watch->next) {
+      if (watch->function != NULL && watch->serial != wake_serial && (watch->condition & cond)) {
+        /* a raising callback must not leave dispatching set, the error is raised below */
+        WatchCall call = { watch, fd, cond };
+        rb_protect(watch_call, (VALUE)&call, &state);
+        if (state && NIL_P(error)) {
+          error = rb_errinfo();
+          rb_set_errinfo(Qnil);
+        }
+      }
+    }
+  }
+
+  dispatching = FALSE;
+  g_slist_free_full(dead_watches, g_free);
+  dead_watches = NULL;
+
+  if (stale)
+    epoll_rebuild();
+
+  /*
+   * Raising through glib from here would leave this source marked as
+   * running, and it would never be dispatched again. A one shot source
+   * raises it instead.
+   */
+  if (!NIL_P(error) && NIL_P(pending_error)) {
+    pending_error = error;
+    g_idle_add_full(G_PRIORITY_HIGH, raise_pending, NULL, NULL);
+  }
+
+  return TRUE;
+}
+
+static GSourceFuncs epoll_source_funcs = {
+  epoll_prepare,
+  epoll_check,
+  epoll_dispatch,
+  NULL
+};
+
+static gboolean epoll_init()
+{
+  EpollSource *source;
+
+  if (epoll_fd >= 0)
+    return TRUE;
+  if (epoll_failed)
+    return FALSE;
+
+  rb_global_variable(&pending_error);
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    epoll_failed = TRUE;
+    return FALSE;
+  }
+
+  source = (EpollSource *)g_source_new(&epoll_source_funcs, sizeof(EpollSource));
+  source->pollfd.fd = epoll_fd;
+  source->pollfd.events = G_IO_IN;
+  g_source_add_poll(&source->source, &source->pollfd);
+  g_source_set_priority(&source->source, G_PRIORITY_DEFAULT);
+  g_source_attach(&source->source, NULL);
+  g_source_unref(&source->source);
+
+  return TRUE;
+}
+
+static guint32 slot_events(FdSlot *slot)
+{
+  guint32 events = 0;
+  InputWatch *watch;
+
+  for (watch = slot->watches; watch != NULL; watch = watch->next) {
+    if (watch->condition & PURPLE_INPUT_READ)
+      events |= EPOLLIN;
+    if (watch->condition & PURPLE_INPUT_WRITE)
+      events |= EPOLLOUT;
+  }
+
+  return events;
+}
+
+static gboolean epoll_input_add(InputWatch *watch)
+{
+  gint fd = watch->fd;
+  FdSlot *slot;
+  guint32 events;
+
+  if (!epoll_init())
+    return FALSE;
+
+  if (fd >= slots_len) {
+    gint len = MAX(fd + 1, MAX(slots_len * 2, 64));
+    slots = g_renew(FdSlot, slots, len);
+    memset(slots + slots_len, 0, (len - slots_len) * sizeof(FdSlot));
+    slots_len = len;
+  }
+
+  slot = &slots[fd];
+  watch->next = slot->watches;
+  slot->watches = watch;
+  events = slot_events(slot);
+
+  if (epoll_register(fd, slot, events) < 0) {
+    slot->watches = watch->next;
+    return FALSE;
+  }
+
+  if (0 == slot->events)
+    epoll_fds++;
+  slot->events = events;
+  return TRUE;
+}
+
+static void epoll_input_remove(InputWatch *watch)
+{
+  FdSlot *slot = &slots[watch->fd];
+  InputWatch **link;
+  struct epoll_event event;
+  guint32 events;
+
+  for (link = &slot->watches; *link != NULL; link = &(*link)->next) {
+    if (*link == watch) {
+      *link = watch->next;
+      break;
+    }
+  }
+
+  events = slot_events(slot);
+  if (events != slot->events) {
+    /*
+     * This fails when the fd was closed first. The registration is gone with
+     * it unless the open file is shared, then epoll_dispatch finds it stale.
+     */
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.u64 = registration(watch->fd, slot);
+    epoll_ctl(epoll_fd, events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL, watch->fd, &event);
+    if (0 == events) {
+      epoll_fds--;
+      slot->generation++;
+    }
+    slot->events = events;
+  }
+
+  if (dispatching) {
+    watch->function = NULL;
+    dead_watches = g_slist_prepend(dead_watches, watch);
+  } else {
+    g_free(watch);
+  }
+}
+
+#endif
+
+static guint input_add(gint fd, PurpleInputCondition condition, PurpleInputFunction function, gpointer data)
+{
+  InputWatch *watch = g_new0(InputWatch, 1);
+
+  if (NULL == input_watches)
+    input_watches = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  watch->fd = fd;
+  watch->condition = condition;
+  watch->function = function;
+  watch->data = data;
+
+  /* handles are ours, they are only passed to input_remove */
+  do {
+    watch->handle = next_handle++;
+  } while (0 == watch->handle || g_hash_table_lookup(input_watches, GUINT_TO_POINTER(watch->handle)) != NULL);
+
+#ifdef HAVE_SYS_EPOLL_H
+  watch->serial = wake_serial;
+  if (!epoll_input_add(watch))
+#endif
+    glib_input_add(watch);
+
+  g_hash_table_insert(input_watches, GUINT_TO_POINTER(watch->handle), watch);
+  return watch->handle;
+}
+
+static gboolean input_remove(guint handle)
+{
+  InputWatch *watch = input_watches ? g_hash_table_lookup(input_watches, GUINT_TO_POINTER(handle)) : NULL;
+
+  if (NULL == watch)
+    return FALSE;
+
+  g_hash_table_remove(input_watches, GUINT_TO_POINTER(handle));
+
+  if (watch->source != 0) {
+    g_source_remove(watch->source);
+    g_free(watch);
+    return TRUE;
+  }
+
+#ifdef HAVE_SYS_EPOLL_H
+  epoll_input_remove(watch);
+#endif
+  return TRUE;
+}
+
+/* timeouts go to the timing wheel in timer.c */
+static PurpleEventLoopUiOps eventloop_ui_ops =
+{
+  timer_timeout_add,
+  timer_timeout_remove,
+  input_add,
+  input_remove,
+  NULL,
+  timer_timeout_add_seconds,
+
+  /* padding */
+  NULL,
+  NULL,
+  NULL
+};
+
+PurpleEventLoopUiOps* eventloop_get_ui_ops()
+{
+  return &eventloop_ui_ops;
+}
+
+/*
+ * PurpleRuby.eventloop_stats => Hash
+ *
+ * :watches fd watches, :epoll_fds fds in the epoll set, :wakeups and
+ * :fd_events since start, :epoll_rebuilds for stale registrations dropped.
+ */
+static VALUE eventloop_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("watches")), UINT2NUM(input_watches ? g_hash_table_size(input_watches) : 0));
+#ifdef HAVE_SYS_EPOLL_H
+  rb_hash_aset(hash, ID2SYM(rb_intern("epoll_fds")), UINT2NUM(epoll_fds));
+  rb_hash_aset(hash, ID2SYM(rb_intern("epoll_rebuilds")), ULONG2NUM(epoll_rebuilds));
+#endif
+  rb_hash_aset(hash, ID2SYM(rb_intern("wakeups")), ULONG2NUM(wakeups));
+  rb_hash_aset(hash, ID2SYM(rb_intern("fd_events")), ULONG2NUM(fd_events));
+
+  return hash;
+}
+
+void init_eventloop(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "eventloop_stats", eventloop_stats, 0);
+}
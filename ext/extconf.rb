@@ -3,4 +3,8 @@ $CFLAGS = "#{ENV['CFLAGS']} -Wall -O3 -g"
 pkg_config 'purple'
 pkg_config 'glib-2.0'
 pkg_config 'gthread-2.0'
+have_header 'sys/sdt.h'
+have_header 'sys/epoll.h'
+have_header 'sys/eventfd.h'
+have_library 'dl', 'dlopen'
 create_makefile('purple_ruby')
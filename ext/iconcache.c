@@ -0,0 +1,302 @@
+/*
+ * Size bounded buddy icon cache.
+ *
+ * By default libpurple keeps the icon of every buddy of every account in
+ * memory. With PurpleRuby.icon_cache(max_bytes) the icons attached to buddies
+ * are tracked in LRU order and the least recently used ones are detached when
+ * the total goes over max_bytes. The checksum stays on the buddy so the prpl
+ * does not fetch it again, and Buddy#avatar reloads it from the icon cache
+ * dir when it is asked for.
+ *
+ * Accounts with Account#store_icons = false never keep icons in memory.
+ *
+ * Buddy#avatar returns frozen strings, cached by checksum, so reading the
+ * same icon repeatedly does not copy it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/blist.h>
+#include <libpurple/buddyicon.h>
+#include <libpurple/signals.h>
+
+#include <ruby.h>
+
+#ifndef RSTRING_LEN
+#define RSTRING_LEN(s) (RSTRING(s)->len)
+#endif
+
+extern VALUE cAccount;
+extern PurpleAccount* get_account_from_ruby_object(VALUE acc);
+
+typedef struct {
+  PurpleBuddy *buddy;
+  gsize bytes;
+  GList *link;
+} IconEntry;
+
+static gboolean enabled = FALSE;
+static gsize max_bytes = 0;
+
+/* least recently used first */
+static GQueue *lru = NULL;
+/* PurpleBuddy* -> IconEntry */
+static GHashTable *icon_entries = NULL;
+static gsize icon_bytes = 0;
+/* accounts that do not keep icons */
+static GHashTable *no_icon_accounts = NULL;
+/* set while we detach an icon ourselves */
+static gboolean detaching = FALSE;
+
+/* checksum -> frozen String, insertion ordered so the first key is the oldest */
+static VALUE avatar_strings = Qnil;
+static gsize string_bytes = 0;
+
+static unsigned long evictions = 0;
+static unsigned long string_hits = 0;
+static unsigned long string_misses = 0;
+
+static void remove_entry(PurpleBuddy *buddy)
+{
+  IconEntry *entry = g_hash_table_lookup(icon_entries, buddy);
+
+  if (NULL == entry)
+    return;
+
+  g_queue_delete_link(lru, entry->link);
+  icon_bytes -= entry->bytes;
+  g_hash_table_remove(icon_entries, buddy);
+  g_free(entry);
+}
+
+static void detach_icon(PurpleBuddy *buddy)
+{
+  detaching = TRUE;
+  purple_buddy_set_icon(buddy, NULL);
+  detaching = FALSE;
+}
+
+static void buddy_icon_changed_cb(PurpleBuddy *buddy, gpointer data)
+{
+  PurpleBuddyIcon *icon;
+  IconEntry *entry;
+  size_t len = 0;
+
+  remove_entry(buddy);
+
+  if (detaching)
+    return;
+
+  icon = purple_buddy_get_icon(buddy);
+  if (NULL == icon)
+    return;
+
+  if (g_hash_table_lookup(no_icon_accounts, purple_buddy_get_account(buddy)) != NULL) {
+    detach_icon(buddy);
+    return;
+  }
+
+  purple_buddy_icon_get_data(icon, &len);
+
+  entry = g_new0(IconEntry, 1);
+  entry->buddy = buddy;
+  entry->bytes = len;
+  g_queue_push_tail(lru, entry);
+  entry->link = g_queue_peek_tail_link(lru);
+  g_hash_table_insert(icon_entries, buddy, entry);
+  icon_bytes += len;
+
+  while (icon_bytes > max_bytes && g_queue_get_length(lru) > 1) {
+    IconEntry *victim = g_queue_peek_head(lru);
+    PurpleBuddy *victim_buddy = victim->buddy;
+    remove_entry(victim_buddy);
+    detach_icon(victim_buddy);
+    evictions++;
+  }
+}
+
+static void buddy_removed_cb(PurpleBuddy *buddy, gpointer data)
+{
+  remove_entry(buddy);
+}
+
+static void *icon_cache_get_handle(void)
+{
+  static int handle;
+
+  return &handle;
+}
+
+gboolean icon_cache_enabled()
+{
+  return enabled;
+}
+
+static VALUE frozen_avatar(const char *checksum, gconstpointer data, size_t len)
+{
+  VALUE key, str;
+
+  if (NULL == checksum) {
+    str = rb_str_new(data, len);
+    OBJ_FREEZE(str);
+    return str;
+  }
+
+  key = rb_str_new2(checksum);
+  str = rb_hash_lookup(avatar_strings, key);
+  if (!NIL_P(str)) {
+    /* move it to the end, it is the most recently used now */
+    rb_hash_delete(avatar_strings, key);
+    rb_hash_aset(avatar_strings, key, str);
+    string_hits++;
+    return str;
+  }
+
+  string_misses++;
+  str = rb_str_new(data, len);
+  OBJ_FREEZE(str);
+  rb_hash_aset(avatar_strings, key, str);
+  string_bytes += len;
+
+  while (string_bytes > max_bytes && RHASH_SIZE(avatar_strings) > 1) {
+    VALUE oldest = rb_funcall(avatar_strings, rb_intern("shift"), 0);
+    string_bytes -= RSTRING_LEN(rb_ary_entry(oldest, 1));
+  }
+
+  return str;
+}
+
+/* Buddy#avatar when the cache is enabled */
+VALUE icon_cache_get_avatar(PurpleBuddy *buddy)
+{
+  PurpleBuddyIcon *icon = purple_buddy_get_icon(buddy);
+  VALUE str;
+  size_t len = 0;
+  gconstpointer data;
+
+  if (icon != NULL) {
+    IconEntry *entry = g_hash_table_lookup(icon_entries, buddy);
+    if (entry != NULL) {
+      g_queue_unlink(lru, entry->link);
+      g_queue_push_tail_link(lru, entry->link);
+    }
+    data = purple_buddy_icon_get_data(icon, &len);
+    return frozen_avatar(purple_buddy_icon_get_checksum(icon), data, len);
+  }
+
+  /*
+   * Load it back from the icon cache dir, if we detached it. That attaches it
+   * to the buddy again; keep the signal handler away until we hold a reference.
+   */
+  detaching = TRUE;
+  icon = purple_buddy_icons_find(purple_buddy_get_account(buddy), purple_buddy_get_name(buddy));
+  detaching = FALSE;
+  if (NULL == icon)
+    return Qnil;
+
+  /* purple_buddy_icons_find returned a reference of ours, dropped below */
+  data = purple_buddy_icon_get_data(icon, &len);
+  str = frozen_avatar(purple_buddy_icon_get_checksum(icon), data, len);
+
+  /* put it in the LRU, or detach it again for accounts that opted out */
+  if (purple_buddy_get_icon(buddy) != NULL)
+    buddy_icon_changed_cb(buddy, NULL);
+
+  purple_buddy_icon_unref(icon);
+  return str;
+}
+
+/*
+ * PurpleRuby.icon_cache(max_bytes, disk = true)
+ *
+ * Keep at most max_bytes of buddy icons in memory (and as many in the frozen
+ * strings returned by Buddy#avatar). With disk = false libpurple does not
+ * write icons to the icon cache dir either, so detached icons are gone until
+ * the buddy's icon changes. Call it after PurpleRuby.init.
+ */
+static VALUE icon_cache(int argc, VALUE* argv, VALUE self)
+{
+  VALUE bytes, disk;
+
+  rb_scan_args(argc, argv, "11", &bytes, &disk);
+
+  max_bytes = NUM2ULONG(bytes);
+  purple_buddy_icons_set_caching((NIL_P(disk) || RTEST(disk)) ? TRUE : FALSE);
+
+  if (!enabled) {
+    lru = g_queue_new();
+    icon_entries = g_hash_table_new(g_direct_hash, g_direct_equal);
+    if (NULL == no_icon_accounts)
+      no_icon_accounts = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    rb_global_variable(&avatar_strings);
+    avatar_strings = rb_hash_new();
+
+    purple_signal_connect(purple_blist_get_handle(), "buddy-icon-changed",
+              icon_cache_get_handle(), PURPLE_CALLBACK(buddy_icon_changed_cb), NULL);
+    purple_signal_connect(purple_blist_get_handle(), "buddy-removed",
+              icon_cache_get_handle(), PURPLE_CALLBACK(buddy_removed_cb), NULL);
+    enabled = TRUE;
+  }
+
+  return bytes;
+}
+
+/*
+ * Account#store_icons = false
+ *
+ * Don't keep buddy icons of this account in memory. Takes effect for icons
+ * received from now on, and needs PurpleRuby.icon_cache.
+ */
+static VALUE set_store_icons(VALUE self, VALUE store)
+{
+  PurpleAccount *account = get_account_from_ruby_object(self);
+
+  if (NULL == no_icon_accounts)
+    no_icon_accounts = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  if (RTEST(store))
+    g_hash_table_remove(no_icon_accounts, account);
+  else
+    g_hash_table_insert(no_icon_accounts, account, account);
+
+  return store;
+}
+
+/*
+ * PurpleRuby.icon_cache_stats => Hash
+ */
+static VALUE icon_cache_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("icons")), UINT2NUM(lru ? g_queue_get_length(lru) : 0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), ULONG2NUM(icon_bytes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("max_bytes")), ULONG2NUM(max_bytes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), ULONG2NUM(evictions));
+  rb_hash_aset(hash, ID2SYM(rb_intern("string_bytes")), ULONG2NUM(string_bytes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("string_hits")), ULONG2NUM(string_hits));
+  rb_hash_aset(hash, ID2SYM(rb_intern("string_misses")), ULONG2NUM(string_misses));
+
+  return hash;
+}
+
+void init_icon_cache(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "icon_cache", icon_cache, -1);
+  rb_define_singleton_method(cPurpleRuby, "icon_cache_stats", icon_cache_stats, 0);
+  rb_define_method(cAccount, "store_icons=", set_store_icons, 1);
+}
@@ -0,0 +1,540 @@
+/*
+ * Append-only journal of inbound events.
+ *
+ * After PurpleRuby.journal_open(dir), received IMs (write_conv), signed-on,
+ * signed-off, connection errors and buddy updates are appended to mmap'd
+ * segment files in dir before the callback returns, whether or not a ruby
+ * handler is set. Consumers read them back by offset with journal_read, at
+ * their own pace, and journal_trim drops the segments they are done with.
+ *
+ * Offsets are byte positions in the whole journal: a segment file is named
+ * after the offset of its first record, the next segment starts where the
+ * last record of the previous one ends. A record's size is written last, so
+ * after a crash the journal ends at the first record without one. Records
+ * survive the process dying, journal_sync also flushes them to disk.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/blist.h>
+#include <libpurple/connection.h>
+#include <libpurple/conversation.h>
+#include <libpurple/debug.h>
+#include <libpurple/signals.h>
+#include <libpurple/status.h>
+
+#include <ruby.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_ALIGN(n) (((n) + 7) & ~(gsize)7)
+#define JOURNAL_FIELDS 4
+
+extern VALUE cAccount;
+
+enum {
+  JOURNAL_IM = 1,
+  JOURNAL_SIGNED_ON,
+  JOURNAL_SIGNED_OFF,
+  JOURNAL_CONNECTION_ERROR,
+  JOURNAL_BUDDY
+};
+
+/* followed by protocol, username, who and text, padded to 8 bytes */
+typedef struct {
+  guint32 size;         /* whole record, written last: 0 is the end */
+  guint16 type;
+  guint16 reserved;
+  gint64 time;          /* g_get_real_time() */
+  gint32 code;          /* disconnect reason */
+  guint32 len[JOURNAL_FIELDS];
+} JournalRecord;
+
+typedef struct {
+  guint64 base;         /* offset of the first record */
+  char *map;
+  gsize size;
+} Segment;
+
+static char *journal_dir = NULL;
+static GQueue *segments = NULL;   /* Segment*, oldest first */
+static gsize segment_size = 64 * 1024 * 1024;
+static guint64 tail = 0;          /* offset of the next record */
+
+static unsigned long appended = 0;
+static unsigned long dropped = 0;
+
+static Segment *segment_map(guint64 base, gboolean create)
+{
+  char *path = g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x" JOURNAL_SUFFIX, journal_dir, base);
+  Segment *segment = NULL;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(path, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+  if (fd < 0)
+    goto out;
+
+  if (create && ftruncate(fd, segment_size) != 0)
+    goto out;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(JournalRecord))
+    goto out;
+
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == map)
+    goto out;
+
+  segment = g_new0(Segment, 1);
+  segment->base = base;
+  segment->map = map;
+  segment->size = st.st_size;
+
+out:
+  if (NULL == segment)
+    purple_debug_error("purple_ruby", "journal: %s: %s\n", path, g_strerror(errno));
+  if (fd >= 0)
+    close(fd);
+  g_free(path);
+  return segment;
+}
+
+static void segment_free(Segment *segment)
+{
+  munmap(segment->map, segment->size);
+  g_free(segment);
+}
+
+/* where the records of segment end */
+static guint64 segment_end(Segment *segment)
+{
+  gsize offset = 0;
+
+  while (offset + sizeof(JournalRecord) <= segment->size) {
+    JournalRecord *record = (JournalRecord *)(segment->map + offset);
+    if (0 == record->size || offset + record->size > segment->size)
+      break;
+    offset += record->size;
+  }
+  return segment->base + offset;
+}
+
+/* whether a record of size > 0 at pos fits segment, and its fields fit the record */
+static gboolean record_valid(Segment *segment, gsize pos)
+{
+  JournalRecord *record = (JournalRecord *)(segment->map + pos);
+  gsize fields = 0;
+  int i;
+
+  if (record->size < sizeof(JournalRecord) || record->size != JOURNAL_ALIGN(record->size) ||
+      record->size > segment->size - pos)
+    return FALSE;
+  for (i = 0; i < JOURNAL_FIELDS; i++)
+    fields += record->len[i];
+  return fields <= record->size - sizeof(JournalRecord);
+}
+
+/* the segment holding offset */
+static Segment *segment_find(guint64 offset)
+{
+  GList *l;
+
+  for (l = segments->tail; l != NULL; l = l->prev) {
+    Segment *segment = l->data;
+    if (segment->base <= offset)
+      return segment;
+  }
+  return NULL;
+}
+
+static void journal_append(int type, PurpleAccount *account, const char *who, const char *text, int code)
+{
+  Segment *segment;
+  JournalRecord *record;
+  const char *fields[JOURNAL_FIELDS];
+  gsize size;
+  char *p;
+  int i;
+
+  fields[0] = purple_account_get_protocol_id(account);
+  fields[1] = purple_account_get_username(account);
+  fields[2] = who;
+  fields[3] = text;
+
+  size = sizeof(JournalRecord);
+  for (i = 0; i < JOURNAL_FIELDS; i++)
+    size += fields[i] ? strlen(fields[i]) : 0;
+  size = JOURNAL_ALIGN(size);
+
+  segment = g_queue_peek_tail(segments);
+  if (tail - segment->base + size > segment->size) {
+    Segment *next;
+
+    if (size > segment_size || NULL == (next = segment_map(tail, TRUE))) {
+      dropped++;
+      return;
+    }
+    g_queue_push_tail(segments, next);
+    segment = next;
+  }
+
+  record = (JournalRecord *)(segment->map + (tail - segment->base));
+  record->type = type;
+  record->reserved = 0;
+  record->time = g_get_real_time();
+  record->code = code;
+  p = (char *)(record + 1);
+  for (i = 0; i < JOURNAL_FIELDS; i++) {
+    record->len[i] = fields[i] ? strlen(fields[i]) : 0;
+    if (record->len[i] > 0)
+      memcpy(p, fields[i], record->len[i]);
+    p += record->len[i];
+  }
+  __sync_synchronize();
+  record->size = size;
+
+  tail += size;
+  appended++;
+}
+
+/* hooks from purple_ruby.c, no-ops while the journal is closed */
+void journal_im(PurpleAccount *account, const char *who, const char *message, PurpleMessageFlags flags)
+{
+  /* write_conv also shows what we sent */
+  if (segments != NULL && (flags & PURPLE_MESSAGE_RECV))
+    journal_append(JOURNAL_IM, account, who, message, 0);
+}
+
+void journal_disconnect(PurpleAccount *account, int reason, const char *text)
+{
+  if (segments != NULL)
+    journal_append(JOURNAL_CONNECTION_ERROR, account, NULL, text, reason);
+}
+
+void journal_buddy(PurpleBuddy *buddy)
+{
+  if (segments != NULL) {
+    PurpleStatus *status = purple_presence_get_active_status(purple_buddy_get_presence(buddy));
+    journal_append(JOURNAL_BUDDY, purple_buddy_get_account(buddy), purple_buddy_get_name(buddy),
+                   status ? purple_status_get_id(status) : NULL, 0);
+  }
+}
+
+static void journal_signed_on(PurpleConnection *gc, gpointer data)
+{
+  if (segments != NULL)
+    journal_append(JOURNAL_SIGNED_ON, purple_connection_get_account(gc), NULL, NULL, 0);
+}
+
+static void journal_signed_off(PurpleConnection *gc, gpointer data)
+{
+  if (segments != NULL)
+    journal_append(JOURNAL_SIGNED_OFF, purple_connection_get_account(gc), NULL, NULL, 0);
+}
+
+static void *journal_get_handle(void)
+{
+  static int handle;
+
+  return &handle;
+}
+
+static gint compare_base(gconstpointer a, gconstpointer b, gpointer data)
+{
+  guint64 x = ((const Segment *)a)->base, y = ((const Segment *)b)->base;
+
+  return x < y ? -1 : x > y;
+}
+
+static void journal_free()
+{
+  Segment *segment;
+
+  if (NULL == segments)
+    return;
+
+  while ((segment = g_queue_pop_head(segments)) != NULL)
+    segment_free(segment);
+  g_queue_free(segments);
+  segments = NULL;
+  g_free(journal_dir);
+  journal_dir = NULL;
+}
+
+/*
+ * PurpleRuby.journal_open(dir, segment_size = 64 MB) => tail offset
+ *
+ * Appends to the journal already in dir, if any.
+ */
+static VALUE journal_open(int argc, VALUE *argv, VALUE self)
+{
+  VALUE dir, size;
+  GDir *d;
+  const char *name;
+
+  rb_scan_args(argc, argv, "11", &dir, &size);
+
+  if (segments != NULL)
+    rb_raise(rb_eRuntimeError, "journal: already open in %s", journal_dir);
+  if (!NIL_P(size)) {
+    if (NUM2SIZET(size) < 4096)
+      rb_raise(rb_eArgError, "journal: segment_size must be at least 4096");
+    segment_size = NUM2SIZET(size);
+  }
+
+  if (g_mkdir_with_parents(StringValueCStr(dir), 0700) != 0)
+    rb_raise(rb_eRuntimeError, "journal: %s: %s", StringValueCStr(dir), g_strerror(errno));
+  d = g_dir_open(StringValueCStr(dir), 0, NULL);
+  if (NULL == d)
+    rb_raise(rb_eRuntimeError, "journal: cannot read %s", StringValueCStr(dir));
+
+  journal_dir = g_strdup(StringValueCStr(dir));
+  segments = g_queue_new();
+
+  while ((name = g_dir_read_name(d)) != NULL) {
+    char *end;
+    guint64 base = g_ascii_strtoull(name, &end, 16);
+    Segment *segment;
+
+    if (end != name + 16 || strcmp(end, JOURNAL_SUFFIX) != 0)
+      continue;
+    if (NULL == (segment = segment_map(base, FALSE))) {
+      g_dir_close(d);
+      journal_free();
+      rb_raise(rb_eRuntimeError, "journal: cannot map segment %s", name);
+    }
+    g_queue_insert_sorted(segments, segment, compare_base, NULL);
+  }
+  g_dir_close(d);
+
+  if (g_queue_is_empty(segments)) {
+    Segment *segment = segment_map(0, TRUE);
+    if (NULL == segment) {
+      journal_free();
+      rb_raise(rb_eRuntimeError, "journal: cannot create a segment in %s", StringValueCStr(dir));
+    }
+    g_queue_push_tail(segments, segment);
+  }
+  tail = segment_end(g_queue_peek_tail(segments));
+
+  purple_signal_connect(purple_connections_get_handle(), "signed-on", journal_get_handle(),
+            PURPLE_CALLBACK(journal_signed_on), NULL);
+  purple_signal_connect(purple_connections_get_handle(), "signed-off", journal_get_handle(),
+            PURPLE_CALLBACK(journal_signed_off), NULL);
+
+  return ULL2NUM(tail);
+}
+
+/*
+ * PurpleRuby.journal_close
+ */
+static VALUE journal_close(VALUE self)
+{
+  purple_signals_disconnect_by_handle(journal_get_handle());
+  journal_free();
+  return Qnil;
+}
+
+/* accounts is a cache for this read, purple_accounts_find is a linear search */
+static VALUE record_to_ruby(guint64 offset, JournalRecord *record, GHashTable *accounts)
+{
+  static const char *events[] = { NULL, "im", "signed_on", "signed_off", "connection_error", "buddy" };
+  VALUE fields[JOURNAL_FIELDS], args[6];
+  PurpleAccount *account;
+  char *p = (char *)(record + 1);
+  char *key;
+  int i;
+
+  for (i = 0; i < JOURNAL_FIELDS; i++) {
+    fields[i] = record->len[i] > 0 ? rb_str_new(p, record->len[i]) : Qnil;
+    p += record->len[i];
+  }
+
+  key = g_strdup_printf("%s/%s", NIL_P(fields[0]) ? "" : RSTRING_PTR(fields[0]),
+                        NIL_P(fields[1]) ? "" : RSTRING_PTR(fields[1]));
+  if (!g_hash_table_lookup_extended(accounts, key, NULL, (gpointer *)&account)) {
+    account = purple_accounts_find(NIL_P(fields[1]) ? "" : RSTRING_PTR(fields[1]),
+                                   NIL_P(fields[0]) ? "" : RSTRING_PTR(fields[0]));
+    g_hash_table_insert(accounts, key, account);
+  } else {
+    g_free(key);
+  }
+
+  args[0] = ULL2NUM(offset);
+  args[1] = record->type < G_N_ELEMENTS(events) && events[record->type] ?
+              ID2SYM(rb_intern(events[record->type])) : INT2FIX(record->type);
+  args[2] = rb_time_nano_new(record->time / G_USEC_PER_SEC, record->time % G_USEC_PER_SEC * 1000);
+  args[3] = account ? Data_Wrap_Struct(cAccount, NULL, NULL, account) : Qnil;
+  args[4] = JOURNAL_CONNECTION_ERROR == record->type ? INT2FIX(record->code) : fields[2];
+  args[5] = fields[3];
+
+  return rb_ary_new4(6, args);
+}
+
+/*
+ * PurpleRuby.journal_read(offset, limit = 256) => [records, next_offset]
+ *
+ * Each record is [offset, event, time, account, who, text]; event is :im,
+ * :signed_on, :signed_off, :connection_error (who is the reason) or :buddy
+ * (who is the buddy, text the status id). Reading from an offset that was
+ * trimmed starts at the oldest record left. An offset that is not one a
+ * record starts at (or the tail) raises ArgumentError.
+ */
+static VALUE journal_read(int argc, VALUE *argv, VALUE self)
+{
+  VALUE offset_value, limit_value, records;
+  guint64 offset;
+  long limit;
+  Segment *segment;
+  GHashTable *accounts;
+
+  rb_scan_args(argc, argv, "11", &offset_value, &limit_value);
+  if (NULL == segments)
+    rb_raise(rb_eRuntimeError, "journal: not open");
+
+  offset = NUM2ULL(offset_value);
+  limit = NIL_P(limit_value) ? 256 : NUM2LONG(limit_value);
+  records = rb_ary_new();
+
+  segment = g_queue_peek_head(segments);
+  if (offset < segment->base)
+    offset = segment->base;
+  if (offset > tail || offset != JOURNAL_ALIGN(offset))
+    rb_raise(rb_eArgError, "journal: no record at offset %" G_GUINT64_FORMAT, offset);
+
+  segment = segment_find(offset);
+  if (offset < tail && offset - segment->base + sizeof(JournalRecord) <= segment->size) {
+    /* only the first record is checked against a bad offset, the rest follow from it */
+    static const JournalRecord end;
+    JournalRecord *record = (JournalRecord *)(segment->map + (offset - segment->base));
+
+    if (0 == record->size ? memcmp(record, &end, sizeof(end)) != 0
+                          : !record_valid(segment, offset - segment->base))
+      rb_raise(rb_eArgError, "journal: no record at offset %" G_GUINT64_FORMAT, offset);
+  }
+
+  accounts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  while (offset < tail && RARRAY_LEN(records) < limit) {
+    JournalRecord *record;
+
+    segment = segment_find(offset);
+    record = (JournalRecord *)(segment->map + (offset - segment->base));
+    if (offset - segment->base + sizeof(JournalRecord) > segment->size || 0 == record->size ||
+        !record_valid(segment, offset - segment->base)) {
+      if (offset - segment->base + sizeof(JournalRecord) <= segment->size && record->size != 0)
+        purple_debug_error("purple_ruby", "journal: corrupt record at %" G_GUINT64_FORMAT ", skipping to the next segment\n", offset);
+      /* end of this segment, the next one starts here */
+      if (segment == g_queue_peek_tail(segments))
+        break;
+      offset = ((Segment *)g_queue_peek_nth(segments, g_queue_index(segments, segment) + 1))->base;
+      continue;
+    }
+
+    rb_ary_push(records, record_to_ruby(offset, record, accounts));
+    offset += record->size;
+  }
+  g_hash_table_destroy(accounts);
+
+  return rb_assoc_new(records, ULL2NUM(offset));
+}
+
+/*
+ * PurpleRuby.journal_tail => offset the next record will get
+ */
+static VALUE journal_tail(VALUE self)
+{
+  return segments ? ULL2NUM(tail) : Qnil;
+}
+
+/*
+ * PurpleRuby.journal_trim(offset) => oldest offset left
+ *
+ * Deletes the segments that end before offset; the one being written to
+ * is kept.
+ */
+static VALUE journal_trim(VALUE self, VALUE offset_value)
+{
+  guint64 offset = NUM2ULL(offset_value);
+
+  if (NULL == segments)
+    rb_raise(rb_eRuntimeError, "journal: not open");
+
+  while (g_queue_get_length(segments) > 1 &&
+         ((Segment *)g_queue_peek_nth(segments, 1))->base <= offset) {
+    Segment *segment = g_queue_pop_head(segments);
+    char *path = g_strdup_printf("%s/%016" G_GINT64_MODIFIER "x" JOURNAL_SUFFIX, journal_dir, segment->base);
+
+    unlink(path);
+    g_free(path);
+    segment_free(segment);
+  }
+
+  return ULL2NUM(((Segment *)g_queue_peek_head(segments))->base);
+}
+
+/*
+ * PurpleRuby.journal_sync
+ *
+ * Write the current segment to disk, for when surviving the process is not
+ * enough.
+ */
+static VALUE journal_sync(VALUE self)
+{
+  Segment *segment;
+
+  if (NULL == segments)
+    rb_raise(rb_eRuntimeError, "journal: not open");
+
+  segment = g_queue_peek_tail(segments);
+  if (msync(segment->map, segment->size, MS_SYNC) != 0)
+    rb_raise(rb_eRuntimeError, "journal: msync: %s", g_strerror(errno));
+  return Qnil;
+}
+
+/*
+ * PurpleRuby.journal_stats => Hash
+ */
+static VALUE journal_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("open")), segments ? Qtrue : Qfalse);
+  rb_hash_aset(hash, ID2SYM(rb_intern("segments")), UINT2NUM(segments ? g_queue_get_length(segments) : 0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("head")),
+               segments ? ULL2NUM(((Segment *)g_queue_peek_head(segments))->base) : Qnil);
+  rb_hash_aset(hash, ID2SYM(rb_intern("tail")), segments ? ULL2NUM(tail) : Qnil);
+  rb_hash_aset(hash, ID2SYM(rb_intern("appended")), ULONG2NUM(appended));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dropped")), ULONG2NUM(dropped));
+
+  return hash;
+}
+
+void init_journal(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "journal_open", journal_open, -1);
+  rb_define_singleton_method(cPurpleRuby, "journal_close", journal_close, 0);
+  rb_define_singleton_method(cPurpleRuby, "journal_read", journal_read, -1);
+  rb_define_singleton_method(cPurpleRuby, "journal_tail", journal_tail, 0);
+  rb_define_singleton_method(cPurpleRuby, "journal_trim", journal_trim, 1);
+  rb_define_singleton_method(cPurpleRuby, "journal_sync", journal_sync, 0);
+  rb_define_singleton_method(cPurpleRuby, "journal_stats", journal_stats, 0);
+}
@@ -0,0 +1,153 @@
+/*
+ * Listening socket handoff for watch_incoming_ipc.
+ *
+ * Instead of binding, watch_incoming_ipc adopts an inherited listening
+ * socket bound to the same port: one passed by systemd socket activation
+ * (LISTEN_PID/LISTEN_FDS) or listed in PURPLE_RUBY_IPC_FD by a process that
+ * exec'd us (see PurpleRuby.ipc_listen_fds). The port then never stops
+ * accepting during a restart: connections queue in the kernel while the new
+ * process starts and the old one drains. With PurpleRuby.ipc_reuseport set,
+ * new sockets get SO_REUSEPORT so that several workers can bind the same
+ * port and the kernel balances connections between them.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/debug.h>
+
+#include <ruby.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define SD_LISTEN_FDS_START 3
+
+static gboolean reuseport = FALSE;
+static unsigned long adopted = 0;
+
+/* a listening TCP socket bound to port */
+static gboolean listens_on(int fd, int port)
+{
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int accepting = 0;
+  socklen_t optlen = sizeof(accepting);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &optlen) != 0 || !accepting)
+    return FALSE;
+  if (getsockname(fd, (struct sockaddr *)&addr, &len) != 0 || addr.sin_family != AF_INET)
+    return FALSE;
+  return ntohs(addr.sin_port) == port;
+}
+
+/*
+ * Listening sockets are watched from the main loop, and with several
+ * processes on the port (SO_REUSEPORT or a handoff) another one may take
+ * the connection first: accept must then fail with EAGAIN, not block.
+ */
+static int set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return -1;
+  return 0;
+}
+
+/* an inherited listening socket for port, -1 if there is none */
+int listen_inherited(int port)
+{
+  const char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS"), *list = getenv("PURPLE_RUBY_IPC_FD");
+  int fd, n;
+
+  if (pid != NULL && fds != NULL && atol(pid) == (long)getpid()) {
+    n = atoi(fds);
+    for (fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n; fd++) {
+      if (listens_on(fd, port) && set_nonblocking(fd) == 0)
+        goto found;
+    }
+  }
+
+  while (list != NULL && *list != '\0') {
+    char *end;
+    fd = strtol(list, &end, 10);
+    if (end == list)
+      break;
+    if (listens_on(fd, port) && set_nonblocking(fd) == 0)
+      goto found;
+    list = ',' == *end ? end + 1 : end;
+  }
+
+  return -1;
+
+found:
+  adopted++;
+  purple_debug_info("purple_ruby", "adopted listening socket %d for port %d\n", fd, port);
+  return fd;
+}
+
+/* on a new listening socket, before bind */
+int listen_set_options(int soc)
+{
+  if (set_nonblocking(soc) < 0)
+    return -1;
+#ifdef SO_REUSEPORT
+  int on = 1;
+
+  if (reuseport && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    return -1;
+#else
+  if (reuseport) {
+    errno = ENOPROTOOPT;
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/*
+ * PurpleRuby.ipc_reuseport = true or false
+ *
+ * Set SO_REUSEPORT on the sockets watch_incoming_ipc binds from now on.
+ */
+static VALUE set_ipc_reuseport(VALUE self, VALUE enabled)
+{
+  reuseport = RTEST(enabled);
+  return enabled;
+}
+
+static VALUE get_ipc_reuseport(VALUE self)
+{
+  return reuseport ? Qtrue : Qfalse;
+}
+
+/*
+ * PurpleRuby.ipc_adopted => number of listening sockets taken over
+ */
+static VALUE ipc_adopted(VALUE self)
+{
+  return ULONG2NUM(adopted);
+}
+
+void init_listen(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "ipc_reuseport=", set_ipc_reuseport, 1);
+  rb_define_singleton_method(cPurpleRuby, "ipc_reuseport", get_ipc_reuseport, 0);
+  rb_define_singleton_method(cPurpleRuby, "ipc_adopted", ipc_adopted, 0);
+}
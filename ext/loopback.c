@@ -0,0 +1,352 @@
+/*
+ * prpl-loopback: an offline protocol plugin for load testing and benchmarks.
+ *
+ * Accounts sign on as soon as they connect, every IM sent is echoed back
+ * from the recipient, and PurpleRuby::Loopback can generate synthetic
+ * inbound traffic, populate buddy lists and inject connection errors.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/blist.h>
+#include <libpurple/connection.h>
+#include <libpurple/core.h>
+#include <libpurple/debug.h>
+#include <libpurple/eventloop.h>
+#include <libpurple/plugin.h>
+#include <libpurple/prpl.h>
+#include <libpurple/server.h>
+#include <libpurple/status.h>
+#include <libpurple/version.h>
+
+#include <ruby.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOPBACK_ID "prpl-loopback"
+#define TRAFFIC_TICK 10 /* ms */
+
+extern VALUE cAccount;
+extern PurpleAccount* get_account_from_ruby_object(VALUE acc);
+
+typedef struct {
+  char *who;
+  char *message;
+} LoopbackEcho;
+
+typedef struct {
+  PurpleConnection *gc;
+  GQueue *echoes;
+  guint echo_timeout;
+  guint traffic_timeout;
+  double rate;   /* synthetic inbound IMs per second */
+  double owed;   /* fractional messages carried between ticks */
+  guint buddies;
+  guint64 seq;
+} LoopbackConnection;
+
+static gboolean enabled = FALSE;
+static PurplePlugin *loopback_plugin = NULL;
+
+static const char* loopback_list_icon(PurpleAccount *account, PurpleBuddy *buddy)
+{
+  return "loopback";
+}
+
+static GList* loopback_status_types(PurpleAccount *account)
+{
+  GList *types = NULL;
+
+  types = g_list_append(types, purple_status_type_new(PURPLE_STATUS_AVAILABLE, NULL, NULL, TRUE));
+  types = g_list_append(types, purple_status_type_new(PURPLE_STATUS_OFFLINE, NULL, NULL, TRUE));
+
+  return types;
+}
+
+static void loopback_login(PurpleAccount *account)
+{
+  PurpleConnection *gc = purple_account_get_connection(account);
+  LoopbackConnection *lc = g_new0(LoopbackConnection, 1);
+
+  lc->gc = gc;
+  lc->echoes = g_queue_new();
+  gc->proto_data = lc;
+
+  purple_connection_set_state(gc, PURPLE_CONNECTED);
+}
+
+static void free_echo(gpointer data, gpointer user_data)
+{
+  LoopbackEcho *echo = data;
+  g_free(echo->who);
+  g_free(echo->message);
+  g_free(echo);
+}
+
+static void loopback_close(PurpleConnection *gc)
+{
+  LoopbackConnection *lc = gc->proto_data;
+
+  if (NULL == lc)
+    return;
+
+  if (lc->echo_timeout != 0)
+    purple_timeout_remove(lc->echo_timeout);
+  if (lc->traffic_timeout != 0)
+    purple_timeout_remove(lc->traffic_timeout);
+
+  g_queue_foreach(lc->echoes, free_echo, NULL);
+  g_queue_free(lc->echoes);
+  g_free(lc);
+  gc->proto_data = NULL;
+}
+
+/* a handler may have logged the account out, which frees the LoopbackConnection */
+static gboolean is_connected(PurpleConnection *gc)
+{
+  return g_list_find(purple_connections_get_all(), gc) != NULL;
+}
+
+/*
+ * Echoes are delivered from the main loop, so a handler that replies does not
+ * recurse. Replies queued while draining go out on the next iteration.
+ */
+static gboolean deliver_echoes(gpointer data)
+{
+  LoopbackConnection *lc = data;
+  PurpleConnection *gc = lc->gc;
+  guint n = g_queue_get_length(lc->echoes);
+  LoopbackEcho *echo;
+
+  lc->echo_timeout = 0;
+
+  while (n-- > 0 && (echo = g_queue_pop_head(lc->echoes)) != NULL) {
+    serv_got_im(gc, echo->who, echo->message, PURPLE_MESSAGE_RECV, time(NULL));
+    free_echo(echo, NULL);
+
+    if (!is_connected(gc))
+      return FALSE;
+  }
+
+  return FALSE;
+}
+
+static int loopback_send_im(PurpleConnection *gc, const char *who, const char *message,
+                            PurpleMessageFlags flags)
+{
+  LoopbackConnection *lc = gc->proto_data;
+  LoopbackEcho *echo = g_new0(LoopbackEcho, 1);
+
+  echo->who = g_strdup(who);
+  echo->message = g_strdup(message);
+  g_queue_push_tail(lc->echoes, echo);
+
+  if (0 == lc->echo_timeout)
+    lc->echo_timeout = purple_timeout_add(0, deliver_echoes, lc);
+
+  return 1;
+}
+
+static gboolean generate_traffic(gpointer data)
+{
+  LoopbackConnection *lc = data;
+  PurpleConnection *gc = lc->gc;
+  char who[32];
+  char message[64];
+
+  lc->owed += lc->rate * TRAFFIC_TICK / 1000.0;
+
+  while (lc->owed >= 1.0) {
+    lc->owed -= 1.0;
+    lc->seq++;
+
+    if (lc->buddies > 0)
+      g_snprintf(who, sizeof(who), "buddy%u", g_random_int_range(0, lc->buddies));
+    else
+      g_snprintf(who, sizeof(who), "peer");
+    g_snprintf(message, sizeof(message), "loopback %" G_GUINT64_FORMAT, lc->seq);
+
+    serv_got_im(gc, who, message, PURPLE_MESSAGE_RECV, time(NULL));
+
+    if (!is_connected(gc))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static PurplePluginProtocolInfo prpl_info =
+{
+  .options = OPT_PROTO_NO_PASSWORD,
+  .list_icon = loopback_list_icon,
+  .status_types = loopback_status_types,
+  .login = loopback_login,
+  .close = loopback_close,
+  .send_im = loopback_send_im,
+  .struct_size = sizeof(PurplePluginProtocolInfo)
+};
+
+static PurplePluginInfo info =
+{
+  .magic = PURPLE_PLUGIN_MAGIC,
+  .major_version = PURPLE_MAJOR_VERSION,
+  .minor_version = PURPLE_MINOR_VERSION,
+  .type = PURPLE_PLUGIN_PROTOCOL,
+  .priority = PURPLE_PRIORITY_DEFAULT,
+  .id = LOOPBACK_ID,
+  .name = "Loopback",
+  .version = "1.0",
+  .summary = "Offline loopback protocol",
+  .description = "Echoes IMs back and generates synthetic traffic, for tests and benchmarks",
+  .author = "purple_ruby",
+  .homepage = "http://github.com/yong/purple_ruby",
+  .extra_info = &prpl_info
+};
+
+/* called by PurpleRuby.init after purple_core_init */
+void loopback_register()
+{
+  if (!enabled || loopback_plugin != NULL)
+    return;
+
+  loopback_plugin = purple_plugin_new(TRUE, NULL);
+  loopback_plugin->info = &info;
+  purple_plugin_load(loopback_plugin);
+  purple_plugin_register(loopback_plugin);
+}
+
+static LoopbackConnection* get_loopback_connection(VALUE account)
+{
+  PurpleAccount *acc = get_account_from_ruby_object(account);
+  PurpleConnection *gc = (NULL == acc) ? NULL : purple_account_get_connection(acc);
+
+  if (NULL == gc || strcmp(purple_account_get_protocol_id(acc), LOOPBACK_ID) != 0) {
+    rb_raise(rb_eArgError, "not a connected %s account", LOOPBACK_ID);
+  }
+
+  return gc->proto_data;
+}
+
+/*
+ * PurpleRuby::Loopback.enable
+ *
+ * Register prpl-loopback. Call it before PurpleRuby.init.
+ */
+static VALUE loopback_enable(VALUE self)
+{
+  enabled = TRUE;
+  if (purple_get_core() != NULL)
+    loopback_register();
+  return Qtrue;
+}
+
+/*
+ * PurpleRuby::Loopback.buddies(account, count)
+ *
+ * Add buddy0..buddy<count-1> to the account's buddy list and bring them online.
+ * Each one triggers a blist update.
+ */
+static VALUE loopback_buddies(VALUE self, VALUE account, VALUE count)
+{
+  LoopbackConnection *lc = get_loopback_connection(account);
+  PurpleAccount *acc = purple_connection_get_account(lc->gc);
+  guint n = NUM2UINT(count);
+  guint i;
+  char name[32];
+
+  PurpleGroup *grp = purple_find_group("Buddies");
+  if (!grp) {
+    grp = purple_group_new("Buddies");
+    purple_blist_add_group(grp, NULL);
+  }
+
+  for (i = lc->buddies; i < n; i++) {
+    g_snprintf(name, sizeof(name), "buddy%u", i);
+    if (purple_find_buddy(acc, name) == NULL) {
+      purple_blist_add_buddy(purple_buddy_new(acc, name, NULL), NULL, grp, NULL);
+    }
+    purple_prpl_got_user_status(acc, name, purple_primitive_get_id_from_type(PURPLE_STATUS_AVAILABLE), NULL);
+  }
+
+  if (n > lc->buddies)
+    lc->buddies = n;
+
+  return count;
+}
+
+/*
+ * PurpleRuby::Loopback.traffic(account, ims_per_second)
+ *
+ * Generate synthetic inbound IMs from random buddies. 0 stops it.
+ */
+static VALUE loopback_traffic(VALUE self, VALUE account, VALUE rate)
+{
+  LoopbackConnection *lc = get_loopback_connection(account);
+
+  lc->rate = NUM2DBL(rate);
+  lc->owed = 0;
+
+  if (lc->rate > 0 && 0 == lc->traffic_timeout) {
+    lc->traffic_timeout = purple_timeout_add(TRAFFIC_TICK, generate_traffic, lc);
+  } else if (lc->rate <= 0 && lc->traffic_timeout != 0) {
+    purple_timeout_remove(lc->traffic_timeout);
+    lc->traffic_timeout = 0;
+  }
+
+  return rate;
+}
+
+/*
+ * PurpleRuby::Loopback.inject_im(account, from, message)
+ *
+ * Deliver one inbound IM right now.
+ */
+static VALUE loopback_inject_im(VALUE self, VALUE account, VALUE from, VALUE message)
+{
+  LoopbackConnection *lc = get_loopback_connection(account);
+  serv_got_im(lc->gc, StringValueCStr(from), StringValueCStr(message), PURPLE_MESSAGE_RECV, time(NULL));
+  return Qnil;
+}
+
+/*
+ * PurpleRuby::Loopback.disconnect(account, reason = ConnectionError::NETWORK_ERROR, text = "loopback disconnect")
+ *
+ * Fail the connection as a real server would.
+ */
+static VALUE loopback_disconnect(int argc, VALUE* argv, VALUE self)
+{
+  VALUE account, reason, text;
+
+  rb_scan_args(argc, argv, "12", &account, &reason, &text);
+
+  LoopbackConnection *lc = get_loopback_connection(account);
+  purple_connection_error_reason(lc->gc,
+    NIL_P(reason) ? PURPLE_CONNECTION_ERROR_NETWORK_ERROR : NUM2INT(reason),
+    NIL_P(text) ? "loopback disconnect" : StringValueCStr(text));
+
+  return Qnil;
+}
+
+void init_loopback(VALUE cPurpleRuby)
+{
+  VALUE cLoopback = rb_define_class_under(cPurpleRuby, "Loopback", rb_cObject);
+  rb_define_const(cLoopback, "PROTOCOL", rb_str_new2(LOOPBACK_ID));
+  rb_define_singleton_method(cLoopback, "enable", loopback_enable, 0);
+  rb_define_singleton_method(cLoopback, "buddies", loopback_buddies, 2);
+  rb_define_singleton_method(cLoopback, "traffic", loopback_traffic, 2);
+  rb_define_singleton_method(cLoopback, "inject_im", loopback_inject_im, 3);
+  rb_define_singleton_method(cLoopback, "disconnect", loopback_disconnect, -1);
+}
@@ -0,0 +1,175 @@
+/*
+ * Native event handlers loaded from shared objects.
+ *
+ * PurpleRuby.load_native_handler(path, event) dlopens path and takes its
+ * on_im, on_presence or on_ipc function (see purple_ruby_native.h). Native
+ * handlers run in load order before the ruby handler of the same event, and
+ * the first one returning PURPLE_RUBY_CONSUMED ends the dispatch.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <glib.h>
+
+#include <ruby.h>
+#include <dlfcn.h>
+
+#include "purple_ruby_native.h"
+
+enum {
+  NATIVE_IM,
+  NATIVE_PRESENCE,
+  NATIVE_IPC,
+  NATIVE_EVENTS
+};
+
+static const char *native_events[NATIVE_EVENTS] = { "im", "presence", "ipc" };
+static const char *native_symbols[NATIVE_EVENTS] = { "on_im", "on_presence", "on_ipc" };
+
+typedef struct {
+  char *path;
+  void *dl;
+  void *function;
+  unsigned long calls;
+  unsigned long consumed;
+} NativeHandler;
+
+static GPtrArray *native_handlers[NATIVE_EVENTS];
+
+/* hooks from purple_ruby.c, TRUE when consumed */
+gboolean native_im(PurpleAccount *account, const char *who, const char *message, PurpleMessageFlags flags)
+{
+  guint i;
+
+  for (i = 0; native_handlers[NATIVE_IM] && i < native_handlers[NATIVE_IM]->len; i++) {
+    NativeHandler *h = g_ptr_array_index(native_handlers[NATIVE_IM], i);
+    h->calls++;
+    if (((PurpleRubyOnIm)h->function)(account, who, message, flags) == PURPLE_RUBY_CONSUMED) {
+      h->consumed++;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+gboolean native_presence(PurpleBuddy *buddy)
+{
+  guint i;
+
+  for (i = 0; native_handlers[NATIVE_PRESENCE] && i < native_handlers[NATIVE_PRESENCE]->len; i++) {
+    NativeHandler *h = g_ptr_array_index(native_handlers[NATIVE_PRESENCE], i);
+    h->calls++;
+    if (((PurpleRubyOnPresence)h->function)(buddy) == PURPLE_RUBY_CONSUMED) {
+      h->consumed++;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+gboolean native_ipc(const char *data, gsize len)
+{
+  guint i;
+
+  for (i = 0; native_handlers[NATIVE_IPC] && i < native_handlers[NATIVE_IPC]->len; i++) {
+    NativeHandler *h = g_ptr_array_index(native_handlers[NATIVE_IPC], i);
+    h->calls++;
+    if (((PurpleRubyOnIpc)h->function)(data, len) == PURPLE_RUBY_CONSUMED) {
+      h->consumed++;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/*
+ * PurpleRuby.load_native_handler(path, event)
+ *
+ * event is :im, :presence or :ipc. The same object can be loaded for
+ * several events.
+ */
+static VALUE load_native_handler(VALUE self, VALUE path, VALUE event)
+{
+  int (*abi)(void);
+  NativeHandler *h;
+  void *dl, *function;
+  int e;
+
+  Check_Type(event, T_SYMBOL);
+  for (e = 0; e < NATIVE_EVENTS; e++) {
+    if (SYM2ID(event) == rb_intern(native_events[e]))
+      break;
+  }
+  if (NATIVE_EVENTS == e)
+    rb_raise(rb_eArgError, "load_native_handler: unknown event :%s", rb_id2name(SYM2ID(event)));
+
+  dl = dlopen(StringValueCStr(path), RTLD_NOW | RTLD_LOCAL);
+  if (NULL == dl)
+    rb_raise(rb_eLoadError, "load_native_handler: %s", dlerror());
+
+  abi = (int (*)(void))dlsym(dl, "purple_ruby_native_abi");
+  if (NULL == abi || abi() != PURPLE_RUBY_NATIVE_ABI) {
+    dlclose(dl);
+    rb_raise(rb_eLoadError, "load_native_handler: %s was not built against ABI %d (PURPLE_RUBY_NATIVE_HANDLER)",
+      StringValueCStr(path), PURPLE_RUBY_NATIVE_ABI);
+  }
+
+  function = dlsym(dl, native_symbols[e]);
+  if (NULL == function) {
+    dlclose(dl);
+    rb_raise(rb_eLoadError, "load_native_handler: %s has no %s", StringValueCStr(path), native_symbols[e]);
+  }
+
+  h = g_new0(NativeHandler, 1);
+  h->path = g_strdup(StringValueCStr(path));
+  h->dl = dl;
+  h->function = function;
+  if (NULL == native_handlers[e])
+    native_handlers[e] = g_ptr_array_new();
+  g_ptr_array_add(native_handlers[e], h);
+
+  return path;
+}
+
+/*
+ * PurpleRuby.native_handler_stats => [{:path, :event, :calls, :consumed}, ...]
+ */
+static VALUE native_handler_stats(VALUE self)
+{
+  VALUE list = rb_ary_new();
+  guint i;
+  int e;
+
+  for (e = 0; e < NATIVE_EVENTS; e++) {
+    for (i = 0; native_handlers[e] && i < native_handlers[e]->len; i++) {
+      NativeHandler *h = g_ptr_array_index(native_handlers[e], i);
+      VALUE hash = rb_hash_new();
+
+      rb_hash_aset(hash, ID2SYM(rb_intern("path")), rb_str_new2(h->path));
+      rb_hash_aset(hash, ID2SYM(rb_intern("event")), ID2SYM(rb_intern(native_events[e])));
+      rb_hash_aset(hash, ID2SYM(rb_intern("calls")), ULONG2NUM(h->calls));
+      rb_hash_aset(hash, ID2SYM(rb_intern("consumed")), ULONG2NUM(h->consumed));
+      rb_ary_push(list, hash);
+    }
+  }
+
+  return list;
+}
+
+void init_native(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "load_native_handler", load_native_handler, 2);
+  rb_define_singleton_method(cPurpleRuby, "native_handler_stats", native_handler_stats, 0);
+}
@@ -0,0 +1,163 @@
+/*
+ * Protocol allowlist and plugin search path for PurpleRuby.init.
+ *
+ * purple_core_init probes every plugin in its search path and loads every
+ * protocol it finds, though a process uses one or two of them. With
+ * init(protocols: [...]) the other protocol plugins are destroyed right
+ * after purple_core_init, which unmaps their libraries before init returns.
+ * purple_core_init has loaded accounts.xml and the buddy list by then, so a
+ * protocol one of those accounts uses is kept, with a warning, rather than
+ * left under a loaded account. init(plugin_path: dir) searches dir before libpurple's own
+ * directory, so a plugin there wins over an installed one with the same
+ * id. PurpleRuby.startup_stats reports the time and RSS of the startup to
+ * compare both.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/debug.h>
+#include <libpurple/plugin.h>
+
+#include <ruby.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static gint64 started = 0;
+static double core_init_seconds = 0;
+static double startup_seconds = 0;
+static long rss_before = 0;
+static long rss_probed = 0;
+static long rss_after = 0;
+static VALUE unloaded = Qnil;
+
+/* resident set size in bytes, 0 where /proc is missing */
+static long current_rss(void)
+{
+  long size, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+
+  if (f != NULL) {
+    if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* before purple_core_init, raises before anything is set up */
+void plugins_prepare(VALUE plugin_path, VALUE protocols)
+{
+  long i;
+
+  if (!NIL_P(protocols)) {
+    Check_Type(protocols, T_ARRAY);
+    for (i = 0; i < RARRAY_LEN(protocols); i++)
+      StringValueCStr(RARRAY_PTR(protocols)[i]);
+  }
+
+  started = g_get_monotonic_time();
+  rss_before = current_rss();
+
+  if (!NIL_P(plugin_path))
+    purple_plugins_add_search_path(StringValueCStr(plugin_path));
+}
+
+static gboolean protocol_in_use(const char *id)
+{
+  GList *l;
+
+  for (l = purple_accounts_get_all(); l != NULL; l = l->next) {
+    const char *protocol = purple_account_get_protocol_id(l->data);
+    if (protocol != NULL && strcmp(protocol, id) == 0)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/* after purple_core_init: destroy the protocols not in the list */
+void plugins_prune(VALUE protocols)
+{
+  GList *list, *l;
+  long i;
+
+  core_init_seconds = (g_get_monotonic_time() - started) / 1e6;
+  rss_probed = current_rss();
+
+  if (NIL_P(unloaded)) {
+    unloaded = rb_ary_new();
+    rb_global_variable(&unloaded);
+  }
+
+  if (NIL_P(protocols))
+    return;
+
+  list = g_list_copy(purple_plugins_get_protocols());
+  for (l = list; l != NULL; l = l->next) {
+    PurplePlugin *plugin = l->data;
+    const char *id = plugin->info ? plugin->info->id : NULL;
+    gboolean allowed = FALSE;
+
+    if (NULL == id)
+      continue;
+    for (i = 0; i < RARRAY_LEN(protocols) && !allowed; i++)
+      allowed = strcmp(RSTRING_PTR(RARRAY_PTR(protocols)[i]), id) == 0;
+    if (allowed)
+      continue;
+    if (protocol_in_use(id)) {
+      purple_debug_warning("purple_ruby", "keeping protocol %s, a saved account uses it\n", id);
+      continue;
+    }
+
+    purple_debug_info("purple_ruby", "unloading protocol %s\n", id);
+    rb_ary_push(unloaded, rb_str_new2(id));
+    purple_plugin_destroy(plugin);
+  }
+  g_list_free(list);
+}
+
+/* at the end of init */
+void plugins_started(void)
+{
+  startup_seconds = (g_get_monotonic_time() - started) / 1e6;
+  rss_after = current_rss();
+}
+
+/*
+ * PurpleRuby.startup_stats => Hash
+ *
+ * :core_init_seconds and :rss_probed are taken right after purple_core_init,
+ * :seconds and :rss at the end of init.
+ */
+static VALUE startup_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("core_init_seconds")), rb_float_new(core_init_seconds));
+  rb_hash_aset(hash, ID2SYM(rb_intern("seconds")), rb_float_new(startup_seconds));
+  rb_hash_aset(hash, ID2SYM(rb_intern("rss_before")), LONG2NUM(rss_before));
+  rb_hash_aset(hash, ID2SYM(rb_intern("rss_probed")), LONG2NUM(rss_probed));
+  rb_hash_aset(hash, ID2SYM(rb_intern("rss")), LONG2NUM(rss_after));
+  rb_hash_aset(hash, ID2SYM(rb_intern("protocols")), UINT2NUM(g_list_length(purple_plugins_get_protocols())));
+  rb_hash_aset(hash, ID2SYM(rb_intern("unloaded")), NIL_P(unloaded) ? rb_ary_new() : rb_ary_dup(unloaded));
+
+  return hash;
+}
+
+void init_plugins(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "startup_stats", startup_stats, 0);
+}
@@ -0,0 +1,359 @@
+/*
+ * Declarative answers to requests, authorizations and notifications.
+ *
+ * PurpleRuby.add_policy adds a rule to a table that request_action,
+ * request_authorize, request_add (account.c) and notify_message consult
+ * before calling into ruby. The first rule of the event whose patterns all
+ * match decides; the ruby handler only runs when none does. Patterns are
+ * globs (* and ?) matched against the whole string, a missing field
+ * matches anything.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/blist.h>
+#include <libpurple/connection.h>
+#include <libpurple/request.h>
+
+#include <ruby.h>
+#include <stdarg.h>
+
+enum {
+  POLICY_REQUEST,
+  POLICY_AUTHORIZE,
+  POLICY_ADD,
+  POLICY_NOTIFY,
+  POLICY_EVENTS
+};
+
+enum {
+  POLICY_ACCEPT,
+  POLICY_DENY,
+  POLICY_IGNORE,
+  POLICY_ACTIONS
+};
+
+enum {
+  FIELD_TITLE,
+  FIELD_PRIMARY,
+  FIELD_WHO,
+  FIELD_ACCOUNT,
+  FIELD_PROTOCOL,
+  FIELDS
+};
+
+static const char *policy_events[POLICY_EVENTS] = { "request", "authorize", "add", "notify" };
+static const char *policy_actions[POLICY_ACTIONS] = { "accept", "deny", "ignore" };
+static const char *policy_fields[FIELDS] = { "title", "primary", "who", "account", "protocol" };
+
+typedef struct {
+  int action;
+  char *label;          /* request: the action to run, by its label */
+  long index;           /* request: or by its position, -1 when not given */
+  char *pattern[FIELDS];
+  GPatternSpec *spec[FIELDS];
+  unsigned long hits;
+} PolicyRule;
+
+static GPtrArray *policies[POLICY_EVENTS];
+static unsigned long fallbacks[POLICY_EVENTS];
+
+static gboolean field_match(PolicyRule *rule, int field, const char *value)
+{
+  if (NULL == rule->spec[field])
+    return TRUE;
+  return g_pattern_match_string(rule->spec[field], NULL == value ? "" : value);
+}
+
+/* the first matching rule, NULL when ruby should decide */
+static PolicyRule *policy_match(int event, const char *title, const char *primary, const char *who,
+  PurpleAccount *account)
+{
+  guint i;
+
+  for (i = 0; policies[event] && i < policies[event]->len; i++) {
+    PolicyRule *rule = g_ptr_array_index(policies[event], i);
+
+    if (field_match(rule, FIELD_TITLE, title) &&
+        field_match(rule, FIELD_PRIMARY, primary) &&
+        field_match(rule, FIELD_WHO, who) &&
+        field_match(rule, FIELD_ACCOUNT, account ? purple_account_get_username(account) : NULL) &&
+        field_match(rule, FIELD_PROTOCOL, account ? purple_account_get_protocol_id(account) : NULL)) {
+      rule->hits++;
+      return rule;
+    }
+  }
+
+  fallbacks[event]++;
+  return NULL;
+}
+
+/* labels a deny rule runs when it names none, compared as label_is does */
+static const char *deny_labels[] = { "reject", "deny", "decline", "cancel", "no" };
+
+/* "_Reject" is "Reject" with a mnemonic, and matches "reject" */
+static gboolean label_is(const char *text, const char *label)
+{
+  char *plain;
+  gboolean same;
+
+  if (NULL == text)
+    return FALSE;
+  plain = g_strdup(text);
+  g_strdelimit(plain, "_", ' ');
+  g_strstrip(plain);
+  same = 0 == g_ascii_strcasecmp(plain, label);
+  g_free(plain);
+  return same;
+}
+
+/* whether rule picks the action text at index */
+static gboolean request_choice(PolicyRule *rule, const char *text, size_t index)
+{
+  size_t i;
+
+  if (rule->index >= 0)
+    return (size_t)rule->index == index;
+  if (rule->label != NULL)
+    return label_is(text, rule->label);
+  for (i = 0; i < G_N_ELEMENTS(deny_labels); i++) {
+    if (label_is(text, deny_labels[i]))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/*
+ * The hooks below return TRUE when a rule handled the event.
+ *
+ * request_action: accept runs the first action with the default action, as
+ * a true from the ruby handler does. deny runs the action the rule names,
+ * or the first one labelled Reject, Deny, Decline, Cancel or No; never one
+ * by its position alone, the last action of an SSL prompt is "View
+ * Certificate", which asks again. When there is no such action the ruby
+ * handler decides.
+ */
+gboolean policy_request_action(const char *title, const char *primary, const char *who,
+  int default_action, PurpleAccount *account, void *user_data, size_t action_count, va_list actions)
+{
+  PolicyRule *rule = policy_match(POLICY_REQUEST, title, primary, who, account);
+  GCallback cb = NULL;
+  va_list copy;
+  size_t i;
+
+  if (NULL == rule)
+    return FALSE;
+  if (POLICY_IGNORE == rule->action || 0 == action_count)
+    return TRUE;
+
+  va_copy(copy, actions);
+  for (i = 0; i < action_count; i++) {
+    const char *text = va_arg(copy, const char *);
+    GCallback action_cb = va_arg(copy, GCallback);
+
+    if (POLICY_ACCEPT == rule->action || request_choice(rule, text, i)) {
+      cb = action_cb;
+      break;
+    }
+  }
+  va_end(copy);
+
+  if (i == action_count) {
+    rule->hits--;
+    fallbacks[POLICY_REQUEST]++;
+    return FALSE;
+  }
+  if (cb != NULL)
+    ((PurpleRequestActionCb)cb)(user_data, POLICY_ACCEPT == rule->action ? default_action : (int)i);
+  return TRUE;
+}
+
+gboolean policy_authorize(PurpleAccount *account, const char *remote_user, const char *alias,
+  const char *message, PurpleAccountRequestAuthorizationCb auth_cb,
+  PurpleAccountRequestAuthorizationCb deny_cb, void *user_data)
+{
+  PolicyRule *rule = policy_match(POLICY_AUTHORIZE, NULL, message, remote_user, account);
+
+  if (NULL == rule)
+    return FALSE;
+
+  if (POLICY_ACCEPT == rule->action) {
+    auth_cb(user_data);
+    purple_blist_request_add_buddy(account, remote_user, NULL, alias);
+  } else if (POLICY_DENY == rule->action) {
+    deny_cb(user_data);
+  }
+  return TRUE;
+}
+
+gboolean policy_add(PurpleAccount *account, const char *remote_user, const char *alias, const char *message)
+{
+  PolicyRule *rule = policy_match(POLICY_ADD, NULL, message, remote_user, account);
+
+  if (NULL == rule)
+    return FALSE;
+
+  if (POLICY_ACCEPT == rule->action &&
+      g_list_find(purple_connections_get_all(), purple_account_get_connection(account)))
+    purple_blist_request_add_buddy(account, remote_user, NULL, alias);
+  return TRUE;
+}
+
+/* notifications need no answer, a matching rule just drops them */
+gboolean policy_notify(const char *title, const char *primary)
+{
+  return NULL != policy_match(POLICY_NOTIFY, title, primary, NULL, NULL);
+}
+
+static int lookup_symbol(VALUE sym, const char **names, int count, const char *what)
+{
+  int i;
+
+  Check_Type(sym, T_SYMBOL);
+  for (i = 0; i < count; i++) {
+    if (SYM2ID(sym) == rb_intern(names[i]))
+      return i;
+  }
+  rb_raise(rb_eArgError, "add_policy: unknown %s :%s", what, rb_id2name(SYM2ID(sym)));
+  return -1;
+}
+
+/*
+ * PurpleRuby.add_policy(event, action, match = {}) => rule number
+ *
+ * event:  :request (watch_request), :authorize and :add (watch_new_buddy),
+ *         :notify (watch_notify_message)
+ * action: :accept, :deny or :ignore. For :request also the label of the
+ *         action to run ("Reject", underscores and case aside) or its
+ *         index; the ruby handler decides when the request has no such
+ *         action.
+ * match:  :title, :primary, :who, :account (username) and :protocol globs.
+ *         authorize and add have no title, their primary is the message.
+ *
+ *   PurpleRuby.add_policy(:request, :accept, :title => "SSL Certificate Verification")
+ *   PurpleRuby.add_policy(:request, "Reject", :title => "SSL Certificate Verification")
+ */
+static VALUE add_policy(int argc, VALUE* argv, VALUE self)
+{
+  VALUE event, action, match, patterns[FIELDS] = { Qnil, Qnil, Qnil, Qnil, Qnil };
+  PolicyRule *rule;
+  long index = -1;
+  int e, a, f;
+
+  rb_scan_args(argc, argv, "21", &event, &action, &match);
+  e = lookup_symbol(event, policy_events, POLICY_EVENTS, "event");
+  if (POLICY_REQUEST == e && (FIXNUM_P(action) || RB_TYPE_P(action, T_STRING))) {
+    a = POLICY_DENY;
+    if (FIXNUM_P(action) && (index = FIX2LONG(action)) < 0)
+      rb_raise(rb_eArgError, "add_policy: action index should not be negative");
+    if (!FIXNUM_P(action))
+      StringValueCStr(action);
+  } else {
+    a = lookup_symbol(action, policy_actions, POLICY_ACTIONS, "action");
+  }
+  if (!NIL_P(match)) {
+    Check_Type(match, T_HASH);
+    for (f = 0; f < FIELDS; f++) {
+      patterns[f] = rb_hash_aref(match, ID2SYM(rb_intern(policy_fields[f])));
+      if (!NIL_P(patterns[f]))
+        StringValueCStr(patterns[f]);
+    }
+  }
+
+  rule = g_new0(PolicyRule, 1);
+  rule->action = a;
+  rule->index = index;
+  if (RB_TYPE_P(action, T_STRING))
+    rule->label = g_strdup(RSTRING_PTR(action));
+  for (f = 0; f < FIELDS; f++) {
+    if (NIL_P(patterns[f]))
+      continue;
+    rule->pattern[f] = g_strdup(RSTRING_PTR(patterns[f]));
+    rule->spec[f] = g_pattern_spec_new(rule->pattern[f]);
+  }
+
+  if (NULL == policies[e])
+    policies[e] = g_ptr_array_new();
+  g_ptr_array_add(policies[e], rule);
+
+  return UINT2NUM(policies[e]->len - 1);
+}
+
+/*
+ * PurpleRuby.clear_policies
+ */
+static VALUE clear_policies(VALUE self)
+{
+  guint i;
+  int e, f;
+
+  for (e = 0; e < POLICY_EVENTS; e++) {
+    for (i = 0; policies[e] && i < policies[e]->len; i++) {
+      PolicyRule *rule = g_ptr_array_index(policies[e], i);
+      for (f = 0; f < FIELDS; f++) {
+        if (rule->spec[f] != NULL)
+          g_pattern_spec_free(rule->spec[f]);
+        g_free(rule->pattern[f]);
+      }
+      g_free(rule->label);
+      g_free(rule);
+    }
+    if (policies[e] != NULL)
+      g_ptr_array_set_size(policies[e], 0);
+  }
+
+  return Qnil;
+}
+
+/*
+ * PurpleRuby.policy_stats => {:rules => [{:event, :action, :match, :hits}, ...], :fallbacks => {event => count}}
+ */
+static VALUE policy_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new(), rules = rb_ary_new(), fallback = rb_hash_new();
+  guint i;
+  int e, f;
+
+  for (e = 0; e < POLICY_EVENTS; e++) {
+    for (i = 0; policies[e] && i < policies[e]->len; i++) {
+      PolicyRule *rule = g_ptr_array_index(policies[e], i);
+      VALUE r = rb_hash_new(), match = rb_hash_new();
+
+      for (f = 0; f < FIELDS; f++) {
+        if (rule->pattern[f] != NULL)
+          rb_hash_aset(match, ID2SYM(rb_intern(policy_fields[f])), rb_str_new2(rule->pattern[f]));
+      }
+      rb_hash_aset(r, ID2SYM(rb_intern("event")), ID2SYM(rb_intern(policy_events[e])));
+      rb_hash_aset(r, ID2SYM(rb_intern("action")), rule->label ? rb_str_new2(rule->label) :
+                   rule->index >= 0 ? LONG2NUM(rule->index) : ID2SYM(rb_intern(policy_actions[rule->action])));
+      rb_hash_aset(r, ID2SYM(rb_intern("match")), match);
+      rb_hash_aset(r, ID2SYM(rb_intern("hits")), ULONG2NUM(rule->hits));
+      rb_ary_push(rules, r);
+    }
+    rb_hash_aset(fallback, ID2SYM(rb_intern(policy_events[e])), ULONG2NUM(fallbacks[e]));
+  }
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("rules")), rules);
+  rb_hash_aset(hash, ID2SYM(rb_intern("fallbacks")), fallback);
+  return hash;
+}
+
+void init_policy(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "add_policy", add_policy, -1);
+  rb_define_singleton_method(cPurpleRuby, "clear_policies", clear_policies, 0);
+  rb_define_singleton_method(cPurpleRuby, "policy_stats", policy_stats, 0);
+}
@@ -0,0 +1,359 @@
+/*
+ * Sender pools: spread outbound IMs over several accounts of a protocol.
+ *
+ * Servers limit how fast one account may send, so PurpleRuby.pool groups
+ * accounts and pool.send picks, per message, the connected member with the
+ * most rate budget left. Each member has a token bucket refilled at the
+ * pool's rate (messages per second); a send that would take a member below
+ * zero is refused rather than risking the server's limit. A sticky pool
+ * keeps sending to a recipient from the same member for as long as that
+ * member stays connected; its bindings are dropped on signed-off or a connection error,
+ * so the next message to those recipients is balanced again.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/connection.h>
+#include <libpurple/signals.h>
+#include <libpurple/util.h>
+
+#include <ruby.h>
+#include <string.h>
+
+#include "probes.h"
+
+#define DEFAULT_RATE 5.0
+
+extern VALUE cAccount;
+extern PurpleAccount* get_account_from_ruby_object(VALUE acc);
+extern int account_send_im(PurpleAccount *account, const char *name, const char *message);
+extern gboolean spool_add(PurpleAccount *account, gboolean common, VALUE name, VALUE message);
+
+typedef struct {
+  PurpleAccount *account;
+  double tokens;
+  gint64 refilled;
+  unsigned long sent;
+  unsigned long failed;
+  unsigned long rebalanced;   /* recipients moved away after a disconnect */
+} PoolMember;
+
+typedef struct {
+  char *protocol;
+  GArray *members;            /* of PoolMember */
+  guint next;                 /* where the next search starts, for ties */
+  double rate;
+  gboolean sticky;
+  GHashTable *recipients;     /* normalized name => PurpleAccount* */
+  unsigned long spooled;
+  unsigned long dropped;
+  unsigned long throttled;
+} Pool;
+
+static VALUE cPool;
+static GList *pools = NULL;
+
+static PoolMember *pool_member(Pool *pool, PurpleAccount *account)
+{
+  guint i;
+
+  for (i = 0; i < pool->members->len; i++) {
+    PoolMember *m = &g_array_index(pool->members, PoolMember, i);
+    if (m->account == account)
+      return m;
+  }
+  return NULL;
+}
+
+static void pool_refill(Pool *pool, PoolMember *m, gint64 now)
+{
+  double burst = MAX(pool->rate, 1.0);
+
+  m->tokens = MIN(burst, m->tokens + (now - m->refilled) * pool->rate / G_USEC_PER_SEC);
+  m->refilled = now;
+}
+
+/* the connected member with the most tokens, NULL when none is connected */
+static PoolMember *pool_pick(Pool *pool, gint64 now)
+{
+  PoolMember *best = NULL;
+  guint i, n = pool->members->len;
+
+  for (i = 0; i < n; i++) {
+    PoolMember *m = &g_array_index(pool->members, PoolMember, (pool->next + i) % n);
+    if (!purple_account_is_connected(m->account))
+      continue;
+    pool_refill(pool, m, now);
+    if (NULL == best || m->tokens > best->tokens)
+      best = m;
+  }
+  if (n > 0)
+    pool->next = (pool->next + 1) % n;
+
+  return best;
+}
+
+static gboolean bound_to(gpointer key, gpointer value, gpointer account)
+{
+  return value == account;
+}
+
+/* forget the recipients of account in every pool */
+void pool_disconnect(PurpleAccount *account)
+{
+  GList *l;
+
+  for (l = pools; l != NULL; l = l->next) {
+    Pool *pool = l->data;
+    PoolMember *m = pool_member(pool, account);
+    if (m != NULL)
+      m->rebalanced += g_hash_table_foreach_remove(pool->recipients, bound_to, account);
+  }
+}
+
+static void pool_signed_off(PurpleConnection *gc, gpointer data)
+{
+  pool_disconnect(purple_connection_get_account(gc));
+}
+
+static void pool_account_destroying(PurpleAccount *account, gpointer data)
+{
+  GList *l;
+  guint i;
+
+  pool_disconnect(account);
+  for (l = pools; l != NULL; l = l->next) {
+    Pool *pool = l->data;
+    for (i = 0; i < pool->members->len; i++) {
+      if (g_array_index(pool->members, PoolMember, i).account == account) {
+        g_array_remove_index(pool->members, i);
+        pool->next = 0;
+        break;
+      }
+    }
+  }
+}
+
+static void *pool_get_handle(void)
+{
+  static int handle;
+
+  return &handle;
+}
+
+static void pool_free(Pool *pool)
+{
+  pools = g_list_remove(pools, pool);
+  g_hash_table_destroy(pool->recipients);
+  g_array_free(pool->members, TRUE);
+  g_free(pool->protocol);
+  g_free(pool);
+}
+
+static Pool *get_pool(VALUE self)
+{
+  Pool *pool;
+  Data_Get_Struct(self, Pool, pool);
+  return pool;
+}
+
+/*
+ * PurpleRuby.pool(protocol, accounts, rate = 5.0, sticky = true) => PurpleRuby::Pool
+ *
+ * rate is the messages per second each member may send.
+ */
+static VALUE pool_new(int argc, VALUE* argv, VALUE self)
+{
+  static gboolean connected = FALSE;
+  VALUE protocol, accounts, rate, sticky, obj;
+  Pool *pool;
+  long i;
+
+  rb_scan_args(argc, argv, "22", &protocol, &accounts, &rate, &sticky);
+  Check_Type(accounts, T_ARRAY);
+
+  /* pools may all have been collected since, the handlers are still there */
+  if (!connected) {
+    purple_signal_connect(purple_connections_get_handle(), "signed-off", pool_get_handle(),
+              PURPLE_CALLBACK(pool_signed_off), NULL);
+    purple_signal_connect(purple_accounts_get_handle(), "account-destroying", pool_get_handle(),
+              PURPLE_CALLBACK(pool_account_destroying), NULL);
+    connected = TRUE;
+  }
+
+  pool = g_new0(Pool, 1);
+  pool->protocol = g_strdup(StringValueCStr(protocol));
+  pool->members = g_array_new(FALSE, TRUE, sizeof(PoolMember));
+  pool->rate = NIL_P(rate) ? DEFAULT_RATE : NUM2DBL(rate);
+  pool->sticky = NIL_P(sticky) || RTEST(sticky);
+  pool->recipients = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  pools = g_list_prepend(pools, pool);
+
+  /* wrapped before checking the members so that a raise doesn't leak it */
+  obj = Data_Wrap_Struct(cPool, NULL, pool_free, pool);
+
+  if (pool->rate <= 0)
+    rb_raise(rb_eArgError, "pool: rate should be positive");
+
+  for (i = 0; i < RARRAY_LEN(accounts); i++) {
+    PurpleAccount *account = get_account_from_ruby_object(rb_ary_entry(accounts, i));
+    PoolMember m = { 0 };
+
+    if (NULL == account)
+      rb_raise(rb_eArgError, "pool: account %ld is unknown", i);
+    if (strcmp(purple_account_get_protocol_id(account), pool->protocol) != 0)
+      rb_raise(rb_eArgError, "pool: %s is not a %s account", purple_account_get_username(account), pool->protocol);
+    if (pool_member(pool, account) != NULL)
+      continue;
+
+    m.account = account;
+    m.tokens = MAX(pool->rate, 1.0);
+    m.refilled = g_get_monotonic_time();
+    g_array_append_val(pool->members, m);
+  }
+
+  return obj;
+}
+
+/*
+ * pool.send(to, message) => account, :throttled, :spooled or nil
+ *
+ * Returns the member the message was sent from. :throttled means the
+ * member it would go from (the recipient's, when sticky) has used up its
+ * rate, nothing was sent and it is up to the caller to retry later. When no
+ * member is connected the message goes to the spool of the first member
+ * that has one (Account#spool=), else it is dropped and nil is returned.
+ */
+static VALUE pool_send(VALUE self, VALUE name, VALUE message)
+{
+  Pool *pool = get_pool(self);
+  gint64 now = g_get_monotonic_time();
+  PoolMember *m = NULL;
+  char *key = NULL;
+  guint i;
+
+  StringValueCStr(name);
+  StringValue(message);
+
+  if (0 == pool->members->len)
+    rb_raise(rb_eRuntimeError, "pool: no members");
+
+  if (pool->sticky) {
+    PurpleAccount *bound;
+    key = g_strdup(purple_normalize(g_array_index(pool->members, PoolMember, 0).account, RSTRING_PTR(name)));
+    bound = g_hash_table_lookup(pool->recipients, key);
+    if (bound != NULL && (m = pool_member(pool, bound)) != NULL && purple_account_is_connected(bound))
+      pool_refill(pool, m, now);
+    else
+      m = NULL;
+  }
+
+  if (NULL == m && NULL == (m = pool_pick(pool, now))) {
+    g_free(key);
+    for (i = 0; i < pool->members->len; i++) {
+      if (spool_add(g_array_index(pool->members, PoolMember, i).account, FALSE, name, message)) {
+        pool->spooled++;
+        return ID2SYM(rb_intern("spooled"));
+      }
+    }
+    pool->dropped++;
+    return Qnil;
+  }
+
+  /* a bound member waits for its own budget, pool_pick's has the most there is */
+  if (m->tokens < 1.0) {
+    g_free(key);
+    pool->throttled++;
+    return ID2SYM(rb_intern("throttled"));
+  }
+
+  if (key != NULL)
+    g_hash_table_replace(pool->recipients, key, m->account);
+
+  m->tokens -= 1.0;
+
+  PROBE4(send__im, purple_account_get_username(m->account), purple_account_get_protocol_id(m->account),
+    RSTRING_PTR(name), RSTRING_LEN(message));
+  if (account_send_im(m->account, RSTRING_PTR(name), StringValueCStr(message)) < 0)
+    m->failed++;
+  else
+    m->sent++;
+
+  return Data_Wrap_Struct(cAccount, NULL, NULL, m->account);
+}
+
+/*
+ * pool.stats => {:spooled, :dropped, :throttled, :recipients, :members => [{:account, :connected, :tokens, :sent, :failed, :rebalanced}, ...]}
+ */
+static VALUE pool_stats(VALUE self)
+{
+  Pool *pool = get_pool(self);
+  gint64 now = g_get_monotonic_time();
+  VALUE hash = rb_hash_new(), members = rb_ary_new();
+  guint i;
+
+  for (i = 0; i < pool->members->len; i++) {
+    PoolMember *m = &g_array_index(pool->members, PoolMember, i);
+    VALUE member = rb_hash_new();
+
+    pool_refill(pool, m, now);
+    rb_hash_aset(member, ID2SYM(rb_intern("account")), Data_Wrap_Struct(cAccount, NULL, NULL, m->account));
+    rb_hash_aset(member, ID2SYM(rb_intern("connected")), purple_account_is_connected(m->account) ? Qtrue : Qfalse);
+    rb_hash_aset(member, ID2SYM(rb_intern("tokens")), rb_float_new(m->tokens));
+    rb_hash_aset(member, ID2SYM(rb_intern("sent")), ULONG2NUM(m->sent));
+    rb_hash_aset(member, ID2SYM(rb_intern("failed")), ULONG2NUM(m->failed));
+    rb_hash_aset(member, ID2SYM(rb_intern("rebalanced")), ULONG2NUM(m->rebalanced));
+    rb_ary_push(members, member);
+  }
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("spooled")), ULONG2NUM(pool->spooled));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dropped")), ULONG2NUM(pool->dropped));
+  rb_hash_aset(hash, ID2SYM(rb_intern("throttled")), ULONG2NUM(pool->throttled));
+  rb_hash_aset(hash, ID2SYM(rb_intern("recipients")), UINT2NUM(g_hash_table_size(pool->recipients)));
+  rb_hash_aset(hash, ID2SYM(rb_intern("members")), members);
+
+  return hash;
+}
+
+/*
+ * pool.rate = messages per second per member
+ */
+static VALUE pool_set_rate(VALUE self, VALUE rate)
+{
+  Pool *pool = get_pool(self);
+  double value = NUM2DBL(rate);
+
+  if (value <= 0)
+    rb_raise(rb_eArgError, "pool: rate should be positive");
+  pool->rate = value;
+  return rate;
+}
+
+static VALUE pool_get_rate(VALUE self)
+{
+  return rb_float_new(get_pool(self)->rate);
+}
+
+void init_pool(VALUE cPurpleRuby)
+{
+  cPool = rb_define_class_under(cPurpleRuby, "Pool", rb_cObject);
+  rb_undef_alloc_func(cPool);
+  rb_define_singleton_method(cPurpleRuby, "pool", pool_new, -1);
+  rb_define_method(cPool, "send", pool_send, 2);
+  rb_define_method(cPool, "stats", pool_stats, 0);
+  rb_define_method(cPool, "rate=", pool_set_rate, 1);
+  rb_define_method(cPool, "rate", pool_get_rate, 0);
+}
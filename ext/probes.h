@@ -0,0 +1,70 @@
+/*
+ * Static USDT probes for perf/bpftrace/systemtap.
+ *
+ * The probes are compiled in when extconf.rb finds sys/sdt.h (systemtap-sdt-dev
+ * on Debian/Ubuntu, systemtap-sdt-devel on Redhat), and are a single nop when
+ * nothing is attached. Without the header they compile to nothing. List them with:
+ *
+ *   bpftrace -l 'usdt:/path/to/purple_ruby.so:purple_ruby:*'
+ *
+ * Probes and arguments:
+ *
+ *   message__received  (account, protocol, who, bytes)
+ *   handler__entry     (handler_name, event, argc)
+ *   handler__return    (handler_name, event)
+ *   send__im           (account, protocol, to, bytes)
+ *   common__send       (account, protocol, to, bytes)
+ *   ipc__accept        (fd)
+ *   ipc__read          (fd, bytes)
+ *   ipc__dispatch      (bytes)
+ *   ipc__route         (bytes, routed)
+ *   disconnect         (account, protocol, reason)
+ *   reconnect__schedule(account, protocol, delay_ms, fatal)
+ *   reconnect__fire    (account, protocol)
+ *   timer__fire        (handler_name)
+ *   defer__drain       (ran, depth)
+ *   ring__drain        (records, bytes_left)
+ *
+ * The probes use semaphores: a tracer attaching to one bumps its counter, and
+ * the arguments (strlen, account lookups) are only computed while it is
+ * non-zero. purple_ruby.c defines PURPLE_RUBY_PROBES_DEFINE before including
+ * this file so that the semaphores are defined once. A probe added here goes
+ * in PURPLE_RUBY_PROBES too.
+ */
+
+#ifndef PURPLE_RUBY_PROBES_H
+#define PURPLE_RUBY_PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PURPLE_RUBY_PROBES(P) \
+  P(message__received) P(handler__entry) P(handler__return) P(send__im) P(common__send) \
+  P(ipc__accept) P(ipc__read) P(ipc__dispatch) P(ipc__route) P(disconnect) \
+  P(reconnect__schedule) P(reconnect__fire) P(timer__fire) P(defer__drain) P(ring__drain)
+
+#ifdef PURPLE_RUBY_PROBES_DEFINE
+#define PROBE_SEMAPHORE(name) \
+  unsigned short purple_ruby_##name##_semaphore __attribute__((unused, section(".probes")));
+#else
+#define PROBE_SEMAPHORE(name) extern unsigned short purple_ruby_##name##_semaphore;
+#endif
+PURPLE_RUBY_PROBES(PROBE_SEMAPHORE)
+
+#define PROBE_ENABLED(name) __builtin_expect(purple_ruby_##name##_semaphore != 0, 0)
+
+#define PROBE1(name, a) do { if (PROBE_ENABLED(name)) DTRACE_PROBE1(purple_ruby, name, a); } while (0)
+#define PROBE2(name, a, b) do { if (PROBE_ENABLED(name)) DTRACE_PROBE2(purple_ruby, name, a, b); } while (0)
+#define PROBE3(name, a, b, c) do { if (PROBE_ENABLED(name)) DTRACE_PROBE3(purple_ruby, name, a, b, c); } while (0)
+#define PROBE4(name, a, b, c, d) do { if (PROBE_ENABLED(name)) DTRACE_PROBE4(purple_ruby, name, a, b, c, d); } while (0)
+#else
+#define PROBE_ENABLED(name) 0
+/* sizeof does not evaluate the arguments, it only keeps them "used" */
+#define PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#define PROBE4(name, a, b, c, d) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); (void)sizeof(d); } while (0)
+#endif
+
+#endif
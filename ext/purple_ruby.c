@@ -21,6 +21,7 @@
 #include <libpurple/conversation.h>
 #include <libpurple/core.h>
 #include <libpurple/debug.h>
+#include <libpurple/dnsquery.h>
 #include <libpurple/blist.h>
 #include <libpurple/cipher.h>
 #include <libpurple/eventloop.h>
@@ -48,6 +49,9 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 
+#define PURPLE_RUBY_PROBES_DEFINE
+#include "probes.h"
+
 #ifndef RSTRING_PTR 
 #define RSTRING_PTR(s) (RSTRING(s)->ptr) 
 #endif 
@@ -55,9 +59,6 @@
 #define RSTRING_LEN(s) (RSTRING(s)->len) 
 #endif
 
-#define PURPLE_GLIB_READ_COND  (G_IO_IN | G_IO_HUP | G_IO_ERR)
-#define PURPLE_GLIB_WRITE_COND (G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL)
-
 // Ruby to C
 #define PURPLE_ACCOUNT(account) get_account_from_ruby_object(account)
 
@@ -67,91 +68,24 @@
 #define RB_BLIST_BUDDY(purple_buddy_pointer) Data_Wrap_Struct(cBuddy, NULL, NULL, purple_buddy_pointer)
 #define RB_ACCOUNT(purple_account_pointer) Data_Wrap_Struct(cAccount, NULL, NULL, purple_account_pointer)
 
-typedef struct _PurpleGLibIOClosure {
-	PurpleInputFunction function;
-	guint result;
-	gpointer data;
-} PurpleGLibIOClosure;
-
-static void purple_glib_io_destroy(gpointer data)
-{
-	g_free(data);
-}
-
-static PurpleAccount* get_account_from_ruby_object(VALUE acc){
+PurpleAccount* get_account_from_ruby_object(VALUE acc){
 	PurpleAccount* account = NULL;
 	Data_Get_Struct( acc, PurpleAccount, account );
 	return purple_accounts_find(account->username,account->protocol_id);
 }
 
-static gboolean purple_glib_io_invoke(GIOChannel *source, GIOCondition condition, gpointer data)
-{
-	PurpleGLibIOClosure *closure = data;
-	PurpleInputCondition purple_cond = 0;
-
-	if (condition & PURPLE_GLIB_READ_COND)
-		purple_cond |= PURPLE_INPUT_READ;
-	if (condition & PURPLE_GLIB_WRITE_COND)
-		purple_cond |= PURPLE_INPUT_WRITE;
-
-	closure->function(closure->data, g_io_channel_unix_get_fd(source),
-			  purple_cond);
-
-	return TRUE;
-}
-
-static guint glib_input_add(gint fd, PurpleInputCondition condition, PurpleInputFunction function,
-							   gpointer data)
-{
-	PurpleGLibIOClosure *closure = g_new0(PurpleGLibIOClosure, 1);
-	GIOChannel *channel;
-	GIOCondition cond = 0;
-	
-	closure->function = function;
-	closure->data = data;
-
-	if (condition & PURPLE_INPUT_READ)
-		cond |= PURPLE_GLIB_READ_COND;
-	if (condition & PURPLE_INPUT_WRITE)
-		cond |= PURPLE_GLIB_WRITE_COND;
-
-	channel = g_io_channel_unix_new(fd);
-	closure->result = g_io_add_watch_full(channel, G_PRIORITY_DEFAULT, cond,
-					      purple_glib_io_invoke, closure, purple_glib_io_destroy);
-
-	g_io_channel_unref(channel);
-	return closure->result;
-}
-
-static PurpleEventLoopUiOps glib_eventloops = 
-{
-	g_timeout_add,
-	g_source_remove,
-	glib_input_add,
-	g_source_remove,
-	NULL,
-#if GLIB_CHECK_VERSION(2,14,0)
-	g_timeout_add_seconds,
-#else
-	NULL,
-#endif
-
-	/* padding */
-	NULL,
-	NULL,
-	NULL
-};
-
 static VALUE cPurpleRuby;
 static VALUE cConnectionError;
 VALUE cAccount;
-static VALUE cBuddy;
+VALUE cBuddy;
 static VALUE cStatus;
 
 const char* UI_ID = "purplegw";
 static GMainLoop *main_loop = NULL;
 static GHashTable* data_hash_table = NULL;
 static GHashTable* fd_hash_table = NULL;
+static GHashTable* listen_hash_table = NULL;   /* listening socket => purple input */
+static gboolean ipc_route_mode = FALSE;
 ID CALL;
 extern PurpleAccountUiOps account_ops;
 
@@ -166,6 +100,7 @@ static VALUE blist_update_handler = Qnil;
 static VALUE blist_ready_handler = Qnil;
 static VALUE ipc_handler = Qnil;
 static VALUE timer_handler = Qnil;
+static VALUE io_handlers = Qnil;
 guint timer_timeout = 0;
 VALUE new_buddy_handler = Qnil;
 
@@ -175,6 +110,60 @@ finch_connection_report_disconnect(PurpleConnection *gc, PurpleConnectionError r
 		
 extern void finch_connections_init();
 
+extern VALUE call_handler(VALUE handler, const char *handler_name, const char *event, int argc, VALUE *argv);
+extern void init_watchdog(VALUE cPurpleRuby);
+extern void init_loopback(VALUE cPurpleRuby);
+extern void loopback_register();
+extern void init_avatar(VALUE cPurpleRuby);
+extern void init_icon_cache(VALUE cPurpleRuby);
+extern gboolean icon_cache_enabled();
+extern VALUE icon_cache_get_avatar(PurpleBuddy *buddy);
+extern void init_timer(VALUE cPurpleRuby);
+extern VALUE timer_add(guint64 ms, guint interval, VALUE block);
+extern void init_defer(VALUE cPurpleRuby);
+extern void init_eventloop(VALUE cPurpleRuby);
+extern PurpleEventLoopUiOps* eventloop_get_ui_ops();
+extern void init_dns(VALUE cPurpleRuby);
+extern PurpleDnsQueryUiOps* dns_get_ui_ops();
+extern void init_xfer(VALUE cPurpleRuby);
+extern void xfer_register();
+extern void init_spool(VALUE cPurpleRuby);
+extern void spool_register();
+extern gboolean spool_add(PurpleAccount *account, gboolean common, VALUE name, VALUE message);
+extern void init_journal(VALUE cPurpleRuby);
+extern void journal_im(PurpleAccount *account, const char *who, const char *message, PurpleMessageFlags flags);
+extern void journal_disconnect(PurpleAccount *account, int reason, const char *text);
+extern void journal_buddy(PurpleBuddy *buddy);
+extern void init_recorder(VALUE cPurpleRuby);
+extern void recorder_add_handler(const char *handler_name, VALUE *handler);
+extern void init_route(VALUE cPurpleRuby);
+extern gboolean ipc_route_frame(GString *frame);
+extern void init_native(VALUE cPurpleRuby);
+extern gboolean native_im(PurpleAccount *account, const char *who, const char *message, PurpleMessageFlags flags);
+extern gboolean native_presence(PurpleBuddy *buddy);
+extern gboolean native_ipc(const char *data, gsize len);
+extern void init_pool(VALUE cPurpleRuby);
+extern void pool_disconnect(PurpleAccount *account);
+extern void init_conv_cache(VALUE cPurpleRuby);
+extern void conv_cache_register();
+extern PurpleConversation *conv_cache_find(PurpleAccount *account, const char *name);
+extern void conv_cache_touch(PurpleConversation *conv);
+extern void init_policy(VALUE cPurpleRuby);
+extern gboolean policy_request_action(const char *title, const char *primary, const char *who,
+  int default_action, PurpleAccount *account, void *user_data, size_t action_count, va_list actions);
+extern gboolean policy_notify(const char *title, const char *primary);
+extern void init_plugins(VALUE cPurpleRuby);
+extern void plugins_prepare(VALUE plugin_path, VALUE protocols);
+extern void plugins_prune(VALUE protocols);
+extern void plugins_started(void);
+extern void init_drain(VALUE cPurpleRuby);
+extern void drain_register();
+extern void drain_signal(int sig);
+extern void init_listen(VALUE cPurpleRuby);
+extern void init_ring(VALUE cPurpleRuby);
+extern int listen_inherited(int port);
+extern int listen_set_options(int soc);
+
 VALUE inspect_rb_obj(VALUE obj)
 {
   return rb_funcall(obj, rb_intern("inspect"), 0, 0);
@@ -191,6 +180,7 @@ void set_callback(VALUE* handler, const char* handler_name)
   }
   
   *handler = rb_block_proc();
+  recorder_add_handler(handler_name, handler);
   /*
   * If you create a Ruby object from C and store it in a C global variable without 
   * exporting it to Ruby, you must at least tell the garbage collector about it, 
@@ -214,13 +204,17 @@ void check_callback(VALUE handler, const char* handler_name){
 
 void report_disconnect(PurpleConnection *gc, PurpleConnectionError reason, const char *text)
 {
+  PROBE3(disconnect, purple_account_get_username(purple_connection_get_account(gc)),
+    purple_account_get_protocol_id(purple_connection_get_account(gc)), reason);
+  journal_disconnect(purple_connection_get_account(gc), reason, text);
+  pool_disconnect(purple_connection_get_account(gc));
+
   if (Qnil != connection_error_handler) {
     VALUE args[3];
     args[0] = Data_Wrap_Struct(cAccount, NULL, NULL, purple_connection_get_account(gc));
     args[1] = INT2FIX(reason);
     args[2] = rb_str_new2(text);
-    check_callback(connection_error_handler, "connection_error_handler");
-    VALUE v = rb_funcall2(connection_error_handler, CALL, 3, args);
+    VALUE v = call_handler(connection_error_handler, "connection_error_handler", "report_disconnect", 3, args);
     
     if (v != Qnil && v != Qfalse) {
       finch_connection_report_disconnect(gc, reason, text);
@@ -233,14 +227,16 @@ static void* notify_message(PurpleNotifyMsgType type,
 	const char *primary, 
 	const char *secondary)
 {
+  if (policy_notify(title, primary))
+    return NULL;
+
   if (notify_message_handler != Qnil) {
     VALUE args[4];
     args[0] = INT2FIX(type);
     args[1] = rb_str_new2(NULL == title ? "" : title);
     args[2] = rb_str_new2(NULL == primary ? "" : primary);
     args[3] = rb_str_new2(NULL == secondary ? "" : secondary);
-    check_callback(notify_message_handler, "notify_message_handler");
-    rb_funcall2(notify_message_handler, CALL, 4, args);
+    call_handler(notify_message_handler, "notify_message_handler", "notify_message", 4, args);
   }
   
   return NULL;
@@ -249,6 +245,14 @@ static void* notify_message(PurpleNotifyMsgType type,
 static void write_conv(PurpleConversation *conv, const char *who, const char *alias,
 			const char *message, PurpleMessageFlags flags, time_t mtime)
 {	
+  PROBE4(message__received, purple_account_get_username(purple_conversation_get_account(conv)),
+    purple_account_get_protocol_id(purple_conversation_get_account(conv)),
+    who, NULL == message ? 0 : strlen(message));
+  conv_cache_touch(conv);
+  journal_im(purple_conversation_get_account(conv), who, message, flags);
+  if (native_im(purple_conversation_get_account(conv), who, message, flags))
+    return;
+
   if (im_handler != Qnil) {
     PurpleAccount* account = purple_conversation_get_account(conv);
     if (strcmp(purple_account_get_protocol_id(account), "prpl-msn") == 0 &&
@@ -267,21 +271,25 @@ static void write_conv(PurpleConversation *conv, const char *who, const char *al
       args[0] = Data_Wrap_Struct(cAccount, NULL, NULL, account);
       args[1] = rb_str_new2(who);
       args[2] = rb_str_new2(message);
-      check_callback(im_handler, "im_handler");
-      rb_funcall2(im_handler, CALL, 3, args);
+      call_handler(im_handler, "im_handler", "write_conv", 3, args);
     }
   }
 }
 
 static void update_blist(PurpleBuddyList *list, PurpleBlistNode *node)
 {
+	if (PURPLE_BLIST_NODE_IS_BUDDY(node)) {
+		journal_buddy((PurpleBuddy *)node);
+		if (native_presence((PurpleBuddy *)node))
+			return;
+	}
+
 	if (blist_update_handler != Qnil && PURPLE_BLIST_NODE_IS_BUDDY(node)) {
 		PurpleBuddy *buddy = (PurpleBuddy *)node;
-		check_callback(blist_update_handler, "blist_update_handler");
 		VALUE args[2];
 		args[0] = RB_BLIST_BUDDY(buddy);
 		args[1] = Data_Wrap_Struct(cAccount, NULL, NULL, purple_buddy_get_account(buddy));
-		rb_funcall2(blist_update_handler, CALL, 2, args);		
+		call_handler(blist_update_handler, "blist_update_handler", "update_blist", 2, args);
 	}
 }
 static PurpleConversationUiOps conv_uiops = 
@@ -350,14 +358,16 @@ static void* request_action(const char *title, const char *primary, const char *
                             size_t action_count, 
                             va_list actions)
 {
+  if (policy_request_action(title, primary, who, default_action, account, user_data, action_count, actions))
+    return NULL;
+
   if (request_handler != Qnil) {
 	  VALUE args[4];
     args[0] = rb_str_new2(NULL == title ? "" : title);
     args[1] = rb_str_new2(NULL == primary ? "" : primary);
     args[2] = rb_str_new2(NULL == secondary ? "" : secondary);
     args[3] = rb_str_new2(NULL == who ? "" : who);
-    check_callback(request_handler, "request_handler");
-    VALUE v = rb_funcall2(request_handler, CALL, 4, args);
+    VALUE v = call_handler(request_handler, "request_handler", "request_action", 4, args);
 	  
 	  if (v != Qnil && v != Qfalse) {
 	    /*const char *text =*/ va_arg(actions, const char *);
@@ -384,7 +394,7 @@ static void notify_user_info(PurpleConnection *gc, const char *who, PurpleNotify
 			}
 		}
 		args[1] = hash;
-		rb_funcall2(user_info_handler, CALL, 2, args);	
+		call_handler(user_info_handler, "user_info_handler", "notify_userinfo", 2, args);
 	}
 }
 
@@ -443,21 +453,26 @@ static void sighandler(int sig)
   case SIGINT:
   case SIGQUIT:
   case SIGTERM:
-		g_main_loop_quit(main_loop);
+		drain_signal(sig);
 		break;
 	}
 }
 
 static VALUE init(int argc, VALUE* argv, VALUE self)
 {
-  VALUE debug, path;
+  VALUE debug, path, opts, protocols = Qnil, plugin_path = Qnil;
   const char *prefs_path = NULL;
   
   if( rb_cv_get( self, "@@prefs_path" ) != Qnil ) {
     prefs_path = RSTRING_PTR( rb_cv_get( self, "@@prefs_path" ) );
   }
   
-  rb_scan_args(argc, argv, "02", &debug, &path);
+  rb_scan_args(argc, argv, "02:", &debug, &path, &opts);
+  if (!NIL_P(opts)) {
+    protocols = rb_hash_aref(opts, ID2SYM(rb_intern("protocols")));
+    plugin_path = rb_hash_aref(opts, ID2SYM(rb_intern("plugin_path")));
+  }
+  plugins_prepare(plugin_path, protocols);
 
   signal(SIGCHLD, SIG_IGN);
   signal(SIGPIPE, SIG_IGN);
@@ -467,6 +482,7 @@ static VALUE init(int argc, VALUE* argv, VALUE self)
 
   data_hash_table = g_hash_table_new(NULL, NULL);
   fd_hash_table = g_hash_table_new(NULL, NULL);
+  listen_hash_table = g_hash_table_new(NULL, NULL);
 
   purple_debug_set_enabled((NIL_P(debug) || debug == Qfalse) ? FALSE : TRUE);
 
@@ -476,11 +492,19 @@ static VALUE init(int argc, VALUE* argv, VALUE self)
 	}
 
   purple_core_set_ui_ops(&core_uiops);
-  purple_eventloop_set_ui_ops(&glib_eventloops);
+  purple_eventloop_set_ui_ops(eventloop_get_ui_ops());
+  purple_dnsquery_set_ui_ops(dns_get_ui_ops());
   
   if (!purple_core_init(UI_ID)) {
 		rb_raise(rb_eRuntimeError, "libpurple initialization failed");
 	}
+  plugins_prune(protocols);
+  
+  loopback_register();
+  xfer_register();
+  spool_register();
+  conv_cache_register();
+  drain_register();
   
   purple_util_set_user_dir( (const char *) prefs_path );
   
@@ -496,6 +520,7 @@ static VALUE init(int argc, VALUE* argv, VALUE self)
   /* Load the pounces. */
   purple_pounces_load();
 
+  plugins_started();
   return Qnil;
 }
 
@@ -545,16 +570,14 @@ static void signed_on(PurpleConnection* connection)
 {
   VALUE args[1];
   args[0] = Data_Wrap_Struct(cAccount, NULL, NULL, purple_connection_get_account(connection));
-  check_callback(signed_on_handler, "signed_on_handler");
-  rb_funcall2(signed_on_handler, CALL, 1, args);
+  call_handler(signed_on_handler, "signed_on_handler", "signed-on", 1, args);
 }
 
 static void signed_off(PurpleConnection* connection)
 {
   VALUE args[1];
   args[0] = Data_Wrap_Struct(cAccount, NULL, NULL, purple_connection_get_account(connection));
-  check_callback(signed_off_handler, "signed_off_handler");
-  rb_funcall2(signed_off_handler, CALL, 1, args);
+  call_handler(signed_off_handler, "signed_off_handler", "signed-off", 1, args);
 }
 
 static VALUE watch_signed_on_event(VALUE self)
@@ -592,16 +615,17 @@ static void _read_socket_handler(gpointer notused, int socket, PurpleInputCondit
 {
   char message[4096] = {0};
   int i = recv(socket, message, sizeof(message) - 1, 0);
+  PROBE2(ipc__read, socket, i);
   if (i > 0) {
     purple_debug_info("purple_ruby", "recv %d: %d\n", socket, i);
     
-    gpointer str = g_hash_table_lookup(data_hash_table, (gpointer)socket);
+    GString *str = g_hash_table_lookup(data_hash_table, (gpointer)socket);
     if (NULL == str) rb_raise(rb_eRuntimeError, "can not find socket: %d", socket);
-    rb_str_append((VALUE)str, rb_str_new2(message));
+    g_string_append_len(str, message, i);
   } else {
     purple_debug_info("purple_ruby", "close connection %d: %d %d\n", socket, i, errno);
     
-    gpointer str = g_hash_table_lookup(data_hash_table, (gpointer)socket);
+    GString *str = g_hash_table_lookup(data_hash_table, (gpointer)socket);
     if (NULL == str) {
       purple_debug_warning("purple_ruby", "can not find socket in data_hash_table %d\n", socket);
       return;
@@ -618,10 +642,15 @@ static void _read_socket_handler(gpointer notused, int socket, PurpleInputCondit
     purple_input_remove((guint)purple_fd);
     close(socket);
     
-    VALUE args[1];
-    args[0] = (VALUE)str;
-    check_callback(ipc_handler, "ipc_handler");
-    rb_funcall2(ipc_handler, CALL, 1, args);
+    if (native_ipc(str->str, str->len)) {
+      g_string_free(str, TRUE);
+    } else if (!ipc_route_mode || !ipc_route_frame(str)) {
+      VALUE args[1];
+      args[0] = rb_str_new(str->str, str->len);
+      PROBE1(ipc__dispatch, str->len);
+      g_string_free(str, TRUE);
+      call_handler(ipc_handler, "ipc_handler", "ipc", 1, args);
+    }
   }
 }
 
@@ -646,18 +675,37 @@ static void _accept_socket_handler(gpointer notused, int server_socket, PurpleIn
 #endif
 
   purple_debug_info("purple_ruby", "new connection: %d\n", client_socket);
+  PROBE1(ipc__accept, client_socket);
 	
 	guint purple_fd = purple_input_add(client_socket, PURPLE_INPUT_READ, _read_socket_handler, NULL);
 	
-	g_hash_table_insert(data_hash_table, (gpointer)client_socket, (gpointer)rb_str_new2(""));
+	g_hash_table_insert(data_hash_table, (gpointer)client_socket, g_string_new(NULL));
 	g_hash_table_insert(fd_hash_table, (gpointer)client_socket, (gpointer)purple_fd);
 }
 
-static VALUE watch_incoming_ipc(VALUE self, VALUE serverip, VALUE port)
+/*
+ * PurpleRuby.watch_incoming_ipc(ip, port, mode = nil) { |data| }
+ *
+ * With mode :route, "<protocol>,<user>,<message>" frames are sent in C
+ * (see route.c) and the block only gets the ones that could not be routed.
+ * An inherited socket already listening on port is used instead of binding
+ * a new one (see listen.c).
+ */
+static VALUE watch_incoming_ipc(int argc, VALUE* argv, VALUE self)
 {
 	struct sockaddr_in my_addr;
 	int soc;
 	int on = 1;
+	VALUE serverip, port, mode;
+
+	rb_scan_args(argc, argv, "21", &serverip, &port, &mode);
+	if (!NIL_P(mode) && mode != ID2SYM(rb_intern("route"))) {
+		rb_raise(rb_eArgError, "watch_incoming_ipc: unknown mode %s", RSTRING_PTR(inspect_rb_obj(mode)));
+	}
+
+	/* Take over a listening socket inherited for this port, see listen.c */
+	if ((soc = listen_inherited(FIX2INT(port))) >= 0)
+		goto watch;
 
 	/* Open a listening socket for incoming conversations */
 	if ((soc = socket(PF_INET, SOCK_STREAM, 0)) < 0)
@@ -672,6 +720,12 @@ static VALUE watch_incoming_ipc(VALUE self, VALUE serverip, VALUE port)
 		return Qnil;
 	}
 
+	if (listen_set_options(soc) < 0)
+	{
+		rb_raise(rb_eRuntimeError, "Cannot set socket options: %s\n", g_strerror(errno));
+		return Qnil;
+	}
+
 	memset(&my_addr, 0, sizeof(struct sockaddr_in));
 	my_addr.sin_family = AF_INET;
 	my_addr.sin_addr.s_addr = inet_addr(RSTRING_PTR(serverip));
@@ -689,20 +743,110 @@ static VALUE watch_incoming_ipc(VALUE self, VALUE serverip, VALUE port)
 		return Qnil;
 	}
 
+watch:
   set_callback(&ipc_handler, "ipc_handler");
+  ipc_route_mode = !NIL_P(mode);
   
 	/* Open a watcher in the socket we have just opened */
-	purple_input_add(soc, PURPLE_INPUT_READ, _accept_socket_handler, NULL);
+	g_hash_table_insert(listen_hash_table, (gpointer)soc,
+	  (gpointer)purple_input_add(soc, PURPLE_INPUT_READ, _accept_socket_handler, NULL));
 	
 	return port;
 }
 
+static void close_listener(gpointer soc, gpointer purple_fd, gpointer data)
+{
+  purple_input_remove((guint)purple_fd);
+  close((int)soc);
+}
+
+/* the drain: no new IPC connections, the open ones are read to the end */
+void ipc_stop_listening(void)
+{
+  if (NULL == listen_hash_table)
+    return;
+  g_hash_table_foreach(listen_hash_table, close_listener, NULL);
+  g_hash_table_remove_all(listen_hash_table);
+}
+
+guint ipc_connections(void)
+{
+  return NULL == fd_hash_table ? 0 : g_hash_table_size(fd_hash_table);
+}
+
+static void push_listener(gpointer soc, gpointer purple_fd, gpointer array)
+{
+  rb_ary_push((VALUE)array, INT2FIX((int)soc));
+}
+
+/*
+ * PurpleRuby.ipc_listen_fds => [fd, ...]
+ *
+ * The listening sockets, to hand over to a new process:
+ *
+ *   fds = PurpleRuby.ipc_listen_fds
+ *   spawn({"PURPLE_RUBY_IPC_FD" => fds.join(",")}, "ruby", "gateway.rb", fds.map {|fd| [fd, fd]}.to_h)
+ *   PurpleRuby.drain
+ */
+static VALUE ipc_listen_fds(VALUE self)
+{
+  VALUE array = rb_ary_new();
+
+  if (listen_hash_table != NULL)
+    g_hash_table_foreach(listen_hash_table, push_listener, (gpointer)array);
+  return array;
+}
+
+static void _io_handler(gpointer data, int fd, PurpleInputCondition condition)
+{
+  VALUE args[1];
+  args[0] = INT2FIX(fd);
+  call_handler((VALUE)data, "io_handler", "io", 1, args);
+}
+
+/*
+ * PurpleRuby.watch_io(io_or_fd) { |fd| } => handle
+ *
+ * Call the block from the main loop whenever the fd is readable.
+ */
+static VALUE watch_io(VALUE self, VALUE io)
+{
+  if (!rb_block_given_p()) {
+    rb_raise(rb_eArgError, "watch_io: no block given");
+  }
+  
+  if (rb_respond_to(io, rb_intern("fileno"))) {
+    io = rb_funcall(io, rb_intern("fileno"), 0);
+  }
+  
+  if (Qnil == io_handlers) {
+    rb_global_variable(&io_handlers);
+    io_handlers = rb_hash_new();
+  }
+  
+  VALUE block = rb_block_proc();
+  guint handle = purple_input_add(NUM2INT(io), PURPLE_INPUT_READ, _io_handler, (gpointer)block);
+  /* keep the block referenced for the GC */
+  rb_hash_aset(io_handlers, UINT2NUM(handle), block);
+  
+  return UINT2NUM(handle);
+}
+
+static VALUE unwatch_io(VALUE self, VALUE handle)
+{
+  purple_input_remove(NUM2UINT(handle));
+  if (Qnil != io_handlers) {
+    rb_hash_delete(io_handlers, handle);
+  }
+  return Qnil;
+}
+
 static gboolean
 do_timeout(gpointer data)
 {
 	VALUE handler = data;
-	check_callback(handler, "timer_handler");
-	VALUE v = rb_funcall(handler, CALL, 0, 0);
+	PROBE1(timer__fire, "timer_handler");
+	VALUE v = call_handler(handler, "timer_handler", "timer", 0, NULL);
 	return (v == Qtrue);
 }
 
@@ -766,20 +910,54 @@ static VALUE main_loop_run( VALUE self ) {
   return Qnil;
 }
 
+void quit_main_loop(void)
+{
+  if (main_loop != NULL)
+    g_main_loop_quit(main_loop);
+}
+
 static VALUE main_loop_stop(VALUE self)
 {
-  g_main_loop_quit(main_loop);
+  quit_main_loop();
   return Qnil;
 }
 
+/* the account must be connected; used by the spool as well */
+int account_send_im(PurpleAccount *account, const char *name, const char *message)
+{
+  return serv_send_im(purple_account_get_connection(account), name, message, 0);
+}
+
+/* -1 when name is not a buddy */
+int account_common_send(PurpleAccount *account, const char *name, const char *message)
+{
+  PurpleBuddy* buddy = purple_find_buddy(account, name);
+  if (buddy != NULL) {
+    PurpleConversation *conv = conv_cache_find(account, name);
+    if (conv == NULL) {
+      conv = purple_conversation_new(PURPLE_CONV_TYPE_IM,
+                                     buddy->account, buddy->name);
+    }
+    purple_conv_im_send(PURPLE_CONV_IM(conv), message);
+    return 0;
+  } else {
+    return -1;
+  }
+}
+
 static VALUE send_im(VALUE self, VALUE name, VALUE message)
 {
   PurpleAccount *account;
   Data_Get_Struct(self, PurpleAccount, account);
   
+  PROBE4(send__im, purple_account_get_username(account), purple_account_get_protocol_id(account),
+    RSTRING_PTR(name), RSTRING_LEN(message));
+
   if (purple_account_is_connected(account)) {
-    int i = serv_send_im(purple_account_get_connection(account), RSTRING_PTR(name), RSTRING_PTR(message), 0);
+    int i = account_send_im(account, RSTRING_PTR(name), RSTRING_PTR(message));
     return INT2FIX(i);
+  } else if (spool_add(account, FALSE, name, message)) {
+    return ID2SYM(rb_intern("spooled"));
   } else {
     return Qnil;
   }
@@ -790,19 +968,14 @@ static VALUE common_send(VALUE self, VALUE name, VALUE message)
   PurpleAccount *account;
   Data_Get_Struct(self, PurpleAccount, account);
   
+  PROBE4(common__send, purple_account_get_username(account), purple_account_get_protocol_id(account),
+    RSTRING_PTR(name), RSTRING_LEN(message));
+
   if (purple_account_is_connected(account)) {
-     PurpleBuddy* buddy = purple_find_buddy(account, RSTRING_PTR(name));
-     if (buddy != NULL) {
-       PurpleConversation *conv = purple_find_conversation_with_account(PURPLE_CONV_TYPE_IM, RSTRING_PTR(name), account);
-       if (conv == NULL) {
-         conv = purple_conversation_new(PURPLE_CONV_TYPE_IM,
-                                        buddy->account, buddy->name);
-       }
-       purple_conv_im_send(PURPLE_CONV_IM(conv), RSTRING_PTR(message));
-       return INT2FIX(0);
-     } else {
-       return Qnil;
-     }
+    int i = account_common_send(account, RSTRING_PTR(name), RSTRING_PTR(message));
+    return i < 0 ? Qnil : INT2FIX(i);
+  } else if (spool_add(account, TRUE, name, message)) {
+    return ID2SYM(rb_intern("spooled"));
   } else {
     return Qnil;    
   }
@@ -973,46 +1146,6 @@ static VALUE acc_delete(VALUE self)
   return Qnil;
 }
 
-static VALUE set_avatar_from_file( VALUE self, VALUE filepath ) {
-  FILE *file = NULL;
-  size_t file_len = 0;
-  unsigned char *file_data = NULL;
-  char *filename = NULL;
-  unsigned char *icon_data = NULL;
-  PurpleAccount *account = PURPLE_ACCOUNT(self);
-  
-  filename = RSTRING_PTR( filepath );
-  
-  file = fopen( filename, "rb" );
-  
-  if( file != NULL ) {
-    // get file size
-    fseek( file, 0, SEEK_END );
-    file_len = ftell( file );
-    fseek( file, 0, SEEK_SET );
-    // read data
-    file_data = g_malloc( file_len );
-    fread( file_data, file_len, 1, file );
-
-    // close file
-    fclose( file );
-  }
-  else {
-    rb_raise( rb_eRuntimeError, "Error when opening picture: %s", filename );
-  }
-
-  // set filename
-  // purple_account_set_buddy_icon_path( account, filename );
-  
-  // set account icon
-  icon_data = g_malloc( file_len );
-  memcpy( icon_data, file_data, file_len );
-  purple_buddy_icons_set_account_icon( account, icon_data, file_len );
-  // purple_account_set_bool( account, "use-global-buddyicon", 1 );
-  
-  return Qtrue;
-}
-
 static VALUE account_is_connected( VALUE self ) {
   PurpleAccount *account = PURPLE_ACCOUNT(self);
   
@@ -1110,35 +1243,8 @@ static VALUE buddy_get_alias( VALUE self ) {
   return rb_str_new2( purple_buddy_get_alias( buddy ));
 }
 
-static gboolean call_rb_block_false( gpointer data ) {
-  VALUE block = data;
-  rb_funcall( block, CALL, 0, 0 );
-  return FALSE;
-}
-
-static gboolean call_rb_block_true( gpointer data ) {
-  VALUE block = data;
-  rb_funcall( block, CALL, 0, 0 );
-  return TRUE;
-}
-
-
-static VALUE defer_execute( VALUE self ) {
-  VALUE *rb_block = NULL;
-  
-  if (!rb_block_given_p()) {
-    rb_raise(rb_eArgError, "defer_execute: no block given");
-  }
-  
-  rb_block = rb_block_proc();
-  
-  g_idle_add( call_rb_block_false, rb_block );
-  
-  return Qtrue;
-}
-
+/* same as PurpleRuby.periodic_timer, in seconds */
 static VALUE add_periodic_timer( VALUE self, VALUE seconds ) {
-  VALUE *rb_block = NULL;
   int secs = 0;
   
   secs = NUM2LONG( seconds );
@@ -1146,16 +1252,15 @@ static VALUE add_periodic_timer( VALUE self, VALUE seconds ) {
   if (!rb_block_given_p()) {
     rb_raise(rb_eArgError, "add_periodic_timer: no block given");
   }
+  if (secs <= 0) {
+    rb_raise(rb_eArgError, "add_periodic_timer: interval should be positive");
+  }
   
-  rb_block = rb_block_proc();
-  
-  g_timeout_add( secs * 1000, call_rb_block_true, rb_block );
-  
-  return Qtrue;
+  return timer_add( secs * 1000, secs * 1000, rb_block_proc() );
 }
 
+/* same as PurpleRuby.timer, in seconds */
 static VALUE add_timer( VALUE self, VALUE seconds ) {
-  VALUE *rb_block = NULL;
   int secs = 0;
   
   secs = NUM2LONG( seconds );
@@ -1164,11 +1269,7 @@ static VALUE add_timer( VALUE self, VALUE seconds ) {
     rb_raise(rb_eArgError, "add_timer: no block given");
   }
   
-  rb_block = rb_block_proc();
-  
-  g_timeout_add( secs * 1000, call_rb_block_false, rb_block );
-  
-  return Qtrue;
+  return timer_add( secs < 0 ? 0 : secs * 1000, 0, rb_block_proc() );
 }
 
 static VALUE run_one_loop( VALUE self ) {
@@ -1182,6 +1283,8 @@ static VALUE buddy_get_avatar (VALUE self){
 	
 	PurpleBuddy *buddy = NULL;
 	PURPLE_BUDDY( self, buddy );
+	if (icon_cache_enabled())
+		return icon_cache_get_avatar(buddy);
 	PurpleBuddyIcon *icon =	purple_buddy_get_icon(buddy);
 	if (icon != NULL) {
 		size_t size = NULL;
@@ -1242,19 +1345,28 @@ void Init_purple_ruby()
   rb_define_singleton_method(cPurpleRuby, "watch_notify_message", watch_notify_message, 0);
   rb_define_singleton_method(cPurpleRuby, "watch_request", watch_request, 0);
   rb_define_singleton_method(cPurpleRuby, "watch_new_buddy", watch_new_buddy, 0);
-  rb_define_singleton_method(cPurpleRuby, "watch_incoming_ipc", watch_incoming_ipc, 2);
+  rb_define_singleton_method(cPurpleRuby, "watch_incoming_ipc", watch_incoming_ipc, -1);
+  rb_define_singleton_method(cPurpleRuby, "ipc_listen_fds", ipc_listen_fds, 0);
   rb_define_singleton_method(cPurpleRuby, "watch_timer", watch_timer, 1);
+  rb_define_singleton_method(cPurpleRuby, "watch_io", watch_io, 1);
+  rb_define_singleton_method(cPurpleRuby, "unwatch_io", unwatch_io, 1);
   rb_define_singleton_method(cPurpleRuby, "watch_blist_change", watch_blist_change, 0);
   rb_define_singleton_method(cPurpleRuby, "login", login, 3);
   rb_define_singleton_method(cPurpleRuby, "main_loop_run", main_loop_run, 0);
   rb_define_singleton_method(cPurpleRuby, "main_loop_stop", main_loop_stop, 0);
   rb_define_singleton_method(cPurpleRuby, "prefs_path=", set_prefs_path, 1);
   rb_define_singleton_method(cPurpleRuby, "prefs_path", get_prefs_path, 0);
-  rb_define_singleton_method(cPurpleRuby, "defer", defer_execute, 0);
   rb_define_singleton_method(cPurpleRuby, "add_periodic_timer", add_periodic_timer, 1);
   rb_define_singleton_method(cPurpleRuby, "add_timer", add_timer, 1);
   rb_define_singleton_method(cPurpleRuby, "run_one_loop", run_one_loop, 0);
   
+  init_watchdog(cPurpleRuby);
+  init_loopback(cPurpleRuby);
+  init_timer(cPurpleRuby);
+  init_defer(cPurpleRuby);
+  init_eventloop(cPurpleRuby);
+  init_dns(cPurpleRuby);
+  
   rb_define_const(cPurpleRuby, "NOTIFY_MSG_ERROR", INT2NUM(PURPLE_NOTIFY_MSG_ERROR));
   rb_define_const(cPurpleRuby, "NOTIFY_MSG_WARNING", INT2NUM(PURPLE_NOTIFY_MSG_WARNING));
   rb_define_const(cPurpleRuby, "NOTIFY_MSG_INFO", INT2NUM(PURPLE_NOTIFY_MSG_INFO));
@@ -1286,7 +1398,6 @@ void Init_purple_ruby()
   rb_define_method(cAccount, "common_send", common_send, 2);
   rb_define_method(cAccount, "username", username, 0);
   rb_define_method(cAccount, "alias=", set_public_alias, 1);
-  rb_define_method(cAccount, "avatar=", set_avatar_from_file, 1);
   rb_define_method(cAccount, "psm=", set_personal_message, 1);
   rb_define_method(cAccount, "protocol_id", protocol_id, 0);
   rb_define_method(cAccount, "protocol_name", protocol_name, 0);
@@ -1298,6 +1409,21 @@ void Init_purple_ruby()
   rb_define_method(cAccount, "delete", acc_delete, 0);
   rb_define_method(cAccount, "display_name", display_name, 0);
   rb_define_method(cAccount, "logout", logout, 0);
+  init_avatar(cPurpleRuby);
+  init_icon_cache(cPurpleRuby);
+  init_xfer(cPurpleRuby);
+  init_spool(cPurpleRuby);
+  init_journal(cPurpleRuby);
+  init_recorder(cPurpleRuby);
+  init_route(cPurpleRuby);
+  init_native(cPurpleRuby);
+  init_pool(cPurpleRuby);
+  init_conv_cache(cPurpleRuby);
+  init_policy(cPurpleRuby);
+  init_plugins(cPurpleRuby);
+  init_drain(cPurpleRuby);
+  init_listen(cPurpleRuby);
+  init_ring(cPurpleRuby);
   
   cBuddy = rb_define_class_under(cPurpleRuby, "Buddy", rb_cObject);
   rb_define_method( cBuddy, "name", buddy_get_name, 0 );
@@ -0,0 +1,70 @@
+/*
+ * ABI for native handlers loaded with PurpleRuby.load_native_handler.
+ *
+ * A native handler is a shared object exporting any of the functions below
+ * (plain C linkage, these exact names) and purple_ruby_native_abi. It is
+ * called from the main loop before the ruby handler for the same event and
+ * may use libpurple directly, e.g. serv_send_im for an auto reply. Returning
+ * PURPLE_RUBY_CONSUMED stops the event there: later native handlers and the
+ * ruby handler don't see it.
+ *
+ *   #include "purple_ruby_native.h"
+ *
+ *   PURPLE_RUBY_NATIVE_HANDLER
+ *
+ *   int on_im(PurpleAccount *account, const char *who, const char *message, PurpleMessageFlags flags)
+ *   {
+ *     if (!(flags & PURPLE_MESSAGE_RECV) || strcmp(message, "ping") != 0)
+ *       return PURPLE_RUBY_PASS;
+ *     serv_send_im(purple_account_get_connection(account), who, "pong", 0);
+ *     return PURPLE_RUBY_CONSUMED;
+ *   }
+ *
+ *   $ cc -shared -fPIC $(pkg-config --cflags purple) -o echo.so echo.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef PURPLE_RUBY_NATIVE_H
+#define PURPLE_RUBY_NATIVE_H
+
+#include <stddef.h>
+#include <libpurple/account.h>
+#include <libpurple/blist.h>
+#include <libpurple/conversation.h>
+
+#define PURPLE_RUBY_NATIVE_ABI 1
+
+#define PURPLE_RUBY_PASS 0
+#define PURPLE_RUBY_CONSUMED 1
+
+/* declares the ABI version the handler was built against */
+#define PURPLE_RUBY_NATIVE_HANDLER \
+  int purple_ruby_native_abi(void) { return PURPLE_RUBY_NATIVE_ABI; }
+
+/*
+ * write_conv: an IM shown in a conversation. That includes the ones we send,
+ * only those with PURPLE_MESSAGE_RECV in flags were received.
+ */
+typedef int (*PurpleRubyOnIm)(PurpleAccount *account, const char *who, const char *message,
+  PurpleMessageFlags flags);
+
+/* update_blist: a buddy changed, e.g. its presence */
+typedef int (*PurpleRubyOnPresence)(PurpleBuddy *buddy);
+
+/* a complete IPC frame, not nul terminated */
+typedef int (*PurpleRubyOnIpc)(const char *data, size_t len);
+
+#endif
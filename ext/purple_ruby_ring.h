@@ -0,0 +1,237 @@
+/*
+ * Client side of the shared memory submission ring (PurpleRuby.ring_open).
+ *
+ * A producer on the same host maps the ring file, gets the eventfd doorbell
+ * from <path>.sock and appends IMs without a syscall per message: the
+ * doorbell is only rung when the gateway is waiting for it. Any number of
+ * producers, in any number of processes, may write at the same time.
+ *
+ *   #include "purple_ruby_ring.h"
+ *
+ *   PurpleRubyRing ring;
+ *   if (purple_ruby_ring_attach(&ring, "/dev/shm/gateway.ring") != 0)
+ *     err(1, "attach");
+ *   while (purple_ruby_ring_send(&ring, "prpl-jabber", "bot@example.com", "someone@example.com",
+ *                                "hello", 5) != 0 && EAGAIN == errno)
+ *     usleep(1000);                      // full, the gateway is behind
+ *   purple_ruby_ring_detach(&ring);
+ *
+ * A producer killed between reserving and publishing a record (a memcpy
+ * long) stalls the ring; PurpleRuby.ring_stats shows head staying ahead of
+ * tail.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef PURPLE_RUBY_RING_H
+#define PURPLE_RUBY_RING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define PURPLE_RUBY_RING_MAGIC "PRRING01"
+#define PURPLE_RUBY_RING_PAD 0x80000000u
+#define PURPLE_RUBY_RING_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+/* the file starts with this, the data area follows at data_offset */
+typedef struct {
+  char magic[8];
+  uint32_t size;                                  /* of the data area, a power of 2 */
+  uint32_t data_offset;
+  uint64_t head __attribute__((aligned(64)));     /* bytes reserved by producers */
+  uint64_t tail __attribute__((aligned(64)));     /* bytes consumed by the gateway */
+  uint32_t sleeping __attribute__((aligned(64))); /* the gateway wants the doorbell */
+} PurpleRubyRingHeader;
+
+/*
+ * size is written last and is 0 until the record is complete. A record with
+ * PURPLE_RUBY_RING_PAD in size fills the end of the data area when the next
+ * record does not fit there. The strings follow, not nul terminated.
+ */
+typedef struct {
+  uint32_t size;                                  /* whole record, multiple of 8 */
+  uint16_t protocol_len;
+  uint16_t username_len;
+  uint16_t recipient_len;
+  uint16_t reserved;
+  uint32_t message_len;
+} PurpleRubyRingRecord;
+
+typedef struct {
+  PurpleRubyRingHeader *header;
+  char *data;
+  size_t map_size;
+  int doorbell;                                   /* eventfd */
+} PurpleRubyRing;
+
+/* receive the doorbell eventfd from the gateway */
+static inline int purple_ruby_ring_doorbell(const char *path)
+{
+  struct sockaddr_un addr;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char c;
+  int sock, fd = -1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.sock", path) >= (int)sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(sock);
+    return -1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = &c;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, 0) == 1 && (cmsg = CMSG_FIRSTHDR(&msg)) != NULL &&
+      SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type)
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  else
+    errno = EPROTO;
+
+  close(sock);
+  return fd;
+}
+
+static inline int purple_ruby_ring_attach(PurpleRubyRing *ring, const char *path)
+{
+  struct stat st;
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+
+  memset(ring, 0, sizeof(*ring));
+  ring->doorbell = -1;
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PurpleRubyRingHeader)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  ring->map_size = st.st_size;
+  ring->header = (PurpleRubyRingHeader *)mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == (void *)ring->header) {
+    ring->header = NULL;
+    return -1;
+  }
+  if (memcmp(ring->header->magic, PURPLE_RUBY_RING_MAGIC, 8) != 0 ||
+      (size_t)ring->header->data_offset + ring->header->size > ring->map_size) {
+    munmap(ring->header, ring->map_size);
+    ring->header = NULL;
+    errno = EINVAL;
+    return -1;
+  }
+  ring->data = (char *)ring->header + ring->header->data_offset;
+
+  if ((ring->doorbell = purple_ruby_ring_doorbell(path)) < 0) {
+    munmap(ring->header, ring->map_size);
+    ring->header = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static inline void purple_ruby_ring_detach(PurpleRubyRing *ring)
+{
+  if (ring->header != NULL)
+    munmap(ring->header, ring->map_size);
+  if (ring->doorbell >= 0)
+    close(ring->doorbell);
+  ring->header = NULL;
+  ring->doorbell = -1;
+}
+
+/*
+ * 0 when queued; -1 with errno EAGAIN when the ring is full, EMSGSIZE when
+ * the record can never fit.
+ */
+static inline int purple_ruby_ring_send(PurpleRubyRing *ring, const char *protocol, const char *username,
+  const char *recipient, const char *message, size_t message_len)
+{
+  PurpleRubyRingHeader *h = ring->header;
+  PurpleRubyRingRecord *record;
+  size_t protocol_len = strlen(protocol), username_len = strlen(username), recipient_len = strlen(recipient);
+  uint64_t need = PURPLE_RUBY_RING_ALIGN(sizeof(PurpleRubyRingRecord) + protocol_len + username_len +
+    recipient_len + message_len);
+  uint64_t head, tail, total, pos, size = h->size;
+  char *p;
+
+  if (protocol_len > 0xffff || username_len > 0xffff || recipient_len > 0xffff || need > size / 2) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+  do {
+    pos = head & (size - 1);
+    total = pos + need > size ? size - pos + need : need;
+    tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+    if (head + total - tail > size) {
+      errno = EAGAIN;
+      return -1;
+    }
+  } while (!__atomic_compare_exchange_n(&h->head, &head, head + total, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  if (total != need) {
+    __atomic_store_n((uint32_t *)(ring->data + pos), (uint32_t)(size - pos) | PURPLE_RUBY_RING_PAD, __ATOMIC_RELEASE);
+    pos = 0;
+  }
+
+  record = (PurpleRubyRingRecord *)(ring->data + pos);
+  record->protocol_len = protocol_len;
+  record->username_len = username_len;
+  record->recipient_len = recipient_len;
+  record->reserved = 0;
+  record->message_len = message_len;
+  p = (char *)(record + 1);
+  memcpy(p, protocol, protocol_len);
+  memcpy(p += protocol_len, username, username_len);
+  memcpy(p += username_len, recipient, recipient_len);
+  memcpy(p + recipient_len, message, message_len);
+  __atomic_store_n(&record->size, (uint32_t)need, __ATOMIC_RELEASE);
+
+  /* pairs with the fence in the gateway before it goes to sleep */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&h->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&h->sleeping, 0, __ATOMIC_ACQ_REL)) {
+    uint64_t one = 1;
+    if (write(ring->doorbell, &one, sizeof(one)) != sizeof(one)) {
+      /* only fails when the counter is saturated: the gateway has been rung */
+    }
+  }
+  return 0;
+}
+
+#endif
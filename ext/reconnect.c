@@ -43,6 +43,8 @@
 #include <libpurple/whiteboard.h>
 #include <libpurple/network.h>
 
+#include "probes.h"
+
 extern const char* UI_ID;
 
 #define INITIAL_RECON_DELAY_MIN  8000
@@ -87,6 +89,8 @@ do_signon(gpointer data)
 	if (info)
 		info->timeout = 0;
 
+	PROBE2(reconnect__fire, purple_account_get_username(account), purple_account_get_protocol_id(account));
+
 	status = purple_account_get_active_status(account);
 	if (purple_status_is_online(status))
 	{
@@ -111,6 +115,7 @@ enable_account(gpointer data)
 	if (info)
 		info->timeout = 0;
   
+	PROBE2(reconnect__fire, purple_account_get_username(account), purple_account_get_protocol_id(account));
 	purple_account_set_enabled(account, UI_ID, TRUE);
 	
 	return FALSE;
@@ -133,6 +138,9 @@ finch_connection_report_disconnect(PurpleConnection *gc, PurpleConnectionError r
 			g_source_remove(info->timeout);
 	}
 	
+	PROBE4(reconnect__schedule, purple_account_get_username(account), purple_account_get_protocol_id(account),
+		info->delay, purple_connection_error_is_fatal(reason));
+
 	if (!purple_connection_error_is_fatal(reason)) {
 		info->timeout = g_timeout_add(info->delay, do_signon, account);
 	} else {
@@ -0,0 +1,631 @@
+/*
+ * Record and replay of handler calls.
+ *
+ * While PurpleRuby.record(path) is on, every call_handler() for a handler
+ * registered with set_callback (im_handler, blist_update_handler,
+ * notify_message_handler, request_handler, connection_error_handler,
+ * ipc_handler, ...) is appended to path with its arguments and the time
+ * since recording started. Accounts and buddies are stored by protocol,
+ * username and buddy name.
+ *
+ * PurpleRuby.replay(path, speed) feeds the file back through call_handler()
+ * to whatever handlers are registered now, with accounts and buddies looked
+ * up again (or created, not added to the account list or buddy list, when
+ * they don't exist in this process). Handler return values are ignored,
+ * nothing goes back to libpurple.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/blist.h>
+#include <libpurple/eventloop.h>
+
+#include <ruby.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RECORDING_MAGIC "PRREC001"
+#define RECORDING_MAGIC_LEN 8
+
+/* argument tags */
+#define ARG_NIL 'n'
+#define ARG_TRUE 't'
+#define ARG_FALSE 'f'
+#define ARG_INT 'i'
+#define ARG_FLOAT 'd'
+#define ARG_STRING 's'
+#define ARG_SYMBOL 'y'
+#define ARG_ACCOUNT 'a'
+#define ARG_BUDDY 'b'
+
+extern VALUE cAccount;
+extern VALUE cBuddy;
+extern VALUE call_handler(VALUE handler, const char *handler_name, const char *event, int argc, VALUE *argv);
+
+/* handler_name => VALUE* of the handler, from set_callback */
+static GHashTable *handlers = NULL;
+
+static FILE *recording = NULL;
+static char *recording_path = NULL;
+static gint64 recording_start = 0;
+static GString *record_buffer = NULL;
+static unsigned long recorded = 0;
+static unsigned long unsupported = 0;
+
+static gboolean replaying = FALSE;
+
+/* accounts and buddies made up for replay, kept since handlers may hold on to them */
+static GHashTable *replay_accounts = NULL;
+static GHashTable *replay_buddies = NULL;
+
+/* called by set_callback */
+void recorder_add_handler(const char *handler_name, VALUE *handler)
+{
+  if (NULL == handlers)
+    handlers = g_hash_table_new(g_str_hash, g_str_equal);
+  g_hash_table_insert(handlers, (gpointer)handler_name, handler);
+}
+
+static void put_bytes(const char *bytes, guint32 len)
+{
+  g_string_append_len(record_buffer, (const char *)&len, sizeof(len));
+  g_string_append_len(record_buffer, bytes, len);
+}
+
+static void put_string(const char *s)
+{
+  put_bytes(s ? s : "", s ? strlen(s) : 0);
+}
+
+static void put_arg(VALUE arg)
+{
+  if (NIL_P(arg)) {
+    g_string_append_c(record_buffer, ARG_NIL);
+  } else if (Qtrue == arg) {
+    g_string_append_c(record_buffer, ARG_TRUE);
+  } else if (Qfalse == arg) {
+    g_string_append_c(record_buffer, ARG_FALSE);
+  } else if (FIXNUM_P(arg)) {
+    gint64 i = FIX2LONG(arg);
+    g_string_append_c(record_buffer, ARG_INT);
+    g_string_append_len(record_buffer, (const char *)&i, sizeof(i));
+  } else if (RB_FLOAT_TYPE_P(arg)) {
+    double d = RFLOAT_VALUE(arg);
+    g_string_append_c(record_buffer, ARG_FLOAT);
+    g_string_append_len(record_buffer, (const char *)&d, sizeof(d));
+  } else if (RB_TYPE_P(arg, T_STRING)) {
+    g_string_append_c(record_buffer, ARG_STRING);
+    put_bytes(RSTRING_PTR(arg), RSTRING_LEN(arg));
+  } else if (SYMBOL_P(arg)) {
+    g_string_append_c(record_buffer, ARG_SYMBOL);
+    put_string(rb_id2name(SYM2ID(arg)));
+  } else if (RTEST(rb_obj_is_kind_of(arg, cAccount))) {
+    PurpleAccount *account;
+    Data_Get_Struct(arg, PurpleAccount, account);
+    g_string_append_c(record_buffer, ARG_ACCOUNT);
+    put_string(purple_account_get_protocol_id(account));
+    put_string(purple_account_get_username(account));
+  } else if (RTEST(rb_obj_is_kind_of(arg, cBuddy))) {
+    PurpleBuddy *buddy;
+    Data_Get_Struct(arg, PurpleBuddy, buddy);
+    g_string_append_c(record_buffer, ARG_BUDDY);
+    put_string(purple_account_get_protocol_id(purple_buddy_get_account(buddy)));
+    put_string(purple_account_get_username(purple_buddy_get_account(buddy)));
+    put_string(purple_buddy_get_name(buddy));
+  } else {
+    unsupported++;
+    g_string_append_c(record_buffer, ARG_NIL);
+  }
+}
+
+/* called by call_handler for every handler call */
+void recorder_handler_call(const char *handler_name, const char *event, int argc, VALUE *argv)
+{
+  gint64 time;
+  guint32 size;
+  int i;
+
+  if (NULL == recording || NULL == g_hash_table_lookup(handlers, handler_name))
+    return;
+
+  time = g_get_monotonic_time() - recording_start;
+  g_string_truncate(record_buffer, 0);
+  g_string_append_len(record_buffer, (const char *)&time, sizeof(time));
+  put_string(handler_name);
+  put_string(event);
+  g_string_append_c(record_buffer, (char)argc);
+  for (i = 0; i < argc; i++)
+    put_arg(argv[i]);
+
+  size = record_buffer->len;
+  fwrite(&size, sizeof(size), 1, recording);
+  fwrite(record_buffer->str, 1, record_buffer->len, recording);
+  recorded++;
+}
+
+/*
+ * PurpleRuby.record(path)
+ *
+ * Start recording handler calls to path, replacing it.
+ */
+static VALUE record(VALUE self, VALUE path)
+{
+  if (recording != NULL)
+    rb_raise(rb_eRuntimeError, "record: already recording to %s", recording_path);
+  if (replaying)
+    rb_raise(rb_eRuntimeError, "record: cannot record during a replay");
+
+  recording = fopen(StringValueCStr(path), "wb");
+  if (NULL == recording)
+    rb_raise(rb_eRuntimeError, "record: %s: %s", StringValueCStr(path), g_strerror(errno));
+  fwrite(RECORDING_MAGIC, 1, RECORDING_MAGIC_LEN, recording);
+
+  recording_path = g_strdup(StringValueCStr(path));
+  recording_start = g_get_monotonic_time();
+  recorded = 0;
+  unsupported = 0;
+  if (NULL == record_buffer)
+    record_buffer = g_string_sized_new(256);
+  if (NULL == handlers)
+    handlers = g_hash_table_new(g_str_hash, g_str_equal);
+
+  return path;
+}
+
+/*
+ * PurpleRuby.stop_recording => number of calls recorded
+ */
+static VALUE stop_recording(VALUE self)
+{
+  if (NULL == recording)
+    return Qnil;
+
+  fclose(recording);
+  recording = NULL;
+  g_free(recording_path);
+  recording_path = NULL;
+
+  if (unsupported > 0)
+    rb_warn("record: %lu arguments of unsupported types were recorded as nil", unsupported);
+
+  return ULONG2NUM(recorded);
+}
+
+/* reading back, all functions fail on a truncated record */
+typedef struct {
+  const char *p;
+  const char *end;
+} Reader;
+
+static gboolean get(Reader *r, void *out, gsize len)
+{
+  if ((gsize)(r->end - r->p) < len)
+    return FALSE;
+  memcpy(out, r->p, len);
+  r->p += len;
+  return TRUE;
+}
+
+static gboolean get_bytes(Reader *r, const char **bytes, guint32 *len)
+{
+  if (!get(r, len, sizeof(*len)) || (gsize)(r->end - r->p) < *len)
+    return FALSE;
+  *bytes = r->p;
+  r->p += *len;
+  return TRUE;
+}
+
+/* a nul terminated copy, for lookups */
+static gboolean get_string(Reader *r, char **s)
+{
+  const char *bytes;
+  guint32 len;
+
+  if (!get_bytes(r, &bytes, &len))
+    return FALSE;
+  *s = g_strndup(bytes, len);
+  return TRUE;
+}
+
+static PurpleAccount *replay_account(const char *protocol, const char *username)
+{
+  PurpleAccount *account = purple_accounts_find(username, protocol);
+  char *key;
+
+  if (account != NULL)
+    return account;
+
+  key = g_strdup_printf("%s/%s", protocol, username);
+  account = g_hash_table_lookup(replay_accounts, key);
+  if (NULL == account) {
+    account = purple_account_new(username, protocol);
+    g_hash_table_insert(replay_accounts, key, account);
+  } else {
+    g_free(key);
+  }
+  return account;
+}
+
+static PurpleBuddy *replay_buddy(PurpleAccount *account, const char *name)
+{
+  PurpleBuddy *buddy = purple_find_buddy(account, name);
+  char *key;
+
+  if (buddy != NULL)
+    return buddy;
+
+  key = g_strdup_printf("%p/%s", (void *)account, name);
+  buddy = g_hash_table_lookup(replay_buddies, key);
+  if (NULL == buddy) {
+    buddy = purple_buddy_new(account, name, NULL);
+    g_hash_table_insert(replay_buddies, key, buddy);
+  } else {
+    g_free(key);
+  }
+  return buddy;
+}
+
+static gboolean get_arg(Reader *r, VALUE *arg)
+{
+  char tag;
+
+  if (!get(r, &tag, 1))
+    return FALSE;
+
+  switch (tag) {
+  case ARG_NIL:
+    *arg = Qnil;
+    return TRUE;
+  case ARG_TRUE:
+    *arg = Qtrue;
+    return TRUE;
+  case ARG_FALSE:
+    *arg = Qfalse;
+    return TRUE;
+  case ARG_INT: {
+    gint64 i;
+    if (!get(r, &i, sizeof(i)))
+      return FALSE;
+    *arg = LL2NUM(i);
+    return TRUE;
+  }
+  case ARG_FLOAT: {
+    double d;
+    if (!get(r, &d, sizeof(d)))
+      return FALSE;
+    *arg = rb_float_new(d);
+    return TRUE;
+  }
+  case ARG_STRING: {
+    const char *bytes;
+    guint32 len;
+    if (!get_bytes(r, &bytes, &len))
+      return FALSE;
+    *arg = rb_str_new(bytes, len);
+    return TRUE;
+  }
+  case ARG_SYMBOL: {
+    const char *bytes;
+    guint32 len;
+    if (!get_bytes(r, &bytes, &len))
+      return FALSE;
+    *arg = ID2SYM(rb_intern2(bytes, len));
+    return TRUE;
+  }
+  case ARG_ACCOUNT:
+  case ARG_BUDDY: {
+    char *protocol = NULL, *username = NULL, *name = NULL;
+    gboolean ok = get_string(r, &protocol) && get_string(r, &username) &&
+                  (ARG_ACCOUNT == tag || get_string(r, &name));
+    if (ok) {
+      PurpleAccount *account = replay_account(protocol, username);
+      if (ARG_ACCOUNT == tag)
+        *arg = Data_Wrap_Struct(cAccount, NULL, NULL, account);
+      else
+        *arg = Data_Wrap_Struct(cBuddy, NULL, NULL, replay_buddy(account, name));
+    }
+    g_free(protocol);
+    g_free(username);
+    g_free(name);
+    return ok;
+  }
+  default:
+    return FALSE;
+  }
+}
+
+typedef struct {
+  GArray *latencies;    /* gint64 us */
+  unsigned long errors;
+} ReplayHandler;
+
+static void replay_handler_free(gpointer data)
+{
+  ReplayHandler *h = data;
+
+  g_array_free(h->latencies, TRUE);
+  g_free(h);
+}
+
+typedef struct {
+  VALUE handler;
+  const char *handler_name;
+  const char *event;
+  int argc;
+  VALUE *argv;
+} ReplayCall;
+
+static VALUE replay_call(VALUE arg)
+{
+  ReplayCall *call = (ReplayCall *)arg;
+
+  return call_handler(call->handler, call->handler_name, call->event, call->argc, call->argv);
+}
+
+typedef struct {
+  gboolean woken;
+  guint id;
+} ReplayWait;
+
+static gboolean replay_wake(gpointer data)
+{
+  ((ReplayWait *)data)->woken = TRUE;
+  return FALSE;
+}
+
+static VALUE replay_wait_body(VALUE arg)
+{
+  ReplayWait *wait = (ReplayWait *)arg;
+
+  while (!wait->woken)
+    g_main_context_iteration(NULL, TRUE);
+  return Qnil;
+}
+
+/* a handler run by the loop may raise, the timeout must not outlive wait */
+static VALUE replay_wait_ensure(VALUE arg)
+{
+  ReplayWait *wait = (ReplayWait *)arg;
+
+  if (!wait->woken)
+    purple_timeout_remove(wait->id);
+  return Qnil;
+}
+
+/* run the main loop until due, so timers and io keep going as they would have */
+static void replay_wait(gint64 due)
+{
+  gint64 now = g_get_monotonic_time();
+  ReplayWait wait = { FALSE, 0 };
+
+  if (due <= now)
+    return;
+
+  wait.id = purple_timeout_add((due - now + 999) / 1000, replay_wake, &wait);
+  rb_ensure(replay_wait_body, (VALUE)&wait, replay_wait_ensure, (VALUE)&wait);
+}
+
+static gint compare_latency(gconstpointer a, gconstpointer b)
+{
+  gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static VALUE percentile(GArray *latencies, int pct)
+{
+  if (0 == latencies->len)
+    return Qnil;
+  return LL2NUM(g_array_index(latencies, gint64, (latencies->len - 1) * pct / 100));
+}
+
+typedef struct {
+  const char *map;
+  gsize size;
+  double speed;         /* 0 is as fast as possible */
+  GHashTable *stats;    /* handler_name => ReplayHandler* */
+} Replay;
+
+static VALUE replay_body(VALUE arg)
+{
+  Replay *replay = (Replay *)arg;
+  Reader r = { replay->map + RECORDING_MAGIC_LEN, replay->map + replay->size };
+  gint64 start = g_get_monotonic_time();
+  gint64 elapsed;
+  unsigned long events = 0, skipped = 0;
+  gboolean truncated = FALSE;
+  VALUE result, by_handler;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  while (r.p < r.end) {
+    guint32 size;
+    gint64 time;
+    char *handler_name = NULL, *event = NULL;
+    unsigned char argc;
+    VALUE argv[16], *handler;
+    Reader body;
+    int i;
+
+    if (!get(&r, &size, sizeof(size)) || (gsize)(r.end - r.p) < size) {
+      truncated = TRUE;
+      break;
+    }
+    body.p = r.p;
+    body.end = r.p + size;
+    r.p += size;
+
+    if (!get(&body, &time, sizeof(time)) || !get_string(&body, &handler_name) ||
+        !get_string(&body, &event) || !get(&body, &argc, 1) || argc > G_N_ELEMENTS(argv)) {
+      g_free(handler_name);
+      g_free(event);
+      truncated = TRUE;
+      break;
+    }
+    for (i = 0; i < argc; i++) {
+      if (!get_arg(&body, &argv[i]))
+        break;
+    }
+
+    handler = handlers ? g_hash_table_lookup(handlers, handler_name) : NULL;
+    if (i < argc || NULL == handler || NIL_P(*handler)) {
+      skipped++;
+    } else {
+      ReplayHandler *h = g_hash_table_lookup(replay->stats, handler_name);
+      ReplayCall call = { *handler, handler_name, event, argc, argv };
+      gint64 t;
+      int state = 0;
+
+      if (NULL == h) {
+        h = g_new0(ReplayHandler, 1);
+        h->latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+        g_hash_table_insert(replay->stats, g_strdup(handler_name), h);
+      }
+
+      if (replay->speed > 0)
+        replay_wait(start + (gint64)(time / replay->speed));
+
+      t = g_get_monotonic_time();
+      rb_protect(replay_call, (VALUE)&call, &state);
+      t = g_get_monotonic_time() - t;
+      g_array_append_val(h->latencies, t);
+      if (state) {
+        h->errors++;
+        rb_set_errinfo(Qnil);
+      }
+      events++;
+    }
+
+    g_free(handler_name);
+    g_free(event);
+  }
+  elapsed = g_get_monotonic_time() - start;
+
+  by_handler = rb_hash_new();
+  g_hash_table_iter_init(&iter, replay->stats);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    ReplayHandler *h = value;
+    VALUE hash = rb_hash_new();
+
+    g_array_sort(h->latencies, compare_latency);
+    rb_hash_aset(hash, ID2SYM(rb_intern("calls")), UINT2NUM(h->latencies->len));
+    rb_hash_aset(hash, ID2SYM(rb_intern("errors")), ULONG2NUM(h->errors));
+    rb_hash_aset(hash, ID2SYM(rb_intern("p50_us")), percentile(h->latencies, 50));
+    rb_hash_aset(hash, ID2SYM(rb_intern("p99_us")), percentile(h->latencies, 99));
+    rb_hash_aset(hash, ID2SYM(rb_intern("max_us")), percentile(h->latencies, 100));
+    rb_hash_aset(by_handler, rb_str_new2(key), hash);
+  }
+
+  result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("events")), ULONG2NUM(events));
+  rb_hash_aset(result, ID2SYM(rb_intern("skipped")), ULONG2NUM(skipped));
+  rb_hash_aset(result, ID2SYM(rb_intern("truncated")), truncated ? Qtrue : Qfalse);
+  rb_hash_aset(result, ID2SYM(rb_intern("seconds")), rb_float_new(elapsed / 1e6));
+  rb_hash_aset(result, ID2SYM(rb_intern("per_second")),
+               rb_float_new(elapsed > 0 ? events * 1e6 / elapsed : 0));
+  rb_hash_aset(result, ID2SYM(rb_intern("handlers")), by_handler);
+
+  return result;
+}
+
+static VALUE replay_ensure(VALUE arg)
+{
+  Replay *replay = (Replay *)arg;
+
+  munmap((void *)replay->map, replay->size);
+  g_hash_table_destroy(replay->stats);
+  replaying = FALSE;
+  return Qnil;
+}
+
+/*
+ * PurpleRuby.replay(path, speed = 0) => Hash
+ *
+ * speed 1.0 keeps the recorded pacing, 2.0 is twice as fast, 0 doesn't
+ * wait at all. Calls for handlers that are not registered are skipped.
+ * Returns throughput and, per handler, calls, errors and latency
+ * percentiles in microseconds.
+ */
+static VALUE replay(int argc, VALUE *argv, VALUE self)
+{
+  VALUE path, speed;
+  Replay replay;
+  struct stat st;
+  void *map;
+  int fd;
+
+  rb_scan_args(argc, argv, "11", &path, &speed);
+
+  if (recording != NULL)
+    rb_raise(rb_eRuntimeError, "replay: cannot replay while recording");
+  if (replaying)
+    rb_raise(rb_eRuntimeError, "replay: already replaying");
+
+  fd = open(StringValueCStr(path), O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    rb_raise(rb_eRuntimeError, "replay: %s: %s", StringValueCStr(path), g_strerror(errno));
+  }
+  if (st.st_size < RECORDING_MAGIC_LEN) {
+    close(fd);
+    rb_raise(rb_eRuntimeError, "replay: %s is not a recording", StringValueCStr(path));
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (MAP_FAILED == map)
+    rb_raise(rb_eRuntimeError, "replay: %s: %s", StringValueCStr(path), g_strerror(errno));
+  if (memcmp(map, RECORDING_MAGIC, RECORDING_MAGIC_LEN) != 0) {
+    munmap(map, st.st_size);
+    rb_raise(rb_eRuntimeError, "replay: %s is not a recording", StringValueCStr(path));
+  }
+
+  if (NULL == replay_accounts) {
+    replay_accounts = g_hash_table_new(g_str_hash, g_str_equal);
+    replay_buddies = g_hash_table_new(g_str_hash, g_str_equal);
+  }
+
+  replay.map = map;
+  replay.size = st.st_size;
+  replay.speed = NIL_P(speed) ? 0 : NUM2DBL(speed);
+  replay.stats = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, replay_handler_free);
+  replaying = TRUE;
+
+  return rb_ensure(replay_body, (VALUE)&replay, replay_ensure, (VALUE)&replay);
+}
+
+/*
+ * PurpleRuby.recording? => true or false
+ */
+static VALUE is_recording(VALUE self)
+{
+  return recording ? Qtrue : Qfalse;
+}
+
+void init_recorder(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "record", record, 1);
+  rb_define_singleton_method(cPurpleRuby, "stop_recording", stop_recording, 0);
+  rb_define_singleton_method(cPurpleRuby, "recording?", is_recording, 0);
+  rb_define_singleton_method(cPurpleRuby, "replay", replay, -1);
+}
@@ -0,0 +1,515 @@
+/*
+ * Shared memory submission ring for producers on the same host.
+ *
+ * PurpleRuby.ring_open(path) maps a ring file (put it on /dev/shm) that
+ * producers append IM records to, see purple_ruby_ring.h for the layout and
+ * the C client. An eventfd watched by the main loop is the doorbell; it is
+ * handed to producers over the unix socket <path>.sock and only rung when
+ * the ring was empty, so a busy producer makes no syscalls. Records are
+ * drained ring_batch at a time per main loop iteration straight into
+ * serv_send_im, or the account's spool when it is offline. Records still in
+ * the ring when the gateway stops are sent after ring_open in the next run.
+ * A record no producer could have written stops the drain (ring_stats shows
+ * :corrupt); ring_open(path, size, true) then starts the ring over.
+ *
+ * PurpleRuby::RingWriter is the same client for ruby producers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/debug.h>
+#include <libpurple/eventloop.h>
+#include <libpurple/signals.h>
+
+#include <ruby.h>
+
+#include "probes.h"
+#include "purple_ruby_ring.h"
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#define DEFAULT_RING_SIZE (4 * 1024 * 1024)
+#define DEFAULT_RING_BATCH 256
+
+extern int account_send_im(PurpleAccount *account, const char *name, const char *message);
+extern gboolean spool_add(PurpleAccount *account, gboolean common, VALUE name, VALUE message);
+
+typedef struct {
+  char *path;
+  char *sock_path;
+  PurpleRubyRing ring;
+  int listener;
+  guint listener_input;
+  guint doorbell_input;
+  guint drain_source;         /* idle source, not on the timer wheel */
+  GHashTable *accounts;       /* "protocol\nusername" => PurpleAccount* */
+  GString *buf;
+  gboolean corrupt;           /* stopped on a bad record */
+} Ring;
+
+static Ring *ring = NULL;
+static guint ring_batch = DEFAULT_RING_BATCH;
+static VALUE cRingWriter;
+
+static unsigned long received = 0;
+static unsigned long sent = 0;
+static unsigned long spooled = 0;
+static unsigned long dropped = 0;
+static unsigned long doorbells = 0;
+static unsigned long batches = 0;
+
+static PurpleAccount *ring_account(const char *protocol, gsize protocol_len, const char *username, gsize username_len)
+{
+  PurpleAccount *account;
+  char *key = g_strdup_printf("%.*s\n%.*s", (int)protocol_len, protocol, (int)username_len, username);
+
+  if ((account = g_hash_table_lookup(ring->accounts, key)) != NULL) {
+    g_free(key);
+    return account;
+  }
+
+  /* key is "protocol\0username" for the lookup */
+  key[protocol_len] = '\0';
+  account = purple_accounts_find(key + protocol_len + 1, key);
+  key[protocol_len] = '\n';
+  if (account != NULL)
+    g_hash_table_insert(ring->accounts, key, account);
+  else
+    g_free(key);
+  return account;
+}
+
+static void ring_deliver(PurpleRubyRingRecord *record)
+{
+  const char *protocol = (const char *)(record + 1);
+  const char *username = protocol + record->protocol_len;
+  const char *recipient = username + record->username_len;
+  const char *message = recipient + record->recipient_len;
+  PurpleAccount *account = ring_account(protocol, record->protocol_len, username, record->username_len);
+  GString *buf = ring->buf;
+  char *to;
+
+  received++;
+  if (NULL == account) {
+    dropped++;
+    return;
+  }
+
+  /* recipient\0message\0 */
+  g_string_truncate(buf, 0);
+  g_string_append_len(buf, recipient, record->recipient_len);
+  g_string_append_c(buf, '\0');
+  g_string_append_len(buf, message, record->message_len);
+  to = buf->str;
+
+  PROBE4(send__im, purple_account_get_username(account), purple_account_get_protocol_id(account),
+    to, record->message_len);
+
+  if (purple_account_is_connected(account)) {
+    account_send_im(account, to, to + record->recipient_len + 1);
+    sent++;
+  } else if (spool_add(account, FALSE, rb_str_new(to, record->recipient_len),
+                       rb_str_new(message, record->message_len))) {
+    spooled++;
+  } else {
+    dropped++;
+  }
+}
+
+/* a record a producer could have written, left is the room to the end of the data area */
+static gboolean ring_record_ok(PurpleRubyRingRecord *record, guint64 left)
+{
+  if (record->size & PURPLE_RUBY_RING_PAD)
+    return (record->size & ~PURPLE_RUBY_RING_PAD) == left;
+  return record->size >= sizeof(*record) && record->size <= left && 0 == (record->size & 7) &&
+    sizeof(*record) + (guint64)record->protocol_len + record->username_len +
+    record->recipient_len + record->message_len <= record->size;
+}
+
+/* up to ring_batch records, TRUE when some are left */
+static gboolean ring_drain_batch(void)
+{
+  PurpleRubyRingHeader *h = ring->ring.header;
+  uint64_t tail = h->tail, mask = h->size - 1;
+  guint n;
+
+  batches++;
+  for (n = 0; n < ring_batch; n++) {
+    char *at = ring->ring.data + (tail & mask);
+    uint32_t size = __atomic_load_n((uint32_t *)at, __ATOMIC_ACQUIRE);
+
+    if (0 == size)
+      break;
+    if (!ring_record_ok((PurpleRubyRingRecord *)at, h->size - (tail & mask))) {
+      purple_debug_error("purple_ruby", "ring: bad record at %" G_GUINT64_FORMAT ", not draining %s\n",
+        (guint64)tail, ring->path);
+      ring->corrupt = TRUE;
+      return FALSE;
+    }
+    if (!(size & PURPLE_RUBY_RING_PAD)) {
+      ring_deliver((PurpleRubyRingRecord *)at);
+      if (NULL == ring)   /* closed from a handler */
+        return FALSE;
+    }
+    size &= ~PURPLE_RUBY_RING_PAD;
+
+    /* a zero size is how the next lap knows the slot is not written yet */
+    memset(at, 0, size);
+    tail += size;
+    __atomic_store_n(&h->tail, tail, __ATOMIC_RELEASE);
+  }
+  PROBE2(ring__drain, n, h->head - tail);
+
+  return n == ring_batch;
+}
+
+static gboolean ring_drain(gpointer data)
+{
+  PurpleRubyRingHeader *h;
+
+  if (ring_drain_batch())
+    return TRUE;
+  if (NULL == ring)
+    return FALSE;
+  if (ring->corrupt) {
+    ring->drain_source = 0;
+    return FALSE;
+  }
+
+  /* going to sleep: ask for the doorbell, then look again for a record published meanwhile */
+  h = ring->ring.header;
+  __atomic_store_n(&h->sleeping, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n((uint32_t *)(ring->ring.data + (h->tail & (h->size - 1))), __ATOMIC_ACQUIRE) != 0) {
+    __atomic_store_n(&h->sleeping, 0, __ATOMIC_RELAXED);
+    return TRUE;
+  }
+
+  ring->drain_source = 0;
+  return FALSE;
+}
+
+static void ring_start_drain(void)
+{
+  if (0 == ring->drain_source && !ring->corrupt)
+    ring->drain_source = g_idle_add(ring_drain, NULL);
+}
+
+static void ring_doorbell_cb(gpointer data, int fd, PurpleInputCondition condition)
+{
+  uint64_t count;
+
+  if (read(fd, &count, sizeof(count)) == sizeof(count))
+    doorbells++;
+  ring_start_drain();
+}
+
+/* hand the doorbell to a producer */
+static void ring_accept_cb(gpointer data, int listener, PurpleInputCondition condition)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char c = 0;
+  int client = accept(listener, NULL, NULL);
+
+  if (client < 0)
+    return;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  iov.iov_base = &c;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &ring->ring.doorbell, sizeof(int));
+
+  if (sendmsg(client, &msg, MSG_NOSIGNAL) != 1)
+    purple_debug_warning("purple_ruby", "ring: sending the doorbell: %s\n", g_strerror(errno));
+  close(client);
+}
+
+static void ring_account_destroying(PurpleAccount *account, gpointer data)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (NULL == ring)
+    return;
+  g_hash_table_iter_init(&iter, ring->accounts);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    if (value == account)
+      g_hash_table_iter_remove(&iter);
+  }
+}
+
+static void *ring_get_handle(void)
+{
+  static int handle;
+
+  return &handle;
+}
+
+static void ring_close(void)
+{
+  if (NULL == ring)
+    return;
+
+  if (ring->drain_source != 0)
+    g_source_remove(ring->drain_source);
+  if (ring->doorbell_input != 0)
+    purple_input_remove(ring->doorbell_input);
+  if (ring->listener_input != 0)
+    purple_input_remove(ring->listener_input);
+  if (ring->listener >= 0) {
+    close(ring->listener);
+    unlink(ring->sock_path);
+  }
+  purple_ruby_ring_detach(&ring->ring);
+  g_hash_table_destroy(ring->accounts);
+  g_string_free(ring->buf, TRUE);
+  g_free(ring->sock_path);
+  g_free(ring->path);
+  g_free(ring);
+  ring = NULL;
+}
+
+static void ring_fail(const char *what)
+{
+  char *message = g_strdup_printf("ring_open: %s %s: %s", what, ring->path, g_strerror(errno));
+  VALUE error = rb_exc_new2(rb_eRuntimeError, message);
+
+  g_free(message);
+  ring_close();
+  rb_exc_raise(error);
+}
+
+/*
+ * PurpleRuby.ring_open(path, size = 4MB, reset = false)
+ *
+ * size is rounded up to a power of 2. An existing ring of the same size is
+ * kept with what is queued in it, unless reset is true: then what is queued
+ * is dropped, which is how a corrupt ring is recovered. Producers must not
+ * be writing while it is reset.
+ */
+static VALUE ring_open(int argc, VALUE* argv, VALUE self)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  static gboolean connected = FALSE;
+  VALUE path, size_value, reset;
+  guint64 size = DEFAULT_RING_SIZE, data_offset = sizeof(PurpleRubyRingHeader);
+  struct sockaddr_un addr;
+  PurpleRubyRingHeader *h;
+  int fd;
+
+  rb_scan_args(argc, argv, "12", &path, &size_value, &reset);
+  if (!NIL_P(size_value))
+    size = NUM2ULL(size_value);
+  if (size < 4096 || size > G_MAXUINT32 / 2 + 1)
+    rb_raise(rb_eArgError, "ring_open: size should be between 4KB and 2GB");
+  while (size & (size - 1))
+    size += size & -size;
+
+  ring_close();
+  ring = g_new0(Ring, 1);
+  ring->path = g_strdup(StringValueCStr(path));
+  ring->sock_path = g_strdup_printf("%s.sock", ring->path);
+  ring->listener = -1;
+  ring->ring.doorbell = -1;
+  ring->accounts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  ring->buf = g_string_new(NULL);
+
+  if ((fd = open(ring->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+    ring_fail("open");
+  if (ftruncate(fd, data_offset + size) != 0) {
+    close(fd);
+    ring_fail("ftruncate");
+  }
+  h = mmap(NULL, data_offset + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (MAP_FAILED == (void *)h)
+    ring_fail("mmap");
+  ring->ring.header = h;
+  ring->ring.map_size = data_offset + size;
+  ring->ring.data = (char *)h + data_offset;
+
+  if (RTEST(reset) || memcmp(h->magic, PURPLE_RUBY_RING_MAGIC, 8) != 0 || h->size != size ||
+      h->data_offset != data_offset) {
+    if (RTEST(reset) && h->head != h->tail)
+      purple_debug_warning("purple_ruby", "ring: reset %s, dropped %" G_GUINT64_FORMAT " bytes of records\n",
+        ring->path, (guint64)(h->head - h->tail));
+    memset(h, 0, data_offset + size);
+    h->size = size;
+    h->data_offset = data_offset;
+    __sync_synchronize();
+    memcpy(h->magic, PURPLE_RUBY_RING_MAGIC, 8);
+  }
+  h->sleeping = 0;
+
+  if ((ring->ring.doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    ring_fail("eventfd");
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(ring->sock_path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    ring_fail("socket");
+  }
+  strcpy(addr.sun_path, ring->sock_path);
+  unlink(ring->sock_path);
+  if ((ring->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    ring_fail("socket");
+  if (bind(ring->listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(ring->listener, 64) != 0)
+    ring_fail("bind");
+
+  ring->listener_input = purple_input_add(ring->listener, PURPLE_INPUT_READ, ring_accept_cb, NULL);
+  ring->doorbell_input = purple_input_add(ring->ring.doorbell, PURPLE_INPUT_READ, ring_doorbell_cb, NULL);
+  if (!connected) {
+    purple_signal_connect(purple_accounts_get_handle(), "account-destroying", ring_get_handle(),
+              PURPLE_CALLBACK(ring_account_destroying), NULL);
+    connected = TRUE;
+  }
+
+  /* whatever an earlier run left */
+  ring_start_drain();
+  return path;
+#else
+  rb_raise(rb_eNotImpError, "ring_open: needs eventfd");
+  return Qnil;
+#endif
+}
+
+static VALUE ring_close_rb(VALUE self)
+{
+  ring_close();
+  return Qnil;
+}
+
+/*
+ * PurpleRuby.ring_batch = records per main loop iteration
+ */
+static VALUE set_ring_batch(VALUE self, VALUE count)
+{
+  if (NUM2UINT(count) < 1)
+    rb_raise(rb_eArgError, "ring_batch should be positive");
+  ring_batch = NUM2UINT(count);
+  return count;
+}
+
+/*
+ * PurpleRuby.ring_stats => Hash
+ */
+static VALUE ring_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+
+  if (ring != NULL) {
+    PurpleRubyRingHeader *h = ring->ring.header;
+    rb_hash_aset(hash, ID2SYM(rb_intern("path")), rb_str_new2(ring->path));
+    rb_hash_aset(hash, ID2SYM(rb_intern("size")), UINT2NUM(h->size));
+    rb_hash_aset(hash, ID2SYM(rb_intern("head")), ULL2NUM(__atomic_load_n(&h->head, __ATOMIC_ACQUIRE)));
+    rb_hash_aset(hash, ID2SYM(rb_intern("tail")), ULL2NUM(h->tail));
+    rb_hash_aset(hash, ID2SYM(rb_intern("corrupt")), ring->corrupt ? Qtrue : Qfalse);
+  }
+  rb_hash_aset(hash, ID2SYM(rb_intern("received")), ULONG2NUM(received));
+  rb_hash_aset(hash, ID2SYM(rb_intern("sent")), ULONG2NUM(sent));
+  rb_hash_aset(hash, ID2SYM(rb_intern("spooled")), ULONG2NUM(spooled));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dropped")), ULONG2NUM(dropped));
+  rb_hash_aset(hash, ID2SYM(rb_intern("doorbells")), ULONG2NUM(doorbells));
+  rb_hash_aset(hash, ID2SYM(rb_intern("batches")), ULONG2NUM(batches));
+
+  return hash;
+}
+
+static void writer_free(PurpleRubyRing *writer)
+{
+  purple_ruby_ring_detach(writer);
+  g_free(writer);
+}
+
+static PurpleRubyRing *get_writer(VALUE self)
+{
+  PurpleRubyRing *writer;
+  Data_Get_Struct(self, PurpleRubyRing, writer);
+  if (NULL == writer->header)
+    rb_raise(rb_eIOError, "RingWriter is closed");
+  return writer;
+}
+
+/*
+ * PurpleRuby::RingWriter.new(path)
+ *
+ * A producer for the ring another process opened with ring_open(path).
+ */
+static VALUE writer_new(VALUE klass, VALUE path)
+{
+  PurpleRubyRing *writer = g_new0(PurpleRubyRing, 1);
+  VALUE obj;
+
+  writer->doorbell = -1;
+  obj = Data_Wrap_Struct(klass, NULL, writer_free, writer);
+  if (purple_ruby_ring_attach(writer, StringValueCStr(path)) != 0)
+    rb_sys_fail(RSTRING_PTR(path));
+  return obj;
+}
+
+/*
+ * writer.write(protocol, username, to, message) => true, or false when the ring is full
+ */
+static VALUE writer_write(VALUE self, VALUE protocol, VALUE username, VALUE to, VALUE message)
+{
+  PurpleRubyRing *writer = get_writer(self);
+
+  StringValue(message);
+  if (purple_ruby_ring_send(writer, StringValueCStr(protocol), StringValueCStr(username), StringValueCStr(to),
+                            RSTRING_PTR(message), RSTRING_LEN(message)) == 0)
+    return Qtrue;
+  if (EAGAIN == errno)
+    return Qfalse;
+  rb_sys_fail("RingWriter#write");
+  return Qnil;
+}
+
+static VALUE writer_close(VALUE self)
+{
+  PurpleRubyRing *writer;
+  Data_Get_Struct(self, PurpleRubyRing, writer);
+  purple_ruby_ring_detach(writer);
+  return Qnil;
+}
+
+void init_ring(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "ring_open", ring_open, -1);
+  rb_define_singleton_method(cPurpleRuby, "ring_close", ring_close_rb, 0);
+  rb_define_singleton_method(cPurpleRuby, "ring_batch=", set_ring_batch, 1);
+  rb_define_singleton_method(cPurpleRuby, "ring_stats", ring_stats, 0);
+
+  cRingWriter = rb_define_class_under(cPurpleRuby, "RingWriter", rb_cObject);
+  rb_undef_alloc_func(cRingWriter);
+  rb_define_singleton_method(cRingWriter, "new", writer_new, 1);
+  rb_define_method(cRingWriter, "write", writer_write, 4);
+  rb_define_method(cRingWriter, "close", writer_close, 0);
+}
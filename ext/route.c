@@ -0,0 +1,194 @@
+/*
+ * Native routing of IPC frames.
+ *
+ * In route mode (PurpleRuby.watch_incoming_ipc(ip, port, :route)) an IPC
+ * frame "<protocol>,<user>,<message>" is parsed here, the account is looked
+ * up in the table filled by PurpleRuby.ipc_route and the message goes
+ * straight to serv_send_im. The ipc block only gets the frames that could
+ * not be routed: malformed, no route, or account not connected. The audit
+ * hook, when set, is the only ruby call made for a routed frame.
+ *
+ * <protocol> is either a protocol id or "<protocol id>/<username>", and is
+ * looked up as given, so both kinds of route can be mixed.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/connection.h>
+#include <libpurple/server.h>
+#include <libpurple/signals.h>
+
+#include <ruby.h>
+#include <string.h>
+
+#include "probes.h"
+
+extern VALUE cAccount;
+extern PurpleAccount* get_account_from_ruby_object(VALUE acc);
+extern void set_callback(VALUE* handler, const char* handler_name);
+extern VALUE call_handler(VALUE handler, const char *handler_name, const char *event, int argc, VALUE *argv);
+
+static GHashTable *routes = NULL;   /* "protocol" or "protocol/username" => PurpleAccount* */
+static VALUE ipc_audit_handler = Qnil;
+
+static unsigned long routed = 0;
+static unsigned long unroutable = 0;
+static unsigned long not_connected = 0;
+
+/* a copy of [s, end) without surrounding whitespace, like the example's strip */
+static char *strip(const char *s, const char *end)
+{
+  while (s < end && g_ascii_isspace(*s))
+    s++;
+  while (end > s && g_ascii_isspace(end[-1]))
+    end--;
+  return g_strndup(s, end - s);
+}
+
+/*
+ * Called by the IPC reader with a complete frame.
+ * Returns FALSE when the frame is for the ruby ipc block, otherwise the
+ * frame has been freed: the audit handler may raise.
+ */
+gboolean ipc_route_frame(GString *frame)
+{
+  const char *data = frame->str, *end = data + frame->len, *first, *second;
+  gsize len = frame->len;
+  char *protocol, *user, *message;
+  PurpleAccount *account;
+  VALUE args[4];
+  int result;
+
+  if (NULL == routes || NULL == (first = memchr(data, ',', len)) ||
+      NULL == (second = memchr(first + 1, ',', end - first - 1))) {
+    unroutable++;
+    return FALSE;
+  }
+
+  protocol = strip(data, first);
+  account = g_hash_table_lookup(routes, protocol);
+  g_free(protocol);
+  PROBE2(ipc__route, len, NULL != account);
+  if (NULL == account) {
+    unroutable++;
+    return FALSE;
+  }
+  if (!purple_account_is_connected(account)) {
+    not_connected++;
+    return FALSE;
+  }
+
+  /* the message is everything after the second comma, commas included */
+  user = strip(first + 1, second);
+  if ('\0' == *user) {
+    g_free(user);
+    unroutable++;
+    return FALSE;
+  }
+  message = strip(second + 1, end);
+
+  PROBE4(send__im, purple_account_get_username(account), purple_account_get_protocol_id(account),
+    user, strlen(message));
+  result = serv_send_im(purple_account_get_connection(account), user, message, 0);
+  routed++;
+
+  /* the ruby strings first, nothing in C is left to leak if the handler raises */
+  if (ipc_audit_handler != Qnil) {
+    args[0] = Data_Wrap_Struct(cAccount, NULL, NULL, account);
+    args[1] = rb_str_new2(user);
+    args[2] = rb_str_new2(message);
+    args[3] = INT2FIX(result);
+  }
+  g_free(user);
+  g_free(message);
+  g_string_free(frame, TRUE);
+
+  if (ipc_audit_handler != Qnil)
+    call_handler(ipc_audit_handler, "ipc_audit_handler", "ipc", 4, args);
+  return TRUE;
+}
+
+static gboolean remove_account(gpointer key, gpointer value, gpointer account)
+{
+  return value == account;
+}
+
+static void account_destroying(PurpleAccount *account, gpointer data)
+{
+  g_hash_table_foreach_remove(routes, remove_account, account);
+}
+
+static void *route_get_handle(void)
+{
+  static int handle;
+
+  return &handle;
+}
+
+/*
+ * PurpleRuby.ipc_route(protocol, account)
+ *
+ * Route IPC frames for protocol ("prpl-jabber", or "prpl-jabber/username"
+ * to pick one of several accounts) to account; nil removes the route.
+ */
+static VALUE ipc_route(VALUE self, VALUE protocol, VALUE account)
+{
+  if (NULL == routes) {
+    routes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    purple_signal_connect(purple_accounts_get_handle(), "account-destroying", route_get_handle(),
+              PURPLE_CALLBACK(account_destroying), NULL);
+  }
+
+  if (NIL_P(account))
+    g_hash_table_remove(routes, StringValueCStr(protocol));
+  else
+    g_hash_table_replace(routes, g_strdup(StringValueCStr(protocol)), get_account_from_ruby_object(account));
+
+  return account;
+}
+
+/*
+ * PurpleRuby.watch_ipc_audit { |acc, user, message, result| }
+ *
+ * Called after each routed frame with what serv_send_im returned.
+ */
+static VALUE watch_ipc_audit(VALUE self)
+{
+  set_callback(&ipc_audit_handler, "ipc_audit_handler");
+  return ipc_audit_handler;
+}
+
+/*
+ * PurpleRuby.ipc_route_stats => Hash
+ */
+static VALUE ipc_route_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("routes")), UINT2NUM(routes ? g_hash_table_size(routes) : 0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("routed")), ULONG2NUM(routed));
+  rb_hash_aset(hash, ID2SYM(rb_intern("unroutable")), ULONG2NUM(unroutable));
+  rb_hash_aset(hash, ID2SYM(rb_intern("not_connected")), ULONG2NUM(not_connected));
+
+  return hash;
+}
+
+void init_route(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "ipc_route", ipc_route, 2);
+  rb_define_singleton_method(cPurpleRuby, "watch_ipc_audit", watch_ipc_audit, 0);
+  rb_define_singleton_method(cPurpleRuby, "ipc_route_stats", ipc_route_stats, 0);
+}
@@ -0,0 +1,570 @@
+/*
+ * Outbound spool for accounts that are not connected.
+ *
+ * With Account#spool = true, send_im and common_send on a disconnected
+ * account append the message to <user dir>/spool/<protocol>-<username> and
+ * return :spooled instead of nil. The file is mmap'd and only ever appended
+ * to; a record is marked done in place once it has been sent or has
+ * expired, and the file is truncated when nothing is left. Pending records
+ * are read back when the spool is enabled again, e.g. after a restart.
+ * Records survive the process dying; nothing is written to disk until the
+ * kernel gets to it, Account#spool_sync does it right away for when a host
+ * crash or power loss must not lose them.
+ *
+ * On signed-on the spool is flushed at PurpleRuby.spool_rate messages per
+ * second so a reconnect storm doesn't turn into a send storm.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/connection.h>
+#include <libpurple/debug.h>
+#include <libpurple/eventloop.h>
+#include <libpurple/signals.h>
+#include <libpurple/util.h>
+
+#include <ruby.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SPOOL_MAGIC "PRSPOOL1"
+#define SPOOL_HEADER 8
+#define SPOOL_MIN_SIZE (64 * 1024)
+#define SPOOL_ALIGN(n) (((n) + 7) & ~(gsize)7)
+
+extern VALUE cAccount;
+extern PurpleAccount* get_account_from_ruby_object(VALUE acc);
+extern int account_send_im(PurpleAccount *account, const char *name, const char *message);
+extern int account_common_send(PurpleAccount *account, const char *name, const char *message);
+
+/* followed by name and message, padded to 8 bytes */
+typedef struct {
+  guint32 size;         /* whole record, written last: 0 is the end */
+  guint8 common;        /* common_send rather than send_im */
+  guint8 done;
+  guint16 name_len;
+  guint32 message_len;
+  guint32 reserved;
+  gint64 expires;       /* time() */
+} SpoolRecord;
+
+typedef struct {
+  PurpleAccount *account;
+  char *path;
+  int fd;
+  char *map;
+  gsize map_size;
+  gsize used;
+  GQueue *pending;      /* offsets of records not yet sent, oldest first */
+  gsize bytes;          /* message bytes pending */
+  gint64 next_expiry;   /* no pending record expires before, 0 to scan */
+  guint flush;
+  gboolean flushing;
+  gboolean closed;
+  unsigned long spooled;
+  unsigned long flushed;
+  unsigned long expired;
+  unsigned long dropped;
+} Spool;
+
+static GHashTable *spools = NULL;   /* PurpleAccount* => Spool* */
+
+static guint spool_ttl = 3600;
+static guint spool_rate = 10;
+static gsize spool_max_bytes = 64 * 1024 * 1024;
+
+#define RECORD(spool, offset) ((SpoolRecord *)((spool)->map + (offset)))
+
+/* a complete record at offset, as spool_add writes them */
+static gboolean record_valid(Spool *spool, gsize offset)
+{
+  SpoolRecord *record = RECORD(spool, offset);
+
+  if (record->size < sizeof(SpoolRecord) || record->size != SPOOL_ALIGN(record->size) ||
+      record->size > spool->map_size - offset)
+    return FALSE;
+  return (gsize)record->name_len + record->message_len <= record->size - sizeof(SpoolRecord);
+}
+
+static gboolean spool_map(Spool *spool, gsize size)
+{
+  void *map;
+
+  if (ftruncate(spool->fd, size) != 0)
+    return FALSE;
+
+  if (spool->map != NULL)
+    munmap(spool->map, spool->map_size);
+  spool->map = NULL;
+
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, spool->fd, 0);
+  if (MAP_FAILED == map)
+    return FALSE;
+
+  spool->map = map;
+  spool->map_size = size;
+  return TRUE;
+}
+
+/* nothing pending, start the file over */
+static void spool_reset(Spool *spool)
+{
+  munmap(spool->map, spool->map_size);
+  spool->map = NULL;
+  if (ftruncate(spool->fd, SPOOL_HEADER) != 0 || !spool_map(spool, SPOOL_MIN_SIZE)) {
+    purple_debug_error("purple_ruby", "spool: %s: %s\n", spool->path, g_strerror(errno));
+    return;
+  }
+  spool->used = SPOOL_HEADER;
+  spool->bytes = 0;
+}
+
+static void spool_done_link(Spool *spool, GList *link)
+{
+  SpoolRecord *record = RECORD(spool, GPOINTER_TO_SIZE(link->data));
+
+  record->done = 1;
+  spool->bytes -= record->message_len;
+  g_queue_delete_link(spool->pending, link);
+  /* flush_cb resets it after the send, its offset must not be reused meanwhile */
+  if (g_queue_is_empty(spool->pending) && !spool->flushing)
+    spool_reset(spool);
+}
+
+static void spool_done(Spool *spool)
+{
+  spool_done_link(spool, spool->pending->head);
+}
+
+/*
+ * Records are pending in send order, but not in expiry order once
+ * spool_ttl has changed, so the whole queue is scanned. Only when the
+ * earliest expiry seen by the last scan has passed.
+ */
+static void spool_expire(Spool *spool)
+{
+  gint64 now = time(NULL), earliest = G_MAXINT64;
+  GList *link, *next;
+
+  if (NULL == spool->map || now < spool->next_expiry)
+    return;
+
+  for (link = spool->pending->head; link != NULL; link = next) {
+    SpoolRecord *record = RECORD(spool, GPOINTER_TO_SIZE(link->data));
+
+    next = link->next;
+    if (record->expires > now) {
+      earliest = MIN(earliest, record->expires);
+      continue;
+    }
+    spool->expired++;
+    spool_done_link(spool, link);
+  }
+  spool->next_expiry = earliest;
+}
+
+static gboolean flush_cb(gpointer data)
+{
+  Spool *spool = data;
+  SpoolRecord *record;
+  char *name, *message;
+  gsize offset;
+  int result;
+
+  spool_expire(spool);
+  if (!purple_account_is_connected(spool->account) || spool->map == NULL ||
+      g_queue_is_empty(spool->pending)) {
+    spool->flush = 0;
+    return FALSE;
+  }
+
+  /* copied, sending can reenter ruby and spool more, which may remap */
+  offset = GPOINTER_TO_SIZE(g_queue_peek_head(spool->pending));
+  record = RECORD(spool, offset);
+  name = g_strndup((char *)(record + 1), record->name_len);
+  message = g_strndup((char *)(record + 1) + record->name_len, record->message_len);
+
+  spool->flushing = TRUE;
+  if (record->common)
+    result = account_common_send(spool->account, name, message);
+  else
+    result = account_send_im(spool->account, name, message);
+  spool->flushing = FALSE;
+
+  g_free(name);
+  g_free(message);
+
+  if (spool->closed) {
+    g_free(spool);
+    return FALSE;
+  }
+
+  /* sent before it is marked done: a crash in between sends it twice rather than never */
+  if (result < 0)
+    spool->dropped++;
+  else
+    spool->flushed++;
+  /* unless it expired while the send was spooling more */
+  if (!g_queue_is_empty(spool->pending) && GPOINTER_TO_SIZE(g_queue_peek_head(spool->pending)) == offset)
+    spool_done(spool);
+
+  if (g_queue_is_empty(spool->pending)) {
+    /* expired during the send, spool_done_link left it to us */
+    if (spool->used > SPOOL_HEADER)
+      spool_reset(spool);
+    spool->flush = 0;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static void spool_start_flush(Spool *spool)
+{
+  if (spool->flush != 0 || g_queue_is_empty(spool->pending))
+    return;
+  spool->flush = purple_timeout_add(MAX(1, 1000 / MAX(spool_rate, 1)), flush_cb, spool);
+}
+
+static Spool *spool_open(PurpleAccount *account)
+{
+  Spool *spool;
+  char *dir;
+  struct stat st;
+  gsize offset;
+
+  dir = g_build_filename(purple_user_dir(), "spool", NULL);
+  if (g_mkdir_with_parents(dir, 0700) != 0) {
+    g_free(dir);
+    rb_raise(rb_eRuntimeError, "spool: cannot create %s/spool: %s", purple_user_dir(), g_strerror(errno));
+  }
+
+  spool = g_new0(Spool, 1);
+  spool->account = account;
+  spool->pending = g_queue_new();
+  spool->path = g_strdup_printf("%s/%s-%s", dir, purple_account_get_protocol_id(account),
+                                purple_escape_filename(purple_account_get_username(account)));
+  g_free(dir);
+
+  spool->fd = open(spool->path, O_RDWR | O_CREAT, 0600);
+  if (spool->fd < 0 || fstat(spool->fd, &st) != 0)
+    goto error;
+  fcntl(spool->fd, F_SETFD, FD_CLOEXEC);
+
+  if (st.st_size < SPOOL_HEADER) {
+    if (!spool_map(spool, SPOOL_MIN_SIZE))
+      goto error;
+    memcpy(spool->map, SPOOL_MAGIC, SPOOL_HEADER);
+  } else if (!spool_map(spool, MAX((gsize)st.st_size, SPOOL_MIN_SIZE))) {
+    goto error;
+  } else if (memcmp(spool->map, SPOOL_MAGIC, SPOOL_HEADER) != 0) {
+    errno = EINVAL;
+    goto error;
+  }
+
+  /* a record whose size never got written, or a torn one, is where the last run stopped */
+  offset = SPOOL_HEADER;
+  while (offset + sizeof(SpoolRecord) <= spool->map_size) {
+    SpoolRecord *record = RECORD(spool, offset);
+    if (!record_valid(spool, offset)) {
+      /* so that records appended here are not followed by stale ones */
+      if (record->size != 0) {
+        purple_debug_warning("purple_ruby", "spool: %s: bad record at %lu, dropping the rest\n",
+                             spool->path, (unsigned long)offset);
+        memset(record, 0, spool->map_size - offset);
+      }
+      break;
+    }
+    if (!record->done) {
+      g_queue_push_tail(spool->pending, GSIZE_TO_POINTER(offset));
+      spool->bytes += record->message_len;
+    }
+    offset += record->size;
+  }
+  spool->used = offset;
+
+  spool_expire(spool);
+  if (g_queue_is_empty(spool->pending))
+    spool_reset(spool);
+
+  return spool;
+
+error:
+  {
+    VALUE exc = rb_exc_new_str(rb_eRuntimeError, rb_sprintf("spool: %s: %s", spool->path, g_strerror(errno)));
+
+    if (spool->map != NULL)
+      munmap(spool->map, spool->map_size);
+    if (spool->fd >= 0)
+      close(spool->fd);
+    g_queue_free(spool->pending);
+    g_free(spool->path);
+    g_free(spool);
+    rb_exc_raise(exc);
+  }
+  return NULL;
+}
+
+static void spool_close(Spool *spool)
+{
+  if (spool->flush != 0)
+    purple_timeout_remove(spool->flush);
+  if (spool->map != NULL)
+    munmap(spool->map, spool->map_size);
+  close(spool->fd);
+  g_queue_free(spool->pending);
+  g_free(spool->path);
+
+  /* flush_cb frees it once the send it is in returns */
+  if (spool->flushing) {
+    spool->map = NULL;
+    spool->closed = TRUE;
+    return;
+  }
+  g_free(spool);
+}
+
+/* called by send_im and common_send when the account is not connected */
+gboolean spool_add(PurpleAccount *account, gboolean common, VALUE name, VALUE message)
+{
+  Spool *spool = spools ? g_hash_table_lookup(spools, account) : NULL;
+  SpoolRecord *record;
+  gsize size;
+
+  if (NULL == spool || NULL == spool->map)
+    return FALSE;
+
+  spool_expire(spool);
+
+  size = SPOOL_ALIGN(sizeof(SpoolRecord) + RSTRING_LEN(name) + RSTRING_LEN(message));
+  if (RSTRING_LEN(name) > G_MAXUINT16 || spool->used + size > spool_max_bytes) {
+    spool->dropped++;
+    return FALSE;
+  }
+
+  if (spool->used + size > spool->map_size &&
+      !spool_map(spool, MAX(spool->map_size * 2, SPOOL_ALIGN(spool->used + size)))) {
+    purple_debug_error("purple_ruby", "spool: %s: %s\n", spool->path, g_strerror(errno));
+    spool->dropped++;
+    return FALSE;
+  }
+
+  record = RECORD(spool, spool->used);
+  record->common = common ? 1 : 0;
+  record->done = 0;
+  record->name_len = RSTRING_LEN(name);
+  record->message_len = RSTRING_LEN(message);
+  record->expires = (gint64)time(NULL) + spool_ttl;
+  memcpy(record + 1, RSTRING_PTR(name), RSTRING_LEN(name));
+  memcpy((char *)(record + 1) + RSTRING_LEN(name), RSTRING_PTR(message), RSTRING_LEN(message));
+  /* orders the stores for a reader after a crash, it does not write anything to disk */
+  __sync_synchronize();
+  record->size = size;
+
+  spool->next_expiry = MIN(spool->next_expiry, record->expires);
+  g_queue_push_tail(spool->pending, GSIZE_TO_POINTER(spool->used));
+  spool->used += size;
+  spool->bytes += RSTRING_LEN(message);
+  spool->spooled++;
+  return TRUE;
+}
+
+static void spool_signed_on(PurpleConnection *gc, gpointer data)
+{
+  Spool *spool = g_hash_table_lookup(spools, purple_connection_get_account(gc));
+
+  if (spool != NULL)
+    spool_start_flush(spool);
+}
+
+static void *spool_get_handle(void)
+{
+  static int handle;
+
+  return &handle;
+}
+
+/* for the drain: records left, or only those a connected account is sending */
+gsize spool_pending(gboolean flushing)
+{
+  GHashTableIter iter;
+  Spool *spool;
+  gsize n = 0;
+
+  if (NULL == spools)
+    return 0;
+  g_hash_table_iter_init(&iter, spools);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&spool)) {
+    if (!flushing || (spool->flush != 0 && purple_account_is_connected(spool->account)))
+      n += g_queue_get_length(spool->pending);
+  }
+  return n;
+}
+
+/* after purple_core_init */
+void spool_register()
+{
+  if (NULL == spools)
+    spools = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  purple_signal_connect(purple_connections_get_handle(), "signed-on", spool_get_handle(),
+            PURPLE_CALLBACK(spool_signed_on), NULL);
+}
+
+/*
+ * Account#spool = true or false
+ *
+ * Keep messages sent while the account is disconnected and send them after
+ * it signs on. Messages still in the file from an earlier run are picked up.
+ */
+static VALUE set_spool(VALUE self, VALUE enabled)
+{
+  PurpleAccount *account = get_account_from_ruby_object(self);
+  Spool *spool;
+
+  if (NULL == spools)
+    rb_raise(rb_eRuntimeError, "spool: PurpleRuby.init has not been called");
+
+  spool = g_hash_table_lookup(spools, account);
+  if (RTEST(enabled) && NULL == spool) {
+    spool = spool_open(account);
+    g_hash_table_insert(spools, account, spool);
+    if (purple_account_is_connected(account))
+      spool_start_flush(spool);
+  } else if (!RTEST(enabled) && spool != NULL) {
+    g_hash_table_remove(spools, account);
+    spool_close(spool);
+  }
+
+  return enabled;
+}
+
+/*
+ * Account#spool? => true or false
+ */
+static VALUE get_spool(VALUE self)
+{
+  PurpleAccount *account = get_account_from_ruby_object(self);
+
+  return (spools && g_hash_table_lookup(spools, account)) ? Qtrue : Qfalse;
+}
+
+/*
+ * Account#spool_stats => Hash, nil when the spool is off
+ */
+static VALUE spool_stats(VALUE self)
+{
+  PurpleAccount *account = get_account_from_ruby_object(self);
+  Spool *spool = spools ? g_hash_table_lookup(spools, account) : NULL;
+  VALUE hash;
+
+  if (NULL == spool)
+    return Qnil;
+
+  spool_expire(spool);
+
+  hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(rb_intern("depth")), UINT2NUM(g_queue_get_length(spool->pending)));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), SIZET2NUM(spool->bytes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("file_bytes")), SIZET2NUM(spool->used));
+  rb_hash_aset(hash, ID2SYM(rb_intern("spooled")), ULONG2NUM(spool->spooled));
+  rb_hash_aset(hash, ID2SYM(rb_intern("flushed")), ULONG2NUM(spool->flushed));
+  rb_hash_aset(hash, ID2SYM(rb_intern("expired")), ULONG2NUM(spool->expired));
+  rb_hash_aset(hash, ID2SYM(rb_intern("dropped")), ULONG2NUM(spool->dropped));
+  rb_hash_aset(hash, ID2SYM(rb_intern("flushing")), spool->flush != 0 ? Qtrue : Qfalse);
+
+  return hash;
+}
+
+/*
+ * Account#spool_sync
+ *
+ * Write the spool file to disk, like PurpleRuby.journal_sync.
+ */
+static VALUE spool_sync(VALUE self)
+{
+  PurpleAccount *account = get_account_from_ruby_object(self);
+  Spool *spool = spools ? g_hash_table_lookup(spools, account) : NULL;
+
+  if (NULL == spool || NULL == spool->map)
+    rb_raise(rb_eRuntimeError, "spool: not enabled for this account");
+
+  if (msync(spool->map, spool->used, MS_SYNC) != 0)
+    rb_raise(rb_eRuntimeError, "spool: msync %s: %s", spool->path, g_strerror(errno));
+  return Qnil;
+}
+
+/*
+ * PurpleRuby.spool_ttl = seconds
+ *
+ * How long a spooled message may wait, applies to messages spooled from now on.
+ */
+static VALUE set_spool_ttl(VALUE self, VALUE seconds)
+{
+  spool_ttl = NUM2UINT(seconds);
+  return seconds;
+}
+
+static VALUE get_spool_ttl(VALUE self)
+{
+  return UINT2NUM(spool_ttl);
+}
+
+/*
+ * PurpleRuby.spool_rate = messages_per_second
+ *
+ * Per account, while flushing after signed-on.
+ */
+static VALUE set_spool_rate(VALUE self, VALUE rate)
+{
+  if (NUM2UINT(rate) == 0)
+    rb_raise(rb_eArgError, "spool_rate must be positive");
+  spool_rate = NUM2UINT(rate);
+  return rate;
+}
+
+static VALUE get_spool_rate(VALUE self)
+{
+  return UINT2NUM(spool_rate);
+}
+
+/*
+ * PurpleRuby.spool_max_bytes = bytes
+ *
+ * Size limit of each spool file, sends beyond it return nil.
+ */
+static VALUE set_spool_max_bytes(VALUE self, VALUE bytes)
+{
+  spool_max_bytes = NUM2SIZET(bytes);
+  return bytes;
+}
+
+void init_spool(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "spool_ttl=", set_spool_ttl, 1);
+  rb_define_singleton_method(cPurpleRuby, "spool_ttl", get_spool_ttl, 0);
+  rb_define_singleton_method(cPurpleRuby, "spool_rate=", set_spool_rate, 1);
+  rb_define_singleton_method(cPurpleRuby, "spool_rate", get_spool_rate, 0);
+  rb_define_singleton_method(cPurpleRuby, "spool_max_bytes=", set_spool_max_bytes, 1);
+  rb_define_method(cAccount, "spool=", set_spool, 1);
+  rb_define_method(cAccount, "spool?", get_spool, 0);
+  rb_define_method(cAccount, "spool_stats", spool_stats, 0);
+  rb_define_method(cAccount, "spool_sync", spool_sync, 0);
+}
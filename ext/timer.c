@@ -0,0 +1,646 @@
+/*
+ * Cancellable millisecond timers on a hierarchical timing wheel.
+ *
+ * All timers share one glib timeout, armed for the next slot that has
+ * something in it, so tens of thousands of them cost no more wakeups than a
+ * few. Insert and cancel are O(1). Blocks are kept in a hash registered with
+ * the GC until the timer fires or is cancelled.
+ *
+ * The wheel has a 1 ms tick. Level 0 has 256 slots, levels 1-3 have 64 slots
+ * each and are cascaded down when level 0 wraps, like the Linux kernel timer
+ * wheel. Timers further away than 2^26 ms (~18 hours) are parked in the last
+ * slot and re-inserted when it cascades.
+ *
+ * libpurple's timeout_add ui ops use the same wheel (see eventloop.c), so
+ * keepalives and retry timers of every connection share the one wakeup too.
+ * Their expiry is rounded up to a multiple of PurpleRuby.timer_slack, so
+ * timers landing in the same window fire together; timeout_add_seconds gets
+ * at least a second of slack, like g_timeout_add_seconds. 0 ms timeouts are
+ * plain glib sources and run on every loop iteration while they return TRUE.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <glib.h>
+
+#include <ruby.h>
+
+#include "probes.h"
+
+#define WHEEL0_BITS 8
+#define WHEELN_BITS 6
+#define WHEEL0_SIZE (1 << WHEEL0_BITS)
+#define WHEELN_SIZE (1 << WHEELN_BITS)
+#define WHEEL0_MASK (WHEEL0_SIZE - 1)
+#define WHEELN_MASK (WHEELN_SIZE - 1)
+#define LEVELS 3
+#define MAX_DELTA ((G_GUINT64_CONSTANT(1) << (WHEEL0_BITS + LEVELS * WHEELN_BITS)) - 1)
+
+extern VALUE call_handler(VALUE handler, const char *handler_name, const char *event, int argc, VALUE *argv);
+
+typedef struct _TimerEntry TimerEntry;
+
+/* slots are circular lists with a sentinel entry */
+struct _TimerEntry {
+  TimerEntry *next;
+  TimerEntry *prev;
+  guint id;
+  guint64 expires;   /* tick (ms) */
+  guint interval;    /* ms, 0 for one shot timers */
+  guint slack;       /* ms */
+  GSourceFunc function;  /* libpurple timeouts, NULL for ruby blocks */
+  gpointer data;
+  guint source;      /* glib source of a 0 ms libpurple timeout, which is not on the wheel */
+};
+
+static TimerEntry wheel0[WHEEL0_SIZE];
+static TimerEntry wheeln[LEVELS][WHEELN_SIZE];
+static gboolean wheel_ready = FALSE;
+static gint64 wheel_start = 0;
+/* the next tick to run */
+static guint64 wheel_tick = 0;
+
+static guint wheel_source = 0;
+static guint64 wheel_source_tick = 0;
+static gboolean running = FALSE;
+
+/* id -> TimerEntry */
+static GHashTable *timers = NULL;
+/* id -> Proc, keeps the blocks away from the GC */
+static VALUE timer_blocks = Qnil;
+static guint next_id = 1;
+
+static guint native_timers = 0;
+static guint immediate_timers = 0;
+static guint slack = 0;
+
+static unsigned long wakeups = 0;
+static guint64 wakeup_second = 0;
+static unsigned long second_wakeups = 0;
+static unsigned long last_second_wakeups = 0;
+
+static VALUE cTimer;
+
+static void list_init(TimerEntry *head)
+{
+  head->next = head->prev = head;
+}
+
+static gboolean list_empty(TimerEntry *head)
+{
+  return head->next == head;
+}
+
+static void list_add_tail(TimerEntry *head, TimerEntry *entry)
+{
+  entry->prev = head->prev;
+  entry->next = head;
+  head->prev->next = entry;
+  head->prev = entry;
+}
+
+static void list_del(TimerEntry *entry)
+{
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+  entry->next = entry->prev = NULL;
+}
+
+/* move everything in from to the empty list to */
+static void list_splice(TimerEntry *from, TimerEntry *to)
+{
+  list_init(to);
+  if (list_empty(from))
+    return;
+  to->next = from->next;
+  to->prev = from->prev;
+  to->next->prev = to;
+  to->prev->next = to;
+  list_init(from);
+}
+
+static guint64 now_tick()
+{
+  return (g_get_monotonic_time() - wheel_start) / 1000;
+}
+
+static void wheel_init()
+{
+  int i, level;
+
+  if (wheel_ready)
+    return;
+
+  for (i = 0; i < WHEEL0_SIZE; i++)
+    list_init(&wheel0[i]);
+  for (level = 0; level < LEVELS; level++)
+    for (i = 0; i < WHEELN_SIZE; i++)
+      list_init(&wheeln[level][i]);
+
+  timers = g_hash_table_new(g_direct_hash, g_direct_equal);
+  rb_global_variable(&timer_blocks);
+  timer_blocks = rb_hash_new();
+  wheel_start = g_get_monotonic_time();
+  wheel_ready = TRUE;
+}
+
+static void wheel_add(TimerEntry *entry)
+{
+  guint64 expires = MAX(entry->expires, wheel_tick);
+  guint64 delta = expires - wheel_tick;
+  TimerEntry *slot;
+  int level;
+
+  if (delta < WHEEL0_SIZE) {
+    slot = &wheel0[expires & WHEEL0_MASK];
+  } else {
+    if (delta > MAX_DELTA) {
+      expires = wheel_tick + MAX_DELTA;
+      delta = MAX_DELTA;
+    }
+    for (level = 0; level < LEVELS - 1; level++) {
+      if (delta < (G_GUINT64_CONSTANT(1) << (WHEEL0_BITS + (level + 1) * WHEELN_BITS)))
+        break;
+    }
+    slot = &wheeln[level][(expires >> (WHEEL0_BITS + level * WHEELN_BITS)) & WHEELN_MASK];
+  }
+
+  list_add_tail(slot, entry);
+}
+
+static void cascade(TimerEntry *slot)
+{
+  TimerEntry pending;
+
+  list_splice(slot, &pending);
+  while (!list_empty(&pending)) {
+    TimerEntry *entry = pending.next;
+    list_del(entry);
+    wheel_add(entry);
+  }
+}
+
+/*
+ * The tick of the earliest timer on the wheel. Each level only needs its
+ * first non-empty slot after the current one: the slots of a level cover
+ * consecutive ranges of ticks. An entry parked beyond MAX_DELTA is due at
+ * the cascade of its slot, where it is parked again.
+ */
+static guint64 next_expiry()
+{
+  guint64 next = G_MAXUINT64, tick;
+  int level, k;
+
+  if (g_hash_table_size(timers) == immediate_timers)
+    return G_MAXUINT64;
+
+  /* level 0 wraps, the higher levels cascade on this tick */
+  if (0 == (wheel_tick & WHEEL0_MASK))
+    return wheel_tick;
+
+  /* level 0 holds the 256 ticks from wheel_tick on */
+  for (tick = wheel_tick; tick < wheel_tick + WHEEL0_SIZE; tick++) {
+    if (!list_empty(&wheel0[tick & WHEEL0_MASK])) {
+      next = tick;
+      break;
+    }
+  }
+
+  /* the current slot of a level was cascaded already, it can only hold a full turn ahead */
+  for (level = 0; level < LEVELS; level++) {
+    int shift = WHEEL0_BITS + level * WHEELN_BITS;
+    guint64 block = wheel_tick >> shift;
+
+    for (k = 1; k <= WHEELN_SIZE; k++) {
+      TimerEntry *slot = &wheeln[level][(block + k) & WHEELN_MASK], *entry;
+      guint64 start = (block + k) << shift, end = start + (G_GUINT64_CONSTANT(1) << shift);
+
+      if (start >= next)
+        break;
+      if (list_empty(slot))
+        continue;
+      for (entry = slot->next; entry != slot; entry = entry->next)
+        next = MIN(next, entry->expires < end ? MAX(entry->expires, start) : start);
+      break;
+    }
+  }
+
+  return next;
+}
+
+static gboolean wheel_fire(gpointer data);
+
+static void wheel_schedule()
+{
+  guint64 next, now;
+
+  if (running)
+    return;
+
+  next = next_expiry();
+  if (wheel_source != 0) {
+    if (next == wheel_source_tick)
+      return;
+    g_source_remove(wheel_source);
+    wheel_source = 0;
+  }
+
+  if (G_MAXUINT64 == next)
+    return;
+
+  now = now_tick();
+  wheel_source_tick = next;
+  wheel_source = g_timeout_add_full(G_PRIORITY_DEFAULT, next > now ? next - now : 0, wheel_fire, NULL, NULL);
+}
+
+static void timer_free(TimerEntry *entry)
+{
+  g_hash_table_remove(timers, GUINT_TO_POINTER(entry->id));
+  if (entry->source != 0)
+    immediate_timers--;
+  if (entry->function != NULL)
+    native_timers--;
+  else
+    rb_hash_delete(timer_blocks, UINT2NUM(entry->id));
+  g_free(entry);
+}
+
+static guint64 slack_round(guint64 tick, guint window)
+{
+  return window > 1 ? (tick + window - 1) / window * window : tick;
+}
+
+static VALUE fire_block(VALUE block)
+{
+  return call_handler(block, "timer", "timer", 0, NULL);
+}
+
+typedef struct {
+  GSourceFunc function;
+  gpointer data;
+} NativeCall;
+
+static VALUE fire_native(VALUE arg)
+{
+  NativeCall *call = (NativeCall *)arg;
+  return call->function(call->data) ? Qtrue : Qfalse;
+}
+
+/* runs the timers up to target, returns the first exception raised by a block */
+static VALUE run_timers(guint64 target)
+{
+  VALUE error = Qnil;
+  int level, state;
+  TimerEntry due;
+
+  while (wheel_tick <= target) {
+    guint index = wheel_tick & WHEEL0_MASK;
+
+    if (0 == index) {
+      for (level = 0; level < LEVELS; level++) {
+        guint i = (wheel_tick >> (WHEEL0_BITS + level * WHEELN_BITS)) & WHEELN_MASK;
+        cascade(&wheeln[level][i]);
+        if (i != 0)
+          break;
+      }
+    }
+
+    list_splice(&wheel0[index], &due);
+    wheel_tick++;
+
+    /* a block may cancel timers that are still in due */
+    while (!list_empty(&due)) {
+      TimerEntry *entry = due.next;
+      VALUE block;
+
+      list_del(entry);
+
+      if (entry->expires >= wheel_tick) {
+        /* parked beyond MAX_DELTA, not due yet */
+        wheel_add(entry);
+        continue;
+      }
+
+      if (entry->function != NULL) {
+        /* like a glib timeout: runs again from now while it returns TRUE */
+        guint id = entry->id;
+        NativeCall call = { entry->function, entry->data };
+
+        entry->expires = slack_round(target + MAX(entry->interval, 1), entry->slack);
+        wheel_add(entry);
+
+        PROBE1(timer__fire, "native");
+        if (!RTEST(rb_protect(fire_native, (VALUE)&call, &state)) &&
+            (entry = g_hash_table_lookup(timers, GUINT_TO_POINTER(id))) != NULL) {
+          list_del(entry);
+          timer_free(entry);
+        }
+        if (state && NIL_P(error)) {
+          error = rb_errinfo();
+          rb_set_errinfo(Qnil);
+        }
+        continue;
+      }
+
+      block = rb_hash_aref(timer_blocks, UINT2NUM(entry->id));
+
+      if (entry->interval > 0) {
+        entry->expires += entry->interval;
+        if (entry->expires < wheel_tick)
+          entry->expires = target + entry->interval;
+        wheel_add(entry);
+      } else {
+        timer_free(entry);
+      }
+
+      PROBE1(timer__fire, "timer");
+      rb_protect(fire_block, block, &state);
+      RB_GC_GUARD(block);
+      if (state && NIL_P(error)) {
+        error = rb_errinfo();
+        rb_set_errinfo(Qnil);
+      }
+    }
+  }
+
+  return error;
+}
+
+static gboolean wheel_fire(gpointer data)
+{
+  VALUE error;
+  guint64 second = now_tick() / 1000;
+
+  wakeups++;
+  if (second != wakeup_second) {
+    last_second_wakeups = (second == wakeup_second + 1) ? second_wakeups : 0;
+    wakeup_second = second;
+    second_wakeups = 0;
+  }
+  second_wakeups++;
+
+  wheel_source = 0;
+  running = TRUE;
+  error = run_timers(now_tick());
+  running = FALSE;
+  wheel_schedule();
+
+  if (!NIL_P(error))
+    rb_exc_raise(error);
+
+  return FALSE;
+}
+
+static TimerEntry* entry_add(guint64 ms, guint interval, guint window)
+{
+  TimerEntry *entry;
+
+  wheel_init();
+
+  /* nothing on the wheel, don't replay the ticks we slept through */
+  if (g_hash_table_size(timers) == immediate_timers)
+    wheel_tick = now_tick();
+
+  entry = g_new0(TimerEntry, 1);
+  do {
+    entry->id = next_id++;
+  } while (0 == entry->id || g_hash_table_lookup(timers, GUINT_TO_POINTER(entry->id)) != NULL);
+  entry->expires = slack_round(MAX(now_tick(), wheel_tick) + ms, window);
+  entry->interval = interval;
+  entry->slack = window;
+
+  g_hash_table_insert(timers, GUINT_TO_POINTER(entry->id), entry);
+  return entry;
+}
+
+static void entry_schedule(TimerEntry *entry)
+{
+  wheel_add(entry);
+
+  if (0 == wheel_source || entry->expires < wheel_source_tick)
+    wheel_schedule();
+}
+
+/* schedule block to run after ms, then every interval ms if interval is not 0 */
+VALUE timer_add(guint64 ms, guint interval, VALUE block)
+{
+  TimerEntry *entry = entry_add(ms, interval, 0);
+  VALUE handle;
+
+  rb_hash_aset(timer_blocks, UINT2NUM(entry->id), block);
+  entry_schedule(entry);
+
+  handle = rb_obj_alloc(cTimer);
+  rb_iv_set(handle, "@id", UINT2NUM(entry->id));
+  return handle;
+}
+
+/* a 0 ms timeout runs again on the next loop iteration while it returns TRUE, as in glib */
+static gboolean immediate_fire(gpointer id)
+{
+  TimerEntry *entry = g_hash_table_lookup(timers, id);
+
+  if (NULL == entry)
+    return FALSE;
+
+  PROBE1(timer__fire, "native");
+  if (entry->function(entry->data))
+    return TRUE;
+
+  /* unless it removed itself */
+  if ((entry = g_hash_table_lookup(timers, id)) != NULL)
+    timer_free(entry);
+  return FALSE;
+}
+
+static guint immediate_add(GSourceFunc function, gpointer data)
+{
+  TimerEntry *entry = entry_add(0, 0, 0);
+
+  entry->function = function;
+  entry->data = data;
+  entry->source = g_timeout_add(0, immediate_fire, GUINT_TO_POINTER(entry->id));
+  native_timers++;
+  immediate_timers++;
+
+  return entry->id;
+}
+
+static guint native_add(guint64 ms, guint window, GSourceFunc function, gpointer data)
+{
+  TimerEntry *entry = entry_add(ms, (guint)ms, window);
+
+  entry->function = function;
+  entry->data = data;
+  native_timers++;
+  entry_schedule(entry);
+
+  return entry->id;
+}
+
+/* timeout_add ui op */
+guint timer_timeout_add(guint interval, GSourceFunc function, gpointer data)
+{
+  /* 0 ms timeouts are "as soon as possible", they stay off the wheel and its 1 ms tick */
+  if (0 == interval)
+    return immediate_add(function, data);
+  return native_add(interval, slack, function, data);
+}
+
+/* timeout_add_seconds ui op */
+guint timer_timeout_add_seconds(guint interval, GSourceFunc function, gpointer data)
+{
+  return native_add((guint64)interval * 1000, MAX(slack, 1000), function, data);
+}
+
+/* timeout_remove ui op */
+gboolean timer_timeout_remove(guint id)
+{
+  TimerEntry *entry = timers ? g_hash_table_lookup(timers, GUINT_TO_POINTER(id)) : NULL;
+
+  if (NULL == entry || NULL == entry->function)
+    return FALSE;
+
+  if (entry->source != 0)
+    g_source_remove(entry->source);
+  else
+    list_del(entry);
+  timer_free(entry);
+  return TRUE;
+}
+
+/*
+ * PurpleRuby.timer(ms) { } => PurpleRuby::Timer
+ */
+static VALUE timer(VALUE self, VALUE ms)
+{
+  gint64 delay = NUM2LL(ms);
+
+  if (!rb_block_given_p()) {
+    rb_raise(rb_eArgError, "timer: no block given");
+  }
+  if (delay < 0) {
+    rb_raise(rb_eArgError, "timer: delay should not be negative");
+  }
+  return timer_add(delay, 0, rb_block_proc());
+}
+
+/*
+ * PurpleRuby.periodic_timer(ms) { } => PurpleRuby::Timer
+ */
+static VALUE periodic_timer(VALUE self, VALUE ms)
+{
+  guint interval = NUM2UINT(ms);
+
+  if (!rb_block_given_p()) {
+    rb_raise(rb_eArgError, "periodic_timer: no block given");
+  }
+  if (0 == interval) {
+    rb_raise(rb_eArgError, "periodic_timer: interval should be positive");
+  }
+  return timer_add(interval, interval, rb_block_proc());
+}
+
+static TimerEntry* timer_lookup(VALUE self)
+{
+  guint id = NUM2UINT(rb_iv_get(self, "@id"));
+  TimerEntry *entry = timers ? g_hash_table_lookup(timers, GUINT_TO_POINTER(id)) : NULL;
+  return (entry != NULL && NULL == entry->function) ? entry : NULL;
+}
+
+/*
+ * Timer#cancel => true if the timer was still pending
+ */
+static VALUE timer_cancel(VALUE self)
+{
+  TimerEntry *entry = timer_lookup(self);
+
+  if (NULL == entry)
+    return Qfalse;
+
+  list_del(entry);
+  timer_free(entry);
+  return Qtrue;
+}
+
+static VALUE timer_is_pending(VALUE self)
+{
+  return timer_lookup(self) != NULL ? Qtrue : Qfalse;
+}
+
+/*
+ * PurpleRuby::Timer.count => number of pending timers
+ */
+static VALUE timer_count(VALUE self)
+{
+  return UINT2NUM(timers ? g_hash_table_size(timers) - native_timers : 0);
+}
+
+/*
+ * PurpleRuby.timer_slack = ms
+ *
+ * Let libpurple timeouts fire up to ms late, so the ones landing within the
+ * same window share a wakeup. Applies to timeouts added from now on.
+ */
+static VALUE set_timer_slack(VALUE self, VALUE ms)
+{
+  slack = NUM2UINT(ms);
+  return ms;
+}
+
+static VALUE get_timer_slack(VALUE self)
+{
+  return UINT2NUM(slack);
+}
+
+/*
+ * PurpleRuby.timer_stats => Hash
+ *
+ * :wakeups_per_second is for the last full second.
+ */
+static VALUE timer_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+  guint total = timers ? g_hash_table_size(timers) : 0;
+  guint64 second = now_tick() / 1000;
+  unsigned long per_second = 0;
+
+  if (second == wakeup_second)
+    per_second = last_second_wakeups;
+  else if (second == wakeup_second + 1)
+    per_second = second_wakeups;
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("timers")), UINT2NUM(total - native_timers));
+  rb_hash_aset(hash, ID2SYM(rb_intern("libpurple_timers")), UINT2NUM(native_timers));
+  rb_hash_aset(hash, ID2SYM(rb_intern("slack")), UINT2NUM(slack));
+  rb_hash_aset(hash, ID2SYM(rb_intern("wakeups")), ULONG2NUM(wakeups));
+  rb_hash_aset(hash, ID2SYM(rb_intern("wakeups_per_second")), ULONG2NUM(per_second));
+
+  return hash;
+}
+
+void init_timer(VALUE cPurpleRuby)
+{
+  cTimer = rb_define_class_under(cPurpleRuby, "Timer", rb_cObject);
+  rb_define_method(cTimer, "cancel", timer_cancel, 0);
+  rb_define_method(cTimer, "pending?", timer_is_pending, 0);
+  rb_define_singleton_method(cTimer, "count", timer_count, 0);
+
+  rb_define_singleton_method(cPurpleRuby, "timer", timer, 1);
+  rb_define_singleton_method(cPurpleRuby, "periodic_timer", periodic_timer, 1);
+  rb_define_singleton_method(cPurpleRuby, "timer_slack=", set_timer_slack, 1);
+  rb_define_singleton_method(cPurpleRuby, "timer_slack", get_timer_slack, 0);
+  rb_define_singleton_method(cPurpleRuby, "timer_stats", timer_stats, 0);
+}
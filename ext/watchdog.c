@@ -0,0 +1,275 @@
+/*
+ * Main loop lag monitor and slow handler watchdog.
+ *
+ * Every ruby callback dispatched by the extension goes through call_handler(),
+ * which times it. A high priority glib timeout measures how late the main loop
+ * fires it compared to when it was scheduled. When either exceeds the
+ * configured threshold, the slow_handler hook is called (or a warning is
+ * printed if there is no hook).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <glib.h>
+
+#include <ruby.h>
+#include <stdlib.h>
+
+#include "probes.h"
+
+#define LAG_SAMPLES 1024
+#define DEFAULT_LAG_INTERVAL 100
+
+extern ID CALL;
+extern void check_callback(VALUE, const char*);
+extern void set_callback(VALUE*, const char*);
+extern void recorder_handler_call(const char *handler_name, const char *event, int argc, VALUE *argv);
+
+static VALUE slow_handler = Qnil;
+
+/* thresholds are in microseconds, 0 means the watchdog is off */
+static gint64 threshold = 0;
+static guint lag_interval = DEFAULT_LAG_INTERVAL;
+static guint lag_timeout = 0;
+static gint64 lag_last_fire = 0;
+
+static gint64 lag_samples[LAG_SAMPLES];
+static guint lag_count = 0;
+static gint64 lag_max = 0;
+
+static unsigned long handler_calls = 0;
+static unsigned long slow_handler_calls = 0;
+static gint64 handler_max = 0;
+static const char *handler_max_name = NULL;
+static int in_slow_handler = 0;
+
+typedef struct {
+  VALUE handler;
+  const char *handler_name;
+  const char *event;
+  int argc;
+  VALUE *argv;
+  gint64 start;
+} HandlerCall;
+
+static VALUE slow_handler_body(VALUE args)
+{
+  return rb_funcall2(slow_handler, CALL, 3, (VALUE *)args);
+}
+
+/* a raising hook must not leave the watchdog muted */
+static VALUE slow_handler_ensure(VALUE data)
+{
+  in_slow_handler = 0;
+  return Qnil;
+}
+
+static void report_slow(const char *handler_name, const char *event, gint64 elapsed)
+{
+  double ms = elapsed / 1000.0;
+
+  if (Qnil == slow_handler) {
+    rb_warn("purple_ruby: %s (%s) took %.1f ms", handler_name, event, ms);
+    return;
+  }
+
+  /* the hook is not timed, and must not re-enter itself */
+  if (in_slow_handler)
+    return;
+
+  VALUE args[3];
+  args[0] = rb_str_new2(handler_name);
+  args[1] = rb_str_new2(event);
+  args[2] = rb_float_new(ms);
+  check_callback(slow_handler, "slow_handler");
+  in_slow_handler = 1;
+  rb_ensure(slow_handler_body, (VALUE)args, slow_handler_ensure, Qnil);
+}
+
+static VALUE handler_call_body(VALUE data)
+{
+  HandlerCall *call = (HandlerCall *)data;
+  PROBE3(handler__entry, call->handler_name, call->event, call->argc);
+  return rb_funcall2(call->handler, CALL, call->argc, call->argv);
+}
+
+static VALUE handler_call_ensure(VALUE data)
+{
+  HandlerCall *call = (HandlerCall *)data;
+  gint64 elapsed = g_get_monotonic_time() - call->start;
+
+  PROBE2(handler__return, call->handler_name, call->event);
+
+  /* only here for the probes */
+  if (0 == threshold)
+    return Qnil;
+
+  if (elapsed > handler_max) {
+    handler_max = elapsed;
+    handler_max_name = call->handler_name;
+  }
+
+  if (elapsed >= threshold) {
+    slow_handler_calls++;
+    report_slow(call->handler_name, call->event, elapsed);
+  }
+
+  return Qnil;
+}
+
+/*
+ * Call a ruby handler. handler_name is the name used by set_callback,
+ * event is the libpurple event that triggered the call.
+ */
+VALUE call_handler(VALUE handler, const char *handler_name, const char *event, int argc, VALUE *argv)
+{
+  HandlerCall call;
+
+  check_callback(handler, handler_name);
+  recorder_handler_call(handler_name, event, argc, argv);
+  handler_calls++;
+
+  /* handler__return fires from the ensure, also when the handler raises */
+  if (0 == threshold && !PROBE_ENABLED(handler__entry) && !PROBE_ENABLED(handler__return))
+    return rb_funcall2(handler, CALL, argc, argv);
+
+  call.handler = handler;
+  call.handler_name = handler_name;
+  call.event = event;
+  call.argc = argc;
+  call.argv = argv;
+  call.start = g_get_monotonic_time();
+  return rb_ensure(handler_call_body, (VALUE)&call, handler_call_ensure, (VALUE)&call);
+}
+
+static gboolean lag_tick(gpointer data)
+{
+  gint64 now = g_get_monotonic_time();
+  gint64 lag = now - lag_last_fire - (gint64)lag_interval * 1000;
+
+  if (lag < 0)
+    lag = 0;
+
+  lag_samples[lag_count % LAG_SAMPLES] = lag;
+  lag_count++;
+  if (lag > lag_max)
+    lag_max = lag;
+
+  /* glib schedules the next fire relative to this dispatch */
+  lag_last_fire = now;
+
+  if (lag >= threshold) {
+    report_slow("main_loop", "lag", lag);
+  }
+
+  return TRUE;
+}
+
+static int compare_gint64(const void *a, const void *b)
+{
+  gint64 x = *(const gint64 *)a;
+  gint64 y = *(const gint64 *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(gint64 *sorted, guint n, int pct)
+{
+  if (0 == n)
+    return 0.0;
+  return sorted[(n - 1) * pct / 100] / 1000.0;
+}
+
+/*
+ * PurpleRuby.watchdog(threshold_ms, interval_ms = 100)
+ *
+ * Warn (or call the watch_slow_handler hook) when a ruby handler runs longer
+ * than threshold_ms, or when the main loop is late by more than threshold_ms.
+ * interval_ms is how often the lag is sampled. A threshold of 0 turns it off.
+ */
+static VALUE watchdog(int argc, VALUE* argv, VALUE self)
+{
+  VALUE ms, interval;
+  gint64 value;
+  guint interval_value;
+
+  rb_scan_args(argc, argv, "11", &ms, &interval);
+
+  /* validate everything before touching the running watchdog */
+  value = (gint64)NUM2LONG(ms) * 1000;
+  if (value < 0) {
+    rb_raise(rb_eArgError, "watchdog: threshold should not be negative");
+  }
+  interval_value = NIL_P(interval) ? DEFAULT_LAG_INTERVAL : NUM2UINT(interval);
+  if (0 == interval_value) {
+    rb_raise(rb_eArgError, "watchdog: interval should be positive");
+  }
+
+  threshold = value;
+  if (lag_timeout != 0) {
+    g_source_remove(lag_timeout);
+    lag_timeout = 0;
+  }
+
+  if (0 == threshold)
+    return Qnil;
+
+  lag_interval = interval_value;
+  lag_last_fire = g_get_monotonic_time();
+  lag_timeout = g_timeout_add_full(G_PRIORITY_HIGH, lag_interval, lag_tick, NULL, NULL);
+
+  return ms;
+}
+
+static VALUE watch_slow_handler(VALUE self)
+{
+  set_callback(&slow_handler, "slow_handler");
+  return slow_handler;
+}
+
+#define STAT(hash, name, value) rb_hash_aset(hash, ID2SYM(rb_intern(name)), value)
+
+/*
+ * PurpleRuby.loop_stats => Hash
+ *
+ * Lag percentiles (in ms) over the last 1024 samples, and handler timing counters.
+ */
+static VALUE loop_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+  guint n = MIN(lag_count, LAG_SAMPLES);
+  gint64 *sorted = g_memdup(lag_samples, n * sizeof(gint64));
+
+  qsort(sorted, n, sizeof(gint64), compare_gint64);
+
+  STAT(hash, "lag_samples", ULONG2NUM(lag_count));
+  STAT(hash, "lag_p50", rb_float_new(percentile(sorted, n, 50)));
+  STAT(hash, "lag_p90", rb_float_new(percentile(sorted, n, 90)));
+  STAT(hash, "lag_p99", rb_float_new(percentile(sorted, n, 99)));
+  STAT(hash, "lag_max", rb_float_new(lag_max / 1000.0));
+  STAT(hash, "handler_calls", ULONG2NUM(handler_calls));
+  STAT(hash, "slow_handler_calls", ULONG2NUM(slow_handler_calls));
+  STAT(hash, "handler_max", rb_float_new(handler_max / 1000.0));
+  STAT(hash, "handler_max_name", NULL == handler_max_name ? Qnil : rb_str_new2(handler_max_name));
+
+  g_free(sorted);
+  return hash;
+}
+
+void init_watchdog(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "watchdog", watchdog, -1);
+  rb_define_singleton_method(cPurpleRuby, "watch_slow_handler", watch_slow_handler, 0);
+  rb_define_singleton_method(cPurpleRuby, "loop_stats", loop_stats, 0);
+}
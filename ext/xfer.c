@@ -0,0 +1,478 @@
+/*
+ * File transfers (PurpleXferUiOps).
+ *
+ * Ruby decides whether to accept an incoming file and where to put it, and
+ * gets progress and completion events; the data never goes through Ruby.
+ * With the ui_read/ui_write ops set libpurple does not open the file itself
+ * and waits for purple_xfer_ui_ready before moving each chunk, so chunks are
+ * written to / read from a raw fd here, and the next one is asked for when
+ * the transfer holds a slot (PurpleRuby.max_file_transfers) and the
+ * bandwidth cap (PurpleRuby.file_transfer_rate) allows it.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <libpurple/account.h>
+#include <libpurple/connection.h>
+#include <libpurple/debug.h>
+#include <libpurple/eventloop.h>
+#include <libpurple/ft.h>
+#include <libpurple/server.h>
+#include <libpurple/signals.h>
+
+#include <ruby.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PROGRESS_INTERVAL G_USEC_PER_SEC
+
+extern VALUE cAccount;
+extern PurpleAccount* get_account_from_ruby_object(VALUE acc);
+extern void set_callback(VALUE* handler, const char* handler_name);
+extern VALUE call_handler(VALUE handler, const char *handler_name, const char *event, int argc, VALUE *argv);
+
+typedef struct {
+  int fd;
+  goffset offset;       /* next byte to read, sending */
+  gboolean active;      /* holds a max_file_transfers slot */
+  gboolean finished;
+  guint resume;         /* timeout that calls purple_xfer_ui_ready */
+  gint64 last_progress;
+} XferData;
+
+static VALUE incoming_file_handler = Qnil;
+static VALUE file_transfer_handler = Qnil;
+
+/* accepted transfers waiting for a slot */
+static GQueue *waiting = NULL;
+static guint active = 0;
+static guint max_active = 0;    /* 0 is no limit */
+
+/* token bucket for the bandwidth cap */
+static guint64 rate = 0;        /* bytes/s, 0 is no limit */
+static gint64 tokens = 0;
+static gint64 tokens_time = 0;
+
+static guint64 bytes_received = 0;
+static guint64 bytes_sent = 0;
+static unsigned long completed = 0;
+static unsigned long cancelled = 0;
+static unsigned long rejected = 0;
+
+static void emit(PurpleXfer *xfer, const char *event)
+{
+  VALUE args[6];
+
+  if (NIL_P(file_transfer_handler))
+    return;
+
+  args[0] = Data_Wrap_Struct(cAccount, NULL, NULL, purple_xfer_get_account(xfer));
+  args[1] = rb_str_new2(purple_xfer_get_remote_user(xfer));
+  args[2] = rb_str_new2(purple_xfer_get_filename(xfer) ? purple_xfer_get_filename(xfer) : "");
+  args[3] = ID2SYM(rb_intern(event));
+  args[4] = ULL2NUM(purple_xfer_get_bytes_sent(xfer));
+  args[5] = ULL2NUM(purple_xfer_get_size(xfer));
+  call_handler(file_transfer_handler, "file_transfer_handler", event, 6, args);
+}
+
+static gboolean resume_cb(gpointer user_data)
+{
+  PurpleXfer *xfer = user_data;
+  XferData *data = xfer->ui_data;
+
+  data->resume = 0;
+  purple_xfer_ui_ready(xfer);
+  return FALSE;
+}
+
+/* ask libpurple for the next chunk after delay ms */
+static void schedule(PurpleXfer *xfer, guint delay)
+{
+  XferData *data = xfer->ui_data;
+
+  if (data->resume != 0 || data->finished)
+    return;
+  /* not from inside ui_read/ui_write, libpurple is in the middle of a chunk */
+  data->resume = purple_timeout_add(delay, resume_cb, xfer);
+}
+
+/* ms until n more bytes fit under the bandwidth cap */
+static guint take_tokens(gsize n)
+{
+  gint64 now = g_get_monotonic_time();
+
+  if (0 == rate)
+    return 0;
+
+  tokens = MIN((gint64)rate, tokens + (now - tokens_time) * (gint64)rate / G_USEC_PER_SEC);
+  tokens_time = now;
+  tokens -= n;
+
+  return tokens >= 0 ? 0 : (guint)(-tokens * 1000 / (gint64)rate);
+}
+
+static void start_waiting()
+{
+  while ((0 == max_active || active < max_active) && !g_queue_is_empty(waiting)) {
+    PurpleXfer *xfer = g_queue_pop_head(waiting);
+    XferData *data = xfer->ui_data;
+
+    data->active = TRUE;
+    active++;
+    schedule(xfer, 0);
+  }
+}
+
+/* done or cancelled: close the file and give up the slot */
+static void release(PurpleXfer *xfer)
+{
+  XferData *data = xfer->ui_data;
+
+  if (NULL == data)
+    return;
+
+  data->finished = TRUE;
+  if (data->resume != 0) {
+    purple_timeout_remove(data->resume);
+    data->resume = 0;
+  }
+  if (data->fd >= 0) {
+    close(data->fd);
+    data->fd = -1;
+  }
+
+  g_queue_remove(waiting, xfer);
+  if (data->active) {
+    data->active = FALSE;
+    active--;
+    start_waiting();
+  }
+}
+
+static gboolean open_file(PurpleXfer *xfer)
+{
+  XferData *data = xfer->ui_data;
+  const char *filename = purple_xfer_get_local_filename(xfer);
+
+  if (data->fd >= 0)
+    return TRUE;
+
+  if (PURPLE_XFER_RECEIVE == purple_xfer_get_type(xfer)) {
+    data->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  } else {
+    data->fd = open(filename, O_RDONLY);
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (data->fd >= 0)
+      posix_fadvise(data->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+
+  if (data->fd < 0) {
+    purple_debug_error("purple_ruby", "file transfer: %s: %s\n", filename, g_strerror(errno));
+    return FALSE;
+  }
+
+  fcntl(data->fd, F_SETFD, FD_CLOEXEC);
+  return TRUE;
+}
+
+static void xfer_new(PurpleXfer *xfer)
+{
+  XferData *data = g_new0(XferData, 1);
+
+  data->fd = -1;
+  xfer->ui_data = data;
+}
+
+static void xfer_destroy(PurpleXfer *xfer)
+{
+  release(xfer);
+  g_free(xfer->ui_data);
+  xfer->ui_data = NULL;
+}
+
+/* accepted, it runs once it gets a slot */
+static void xfer_add(PurpleXfer *xfer)
+{
+  g_queue_push_tail(waiting, xfer);
+  start_waiting();
+}
+
+static void xfer_update_progress(PurpleXfer *xfer, double percent)
+{
+  XferData *data = xfer->ui_data;
+  gint64 now = g_get_monotonic_time();
+
+  if (now - data->last_progress < PROGRESS_INTERVAL || purple_xfer_is_completed(xfer))
+    return;
+
+  data->last_progress = now;
+  emit(xfer, "progress");
+}
+
+static void xfer_cancel(PurpleXfer *xfer)
+{
+  XferData *data = xfer->ui_data;
+
+  if (data->finished)
+    return;
+
+  release(xfer);
+  cancelled++;
+  emit(xfer, "cancelled");
+}
+
+static gssize xfer_ui_write(PurpleXfer *xfer, const guchar *buffer, gssize size)
+{
+  gssize done = 0;
+
+  if (!open_file(xfer))
+    return -1;
+
+  while (done < size) {
+    gssize n = write(((XferData *)xfer->ui_data)->fd, buffer + done, size - done);
+    if (n < 0 && EINTR == errno)
+      continue;
+    if (n < 0) {
+      purple_debug_error("purple_ruby", "file transfer: %s: %s\n",
+                         purple_xfer_get_local_filename(xfer), g_strerror(errno));
+      return -1;
+    }
+    done += n;
+  }
+
+  bytes_received += size;
+  schedule(xfer, take_tokens(size));
+  return size;
+}
+
+static gssize xfer_ui_read(PurpleXfer *xfer, guchar **buffer, gssize size)
+{
+  XferData *data = xfer->ui_data;
+  gssize n;
+
+  *buffer = NULL;
+  if (!open_file(xfer))
+    return -1;
+
+  *buffer = g_malloc(size);
+  do {
+    n = pread(data->fd, *buffer, size, data->offset);
+  } while (n < 0 && EINTR == errno);
+
+  if (n <= 0) {
+    /* 0 would mean "not ready", but the file is shorter than it was */
+    purple_debug_error("purple_ruby", "file transfer: %s: %s\n", purple_xfer_get_local_filename(xfer),
+                       n < 0 ? g_strerror(errno) : "unexpected end of file");
+    g_free(*buffer);
+    *buffer = NULL;
+    return -1;
+  }
+
+  data->offset += n;
+  bytes_sent += n;
+  schedule(xfer, take_tokens(n));
+  return n;
+}
+
+/* the prpl took only part of the chunk, read the rest again next time */
+static void xfer_data_not_sent(PurpleXfer *xfer, const guchar *buffer, gsize size)
+{
+  XferData *data = xfer->ui_data;
+
+  data->offset -= size;
+  bytes_sent -= size;
+}
+
+static PurpleXferUiOps xfer_ui_ops =
+{
+  xfer_new,
+  xfer_destroy,
+  xfer_add,
+  xfer_update_progress,
+  xfer_cancel,    /* cancel_local */
+  xfer_cancel,    /* cancel_remote */
+  xfer_ui_write,
+  xfer_ui_read,
+  xfer_data_not_sent,
+
+  /* padding */
+  NULL
+};
+
+static void file_recv_request_cb(PurpleXfer *xfer, gpointer user_data)
+{
+  VALUE args[4], path;
+
+  if (NIL_P(incoming_file_handler)) {
+    rejected++;
+    xfer->status = PURPLE_XFER_STATUS_CANCEL_LOCAL;
+    return;
+  }
+
+  args[0] = Data_Wrap_Struct(cAccount, NULL, NULL, purple_xfer_get_account(xfer));
+  args[1] = rb_str_new2(purple_xfer_get_remote_user(xfer));
+  args[2] = rb_str_new2(purple_xfer_get_filename(xfer) ? purple_xfer_get_filename(xfer) : "");
+  args[3] = ULL2NUM(purple_xfer_get_size(xfer));
+  path = call_handler(incoming_file_handler, "incoming_file_handler", "file-recv-request", 4, args);
+
+  if (RTEST(path)) {
+    purple_xfer_request_accepted(xfer, StringValueCStr(path));
+  } else {
+    rejected++;
+    xfer->status = PURPLE_XFER_STATUS_CANCEL_LOCAL;
+  }
+}
+
+static void file_start_cb(PurpleXfer *xfer, gpointer user_data)
+{
+  emit(xfer, "started");
+}
+
+static void file_complete_cb(PurpleXfer *xfer, gpointer user_data)
+{
+  release(xfer);
+  completed++;
+  emit(xfer, "done");
+}
+
+static void *xfer_get_handle(void)
+{
+  static int handle;
+
+  return &handle;
+}
+
+/* after purple_core_init */
+void xfer_register()
+{
+  void *xfers = purple_xfers_get_handle();
+
+  if (NULL == waiting)
+    waiting = g_queue_new();
+
+  purple_xfers_set_ui_ops(&xfer_ui_ops);
+
+  purple_signal_connect(xfers, "file-recv-request", xfer_get_handle(),
+            PURPLE_CALLBACK(file_recv_request_cb), NULL);
+  purple_signal_connect(xfers, "file-recv-start", xfer_get_handle(),
+            PURPLE_CALLBACK(file_start_cb), NULL);
+  purple_signal_connect(xfers, "file-send-start", xfer_get_handle(),
+            PURPLE_CALLBACK(file_start_cb), NULL);
+  purple_signal_connect(xfers, "file-recv-complete", xfer_get_handle(),
+            PURPLE_CALLBACK(file_complete_cb), NULL);
+  purple_signal_connect(xfers, "file-send-complete", xfer_get_handle(),
+            PURPLE_CALLBACK(file_complete_cb), NULL);
+}
+
+/*
+ * PurpleRuby.watch_incoming_file { |acc, who, filename, size| path or false }
+ *
+ * Return where to save the file, or false to reject it. Without this
+ * handler incoming files are rejected.
+ */
+static VALUE watch_incoming_file(VALUE self)
+{
+  set_callback(&incoming_file_handler, "incoming_file_handler");
+  return incoming_file_handler;
+}
+
+/*
+ * PurpleRuby.watch_file_transfer { |acc, who, filename, event, bytes, size| }
+ *
+ * event is :started, :progress (at most once a second), :done or :cancelled.
+ */
+static VALUE watch_file_transfer(VALUE self)
+{
+  set_callback(&file_transfer_handler, "file_transfer_handler");
+  return file_transfer_handler;
+}
+
+/*
+ * Account#send_file(who, path)
+ */
+static VALUE send_file(VALUE self, VALUE who, VALUE path)
+{
+  PurpleAccount *account = get_account_from_ruby_object(self);
+  PurpleConnection *gc = purple_account_get_connection(account);
+
+  if (NULL == gc) {
+    rb_raise(rb_eRuntimeError, "send_file: %s is not connected", purple_account_get_username(account));
+  }
+
+  serv_send_file(gc, StringValueCStr(who), StringValueCStr(path));
+  return Qtrue;
+}
+
+/*
+ * PurpleRuby.max_file_transfers = n
+ *
+ * Transfers moving data at the same time, the others wait. 0 is no limit.
+ */
+static VALUE set_max_file_transfers(VALUE self, VALUE n)
+{
+  max_active = NUM2UINT(n);
+  if (waiting != NULL)
+    start_waiting();
+  return n;
+}
+
+/*
+ * PurpleRuby.file_transfer_rate = bytes_per_second
+ *
+ * Cap on all transfers together. 0 is no limit.
+ */
+static VALUE set_file_transfer_rate(VALUE self, VALUE bytes)
+{
+  rate = NUM2ULL(bytes);
+  tokens = 0;
+  tokens_time = g_get_monotonic_time();
+  return bytes;
+}
+
+/* for the drain: transfers running or waiting for a slot */
+guint xfer_pending(void)
+{
+  return active + (waiting ? g_queue_get_length(waiting) : 0);
+}
+
+/*
+ * PurpleRuby.file_transfer_stats => Hash
+ */
+static VALUE file_transfer_stats(VALUE self)
+{
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, ID2SYM(rb_intern("active")), UINT2NUM(active));
+  rb_hash_aset(hash, ID2SYM(rb_intern("waiting")), UINT2NUM(waiting ? g_queue_get_length(waiting) : 0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("completed")), ULONG2NUM(completed));
+  rb_hash_aset(hash, ID2SYM(rb_intern("cancelled")), ULONG2NUM(cancelled));
+  rb_hash_aset(hash, ID2SYM(rb_intern("rejected")), ULONG2NUM(rejected));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes_received")), ULL2NUM(bytes_received));
+  rb_hash_aset(hash, ID2SYM(rb_intern("bytes_sent")), ULL2NUM(bytes_sent));
+
+  return hash;
+}
+
+void init_xfer(VALUE cPurpleRuby)
+{
+  rb_define_singleton_method(cPurpleRuby, "watch_incoming_file", watch_incoming_file, 0);
+  rb_define_singleton_method(cPurpleRuby, "watch_file_transfer", watch_file_transfer, 0);
+  rb_define_singleton_method(cPurpleRuby, "max_file_transfers=", set_max_file_transfers, 1);
+  rb_define_singleton_method(cPurpleRuby, "file_transfer_rate=", set_file_transfer_rate, 1);
+  rb_define_singleton_method(cPurpleRuby, "file_transfer_stats", file_transfer_stats, 0);
+  rb_define_method(cAccount, "send_file", send_file, 2);
+}
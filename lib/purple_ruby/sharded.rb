@@ -0,0 +1,407 @@
+#
+#Run accounts in several libpurple processes behind one IPC port.
+#
+#libpurple is single threaded, so one process uses one core. run_sharded forks
+#workers, each with its own prefs dir and libpurple instance, and assigns
+#accounts to them by consistent hashing. The parent owns the IPC port and
+#forwards every message to the worker that owns the account it is for.
+#
+#Example:
+#
+#  require 'purple_ruby'
+#  require 'purple_ruby/sharded'
+#
+#  PurpleRuby.run_sharded(:workers => 4, :accounts => configs, :ipc => ["127.0.0.1", 9877]) do |worker|
+#    #runs in every worker, register handlers as usual
+#    PurpleRuby.watch_incoming_im do |acc, sender, message|
+#      ...
+#    end
+#
+#    PurpleRuby.watch_incoming_ipc(nil, nil) do |data|
+#      protocol, user, message = data.split(",").collect{|x| x.chomp.strip}
+#      worker.account(protocol).send_im(user, message)
+#    end
+#  end
+#
+#Options:
+#  :workers     number of worker processes (default 2)
+#  :accounts    [{:protocol => , :username => , :password => }, ...]
+#  :ipc         [ip, port] the parent listens on, one message per connection as
+#               with watch_incoming_ipc. Inside workers watch_incoming_ipc does not
+#               bind, it receives the messages the parent routes to the worker.
+#  :route       lambda {|data| [protocol, username] } picks the account a message is
+#               for; a bare username works when no other protocol has it. The
+#               default reads "<protocol>,<user>,..." and spreads the users of a
+#               protocol over its accounts by hashing <user>.
+#  :on_event    lambda {|worker_index, event, username, protocol, *args| } called in the
+#               parent for :im, :signed_on, :signed_off and :connection_error
+#  :prefs_path  base directory, each worker uses <prefs_path>/worker<n>
+#  :debug       passed to PurpleRuby.init
+#  :protocols   passed to PurpleRuby.init(protocols: ...), only these protocol
+#               plugins stay loaded in the workers
+#
+
+require 'fileutils'
+require 'socket'
+require 'tmpdir'
+require 'zlib'
+
+class PurpleRuby
+  class Sharded
+    VNODES = 64
+    READ_SIZE = 65536
+    #frames queued for a peer that is not reading are dropped beyond this
+    MAX_OUTBOUND = 16 * 1024 * 1024
+    #a worker that keeps dying is restarted after 1, 2, 4, ... up to 60 seconds,
+    #and from 1 again once it has stayed up for RESPAWN_MAX
+    RESPAWN_MIN = 1
+    RESPAWN_MAX = 60
+    #the worker retries a blocked write to the parent this often
+    FLUSH_RETRY_MS = 50
+
+    class Worker
+      attr_reader :index, :accounts
+
+      def initialize index
+        @index = index
+        @accounts = []
+      end
+
+      #first account of this worker with the given protocol or username
+      def account name
+        @accounts.find {|acc| acc.username == name } || @accounts.find {|acc| acc.protocol_id == name }
+      end
+    end
+
+    def initialize options, &setup
+      @workers = options[:workers] || 2
+      @accounts = options[:accounts] || []
+      @ipc = options[:ipc]
+      @route = options[:route] || method(:default_route)
+      @on_event = options[:on_event]
+      @prefs_path = options[:prefs_path] || Dir.tmpdir
+      @debug = options[:debug] || false
+      @protocols = options[:protocols]
+      @setup = setup
+
+      raise ArgumentError, "run_sharded: no block" unless @setup
+      raise ArgumentError, "run_sharded: workers should be positive" unless @workers > 0
+
+      @ring = []
+      @workers.times do |w|
+        VNODES.times {|v| @ring << [Zlib.crc32("worker#{w}:#{v}"), w] }
+      end
+      @ring.sort!
+
+      @owners = {}
+      @accounts.each {|config| @owners[account_key(config[:protocol], config[:username])] = owner(config) }
+
+      @pids = {}
+      @sockets = {}
+      @buffers = {}
+      @outbound = {}
+      @started = {}
+      @failures = {}
+      @respawns = {}
+    end
+
+    #worker index an account is assigned to
+    def owner config
+      hash = Zlib.crc32("#{config[:protocol]}:#{config[:username]}")
+      (@ring.bsearch {|point, w| point >= hash } || @ring.first)[1]
+    end
+
+    #the same username may exist on several protocols
+    def account_key protocol, username
+      "#{protocol}/#{username}"
+    end
+
+    def default_route data
+      protocol, user = data.split(",", 3).collect {|x| x.strip }
+      configs = @accounts.select {|c| c[:protocol] == protocol }
+      return nil if configs.empty?
+      config = configs[Zlib.crc32(user.to_s) % configs.size]
+      [config[:protocol], config[:username]]
+    end
+
+    #worker index for what the route returned
+    def route_owner route
+      protocol, username = route.is_a?(Array) ? route : [nil, route]
+      if protocol.nil?
+        config = @accounts.find {|c| c[:username] == username }
+        protocol = config && config[:protocol]
+      end
+      @owners[account_key(protocol, username)]
+    end
+
+    def run
+      @listener = @ipc ? TCPServer.new(@ipc[0], @ipc[1]) : nil
+      @workers.times {|index| spawn index }
+
+      @stopping = false
+      ["INT", "TERM", "QUIT"].each {|sig| trap(sig) { @stopping = true } }
+
+      clients = {}
+      until @stopping
+        reap
+        respawn
+
+        ios = [@listener].compact + clients.keys + @sockets.values
+        writing = @sockets.values.select {|socket| !@outbound[socket].empty? }
+        ready = IO.select(ios, writing, nil, 1)
+        next unless ready
+
+        ready[1].each {|socket| flush socket }
+
+        ready[0].each do |io|
+          if io == @listener
+            begin
+              clients[io.accept_nonblock] = ""
+            rescue IO::WaitReadable, Errno::EINTR
+            end
+          elsif clients.key?(io)
+            begin
+              clients[io] << io.read_nonblock(READ_SIZE)
+            rescue IO::WaitReadable
+            rescue EOFError, SystemCallError
+              dispatch clients.delete(io)
+              io.close
+            end
+          else
+            read_events io
+          end
+        end
+      end
+
+      shutdown
+    end
+
+    private
+
+    def spawn index
+      parent_socket, child_socket = UNIXSocket.pair
+      pid = fork do
+        parent_socket.close
+        @listener.close if @listener
+        @sockets.each_value {|s| s.close }
+        run_worker index, child_socket
+        exit!(0)
+      end
+
+      child_socket.close
+      @pids[pid] = index
+      @sockets[index] = parent_socket
+      @buffers[parent_socket] = ""
+      @outbound[parent_socket] = ""
+      @started[index] = Time.now
+    end
+
+    #schedule a restart of workers that died, backing off while they keep dying
+    def reap
+      while (pid = Process.wait(-1, Process::WNOHANG))
+        index = @pids.delete(pid)
+        next unless index
+        socket = @sockets.delete(index)
+        @buffers.delete(socket)
+        @outbound.delete(socket)
+        socket.close
+
+        @failures[index] = 0 if Time.now - @started[index] >= RESPAWN_MAX
+        delay = [RESPAWN_MIN * 2 ** (@failures[index] || 0), RESPAWN_MAX].min
+        @failures[index] = (@failures[index] || 0) + 1
+        @respawns[index] = Time.now + delay
+        $stderr.puts "purple_ruby: worker #{index} (#{pid}) exited with #{$?.exitstatus.inspect}, restarting in #{delay}s"
+      end
+    rescue Errno::ECHILD
+    end
+
+    def respawn
+      now = Time.now
+      @respawns.select {|index, at| at <= now }.each_key do |index|
+        @respawns.delete(index)
+        spawn index
+      end
+    end
+
+    def shutdown
+      @listener.close if @listener
+      @pids.each_key {|pid| Process.kill("TERM", pid) rescue nil }
+      @pids.each_key {|pid| Process.wait(pid) rescue nil }
+    end
+
+    def dispatch data
+      return if data.empty?
+
+      index = route_owner(@route.call(data))
+      if index.nil?
+        $stderr.puts "purple_ruby: can not route ipc message: #{data[0, 64].inspect}"
+        return
+      end
+
+      socket = @sockets[index]
+      if socket.nil?
+        $stderr.puts "purple_ruby: worker #{index} is restarting, dropped ipc message"
+      elsif @outbound[socket].bytesize + 4 + data.bytesize > MAX_OUTBOUND
+        $stderr.puts "purple_ruby: worker #{index} is not reading, dropped ipc message"
+      else
+        @outbound[socket] << [data.bytesize].pack("N") << data
+        flush socket
+      end
+    end
+
+    #write what the worker takes without blocking, the rest waits for IO.select
+    def flush socket
+      buffer = @outbound[socket]
+      until buffer.empty?
+        written = socket.write_nonblock(buffer)
+        buffer.replace(buffer.byteslice(written, buffer.bytesize))
+      end
+    rescue IO::WaitWritable, Errno::EINTR
+    rescue SystemCallError, IOError => e
+      #reap restarts it
+      $stderr.puts "purple_ruby: worker #{@sockets.key(socket)} is gone, dropped #{buffer.bytesize} bytes of ipc messages: #{e}"
+      buffer.clear
+    end
+
+    def read_events socket
+      index = @sockets.key(socket)
+      begin
+        @buffers[socket] << socket.read_nonblock(READ_SIZE)
+      rescue IO::WaitReadable
+        return
+      rescue EOFError, SystemCallError
+        #reap restarts it
+        return
+      end
+
+      each_frame(@buffers[socket]) do |frame|
+        @on_event.call(index, *Marshal.load(frame)) if @on_event
+      end
+    end
+
+    #frames are a 4 byte length followed by the payload
+    def each_frame buffer
+      while buffer.bytesize >= 4
+        length = buffer.unpack("N").first
+        break if buffer.bytesize < 4 + length
+        frame = buffer.byteslice(4, length)
+        buffer.replace(buffer.byteslice(4 + length, buffer.bytesize))
+        yield frame
+      end
+    end
+
+    def run_worker index, socket
+      worker = Worker.new(index)
+      dir = File.join(@prefs_path, "worker#{index}")
+      FileUtils.mkdir_p dir
+
+      PurpleRuby.prefs_path = dir
+      PurpleRuby.init @debug, dir, :protocols => @protocols
+
+      handlers = capture_handlers
+      @setup.call(worker)
+      install_handlers handlers, socket
+
+      @accounts.each do |config|
+        next unless @owners[account_key(config[:protocol], config[:username])] == index
+        worker.accounts << PurpleRuby.login(config[:protocol], config[:username], config[:password])
+      end
+
+      PurpleRuby.main_loop_run
+    end
+
+    #watch_incoming_ipc must not bind inside workers, and events are forwarded
+    #to the parent when :on_event is given, so the user's blocks are captured
+    #here and installed by install_handlers
+    def capture_handlers
+      handlers = {}
+      events = [:watch_incoming_ipc]
+      events += [:watch_incoming_im, :watch_signed_on_event, :watch_signed_off_event, :watch_connection_error] if @on_event
+
+      metaclass = class << PurpleRuby; self; end
+      events.each do |name|
+        handlers[name] = [PurpleRuby.method(name), nil]
+        metaclass.send(:define_method, name) do |*args, &block|
+          raise ArgumentError, "#{name}: no block" unless block
+          handlers[name][1] = block
+        end
+      end
+
+      handlers
+    end
+
+    def install_handlers handlers, socket
+      ipc_handler = handlers[:watch_incoming_ipc][1]
+      buffer = ""
+      PurpleRuby.watch_io(socket) do |fd|
+        begin
+          buffer << socket.read_nonblock(READ_SIZE)
+        rescue IO::WaitReadable
+          next
+        rescue EOFError, SystemCallError
+          #the parent is gone
+          PurpleRuby.main_loop_stop
+          next
+        end
+        each_frame(buffer) {|data| ipc_handler.call(data) if ipc_handler }
+      end
+
+      return unless @on_event
+
+      #never block the main loop on a parent that is not reading
+      outbound = ""
+      retry_timer = nil
+      flush = lambda do
+        begin
+          until outbound.empty?
+            written = socket.write_nonblock(outbound)
+            outbound.replace(outbound.byteslice(written, outbound.bytesize))
+          end
+        rescue IO::WaitWritable, Errno::EINTR
+          retry_timer ||= PurpleRuby.timer(FLUSH_RETRY_MS) { retry_timer = nil; flush.call }
+        rescue SystemCallError, IOError
+          #the parent is gone, the reader stops the loop
+          outbound.clear
+        end
+      end
+
+      forward = lambda do |event, acc, *args|
+        payload = Marshal.dump([event, acc.username, acc.protocol_id] + args)
+        if outbound.bytesize + 4 + payload.bytesize > MAX_OUTBOUND
+          $stderr.puts "purple_ruby: dropped #{event} event, the parent is not reading"
+        else
+          outbound << [payload.bytesize].pack("N") << payload
+          flush.call
+        end
+      end
+
+      original, block = handlers[:watch_incoming_im]
+      original.call do |acc, sender, message|
+        forward.call(:im, acc, sender, message)
+        block.call(acc, sender, message) if block
+      end
+
+      original, block = handlers[:watch_signed_on_event]
+      original.call do |acc|
+        forward.call(:signed_on, acc)
+        block.call(acc) if block
+      end
+
+      original, block = handlers[:watch_signed_off_event]
+      original.call do |acc|
+        forward.call(:signed_off, acc)
+        block.call(acc) if block
+      end
+
+      original, block = handlers[:watch_connection_error]
+      original.call do |acc, type, description|
+        forward.call(:connection_error, acc, type, description)
+        block ? block.call(acc, type, description) : false
+      end
+    end
+  end
+
+  def self.run_sharded options, &setup
+    Sharded.new(options, &setup).run
+  end
+end